@@ -32,6 +32,7 @@
 #include <linux/sched/signal.h>
 #include <linux/uaccess.h>
 #include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/kern_levels.h>
 
 #include <asm/page.h>
@@ -75,8 +76,6 @@ module_param(dbg, bool, 0644);
 #define MMU_WARN_ON(x) do { } while (0)
 #endif
 
-#define PTE_PREFETCH_NUM		8
-
 #define PT_FIRST_AVAIL_BITS_SHIFT 10
 #define PT64_SECOND_AVAIL_BITS_SHIFT 52
 
@@ -141,12 +140,21 @@ module_param(dbg, bool, 0644);
 
 #define SHADOW_PT_INDEX(addr, level) PT64_INDEX(addr, level)
 
-/* make pte_list_desc fit well in cache line */
-#define PTE_LIST_EXT 3
+/* make pte_list_desc fill exactly one cache line */
+#define PTE_LIST_EXT 6
 
+/*
+ * Only the head descriptor of a chain may be partially filled; all the
+ * ones after it are full, so tail_count is fixed once a descriptor stops
+ * being the head and the length of the chain is known without a walk.
+ */
 struct pte_list_desc {
-	u64 *sptes[PTE_LIST_EXT];
 	struct pte_list_desc *more;
+	/* number of sptes in this descriptor */
+	u32 spte_count;
+	/* number of sptes in the descriptors after this one */
+	u32 tail_count;
+	u64 *sptes[PTE_LIST_EXT];
 };
 
 struct vmrun_shadow_walk_iterator {
@@ -170,7 +178,6 @@ struct vmrun_shadow_walk_iterator {
 
 static struct kmem_cache *pte_list_desc_cache;
 static struct kmem_cache *mmu_page_header_cache;
-static struct percpu_counter vmrun_total_used_mmu_pages;
 
 static u64 __read_mostly shadow_nx_mask;
 static u64 __read_mostly shadow_x_mask;	/* mutual exclusive with nx_mask */
@@ -283,8 +290,7 @@ static unsigned int vmrun_current_mmio_generation(struct vmrun_vcpu *vcpu)
 	return vmrun_vcpu_memslots(vcpu)->generation & MMIO_GEN_MASK;
 }
 
-static void mark_mmio_spte(struct vmrun_vcpu *vcpu, u64 *sptep, u64 gfn,
-			   unsigned access)
+static u64 make_mmio_spte(struct vmrun_vcpu *vcpu, u64 gfn, unsigned access)
 {
 	unsigned int gen = vmrun_current_mmio_generation(vcpu);
 	u64 mask = generation_mmio_spte_mask(gen);
@@ -292,7 +298,16 @@ static void mark_mmio_spte(struct vmrun_vcpu *vcpu, u64 *sptep, u64 gfn,
 	access &= ACC_WRITE_MASK | ACC_USER_MASK;
 	mask |= shadow_mmio_value | access | gfn << PAGE_SHIFT;
 
-	trace_mark_mmio_spte(sptep, gfn, access, gen);
+	return mask;
+}
+
+static void mark_mmio_spte(struct vmrun_vcpu *vcpu, u64 *sptep, u64 gfn,
+			   unsigned access)
+{
+	u64 mask = make_mmio_spte(vcpu, gfn, access);
+
+	trace_mark_mmio_spte(sptep, gfn, access,
+			     vmrun_current_mmio_generation(vcpu));
 	mmu_spte_set(sptep, mask);
 }
 
@@ -691,8 +706,30 @@ static bool mmu_spte_age(u64 *sptep)
 	return true;
 }
 
+/*
+ * mmu_lock is an rwlock, which cond_resched_lock() does not handle; drop
+ * and retake the write side by hand when a reschedule is due.  Returns
+ * true if the lock was dropped.
+ */
+static bool vmrun_cond_resched_mmu_lock(struct vmrun *vmrun)
+{
+	if (!need_resched())
+		return false;
+
+	write_unlock(&vmrun->mmu_lock);
+	cond_resched();
+	write_lock(&vmrun->mmu_lock);
+	return true;
+}
+
 static void walk_shadow_page_lockless_begin(struct vmrun_vcpu *vcpu)
 {
+	/*
+	 * TDP MMU page tables are freed via call_rcu() rather than after
+	 * the IPI below, so the walk must also be an RCU read-side section.
+	 */
+	rcu_read_lock();
+
 	/*
 	 * Prevent page table teardown by making any free-er wait during
 	 * vmrun_flush_remote_tlbs() IPI to all active vcpus.
@@ -715,22 +752,37 @@ static void walk_shadow_page_lockless_end(struct vmrun_vcpu *vcpu)
 	 */
 	smp_store_release(&vcpu->mode, OUTSIDE_GUEST_MODE);
 	local_irq_enable();
+	rcu_read_unlock();
 }
 
+/*
+ * A fault links at most two pages (the page table and, for shadow pages,
+ * its gfn array) per level and adds an rmap entry for each SPTE it
+ * prefetches, so the per-vCPU caches hold enough for two such faults.
+ */
+#define MMU_DESC_CACHE_CAPACITY		VMRUN_NR_MEM_OBJS
+#define MMU_PAGE_CACHE_CAPACITY		(4 * PT64_ROOT_MAX_LEVEL)
+#define MMU_HEADER_CACHE_CAPACITY	(2 * PT64_ROOT_MAX_LEVEL)
+
+/* A new shadow page needs one page-track overflow entry at most. */
+#define MMU_TRACK_CACHE_CAPACITY	MMU_HEADER_CACHE_CAPACITY
+
+/*
+ * Fill @cache up to @capacity with one bulk allocation if it holds fewer
+ * than @min objects.
+ */
 static int mmu_topup_memory_cache(struct vmrun_mmu_memory_cache *cache,
-				  struct kmem_cache *base_cache, int min)
+				  struct kmem_cache *base_cache, int min,
+				  int capacity)
 {
-	void *obj;
-
 	if (cache->nobjs >= min)
 		return 0;
-	while (cache->nobjs < ARRAY_SIZE(cache->objects)) {
-		obj = kmem_cache_zalloc(base_cache, GFP_KERNEL);
-		if (!obj)
-			return -ENOMEM;
-		cache->objects[cache->nobjs++] = obj;
-	}
-	return 0;
+
+	cache->nobjs += kmem_cache_alloc_bulk(base_cache,
+					      GFP_KERNEL | __GFP_ZERO,
+					      capacity - cache->nobjs,
+					      &cache->objects[cache->nobjs]);
+	return cache->nobjs >= min ? 0 : -ENOMEM;
 }
 
 static int mmu_memory_cache_free_objects(struct vmrun_mmu_memory_cache *cache)
@@ -746,19 +798,21 @@ static void mmu_free_memory_cache(struct vmrun_mmu_memory_cache *mc,
 }
 
 static int mmu_topup_memory_cache_page(struct vmrun_mmu_memory_cache *cache,
-				       int min)
+				       int min, int capacity)
 {
 	void *page;
 
 	if (cache->nobjs >= min)
 		return 0;
-	while (cache->nobjs < ARRAY_SIZE(cache->objects)) {
+
+	capacity = min(capacity, MMU_PAGE_CACHE_CAPACITY);
+	while (cache->nobjs < capacity) {
 		page = (void *)__get_free_page(GFP_KERNEL);
 		if (!page)
-			return -ENOMEM;
+			break;
 		cache->objects[cache->nobjs++] = page;
 	}
-	return 0;
+	return cache->nobjs >= min ? 0 : -ENOMEM;
 }
 
 static void mmu_free_memory_cache_page(struct vmrun_mmu_memory_cache *mc)
@@ -767,30 +821,160 @@ static void mmu_free_memory_cache_page(struct vmrun_mmu_memory_cache *mc)
 		free_page((unsigned long)mc->objects[--mc->nobjs]);
 }
 
+static int mmu_topup_page_track_cache(struct vmrun_mmu_memory_cache *cache,
+				      int min, int capacity)
+{
+	void *entry;
+
+	if (cache->nobjs >= min)
+		return 0;
+
+	while (cache->nobjs < capacity) {
+		entry = kzalloc(sizeof(struct vmrun_gfn_track_overflow),
+				GFP_KERNEL);
+		if (!entry)
+			break;
+		cache->objects[cache->nobjs++] = entry;
+	}
+	return cache->nobjs >= min ? 0 : -ENOMEM;
+}
+
+static void mmu_free_page_track_cache(struct vmrun_mmu_memory_cache *mc)
+{
+	while (mc->nobjs)
+		kfree(mc->objects[--mc->nobjs]);
+}
+
+static void mmu_move_memory_cache(struct vmrun_mmu_memory_cache *to,
+				  struct vmrun_mmu_memory_cache *from,
+				  int capacity)
+{
+	while (from->nobjs && to->nobjs < capacity)
+		to->objects[to->nobjs++] = from->objects[--from->nobjs];
+}
+
+/*
+ * How many objects @refill should hold so that moving them into @cache
+ * fills it up to @capacity; @cache is read racily, as the vCPU keeps
+ * taking objects from it.
+ */
+static int mmu_refill_target(struct vmrun_mmu_memory_cache *cache,
+			     int capacity)
+{
+	return max(capacity - READ_ONCE(cache->nobjs), 0);
+}
+
+/*
+ * Background refill of the vCPU caches: objects are allocated into the
+ * mmu_refill_* caches, which only this work and mmu_topup_memory_caches
+ * touch, under mmu_refill_lock.  Failures are left to the fault path.
+ */
+static void mmu_refill_memory_caches(struct work_struct *work)
+{
+	struct vmrun_vcpu *vcpu = container_of(work, struct vmrun_vcpu,
+					       mmu_refill_work);
+	int target;
+
+	mutex_lock(&vcpu->mmu_refill_lock);
+
+	target = mmu_refill_target(&vcpu->arch.mmu_pte_list_desc_cache,
+				   MMU_DESC_CACHE_CAPACITY);
+	mmu_topup_memory_cache(&vcpu->mmu_refill_desc_cache,
+			       pte_list_desc_cache, target, target);
+
+	target = mmu_refill_target(&vcpu->arch.mmu_page_cache,
+				   MMU_PAGE_CACHE_CAPACITY);
+	mmu_topup_memory_cache_page(&vcpu->mmu_refill_page_cache,
+				    target, target);
+
+	target = mmu_refill_target(&vcpu->arch.mmu_page_header_cache,
+				   MMU_HEADER_CACHE_CAPACITY);
+	mmu_topup_memory_cache(&vcpu->mmu_refill_header_cache,
+			       mmu_page_header_cache, target, target);
+
+	mutex_unlock(&vcpu->mmu_refill_lock);
+}
+
+/* Below half of the headroom above @min, refill in the background. */
+static bool mmu_memory_cache_low(struct vmrun_mmu_memory_cache *cache,
+				 int min, int capacity)
+{
+	return cache->nobjs < (min + capacity) / 2;
+}
+
+#define MMU_DESC_CACHE_MIN	(8 + PTE_PREFETCH_NUM)
+#define MMU_PAGE_CACHE_MIN	8
+#define MMU_HEADER_CACHE_MIN	4
+#define MMU_TRACK_CACHE_MIN	MMU_HEADER_CACHE_MIN
+
 static int mmu_topup_memory_caches(struct vmrun_vcpu *vcpu)
 {
 	int r;
 
+	/* Callers may sleep here, which growing the hash needs. */
+	mmu_page_hash_maybe_grow(vcpu->vmrun);
+
+	/* Take what the refill work allocated, unless it is still busy. */
+	if (mutex_trylock(&vcpu->mmu_refill_lock)) {
+		mmu_move_memory_cache(&vcpu->arch.mmu_pte_list_desc_cache,
+				      &vcpu->mmu_refill_desc_cache,
+				      MMU_DESC_CACHE_CAPACITY);
+		mmu_move_memory_cache(&vcpu->arch.mmu_page_cache,
+				      &vcpu->mmu_refill_page_cache,
+				      MMU_PAGE_CACHE_CAPACITY);
+		mmu_move_memory_cache(&vcpu->arch.mmu_page_header_cache,
+				      &vcpu->mmu_refill_header_cache,
+				      MMU_HEADER_CACHE_CAPACITY);
+		mutex_unlock(&vcpu->mmu_refill_lock);
+	}
+
 	r = mmu_topup_memory_cache(&vcpu->arch.mmu_pte_list_desc_cache,
-				   pte_list_desc_cache, 8 + PTE_PREFETCH_NUM);
+				   pte_list_desc_cache, MMU_DESC_CACHE_MIN,
+				   MMU_DESC_CACHE_CAPACITY);
 	if (r)
 		goto out;
-	r = mmu_topup_memory_cache_page(&vcpu->arch.mmu_page_cache, 8);
+	r = mmu_topup_memory_cache_page(&vcpu->arch.mmu_page_cache,
+					MMU_PAGE_CACHE_MIN,
+					MMU_PAGE_CACHE_CAPACITY);
 	if (r)
 		goto out;
 	r = mmu_topup_memory_cache(&vcpu->arch.mmu_page_header_cache,
-				   mmu_page_header_cache, 4);
+				   mmu_page_header_cache, MMU_HEADER_CACHE_MIN,
+				   MMU_HEADER_CACHE_CAPACITY);
+	if (r)
+		goto out;
+	r = mmu_topup_page_track_cache(&vcpu->mmu_page_track_cache,
+				       MMU_TRACK_CACHE_MIN,
+				       MMU_TRACK_CACHE_CAPACITY);
+	if (r)
+		goto out;
+
+	if (mmu_memory_cache_low(&vcpu->arch.mmu_pte_list_desc_cache,
+				 MMU_DESC_CACHE_MIN, MMU_DESC_CACHE_CAPACITY) ||
+	    mmu_memory_cache_low(&vcpu->arch.mmu_page_cache,
+				 MMU_PAGE_CACHE_MIN, MMU_PAGE_CACHE_CAPACITY) ||
+	    mmu_memory_cache_low(&vcpu->arch.mmu_page_header_cache,
+				 MMU_HEADER_CACHE_MIN, MMU_HEADER_CACHE_CAPACITY))
+		schedule_work(&vcpu->mmu_refill_work);
 out:
 	return r;
 }
 
 static void mmu_free_memory_caches(struct vmrun_vcpu *vcpu)
 {
+	cancel_work_sync(&vcpu->mmu_refill_work);
+
 	mmu_free_memory_cache(&vcpu->arch.mmu_pte_list_desc_cache,
 				pte_list_desc_cache);
 	mmu_free_memory_cache_page(&vcpu->arch.mmu_page_cache);
 	mmu_free_memory_cache(&vcpu->arch.mmu_page_header_cache,
 				mmu_page_header_cache);
+	mmu_free_memory_cache(&vcpu->mmu_refill_desc_cache,
+				pte_list_desc_cache);
+	mmu_free_memory_cache_page(&vcpu->mmu_refill_page_cache);
+	mmu_free_memory_cache(&vcpu->mmu_refill_header_cache,
+				mmu_page_header_cache);
+	mmu_free_page_track_cache(&vcpu->mmu_page_track_cache);
 }
 
 static void *mmu_memory_cache_alloc(struct vmrun_mmu_memory_cache *mc)
@@ -802,9 +986,10 @@ static void *mmu_memory_cache_alloc(struct vmrun_mmu_memory_cache *mc)
 	return p;
 }
 
-static struct pte_list_desc *mmu_alloc_pte_list_desc(struct vmrun_vcpu *vcpu)
+static struct pte_list_desc *
+mmu_alloc_pte_list_desc(struct vmrun_mmu_memory_cache *cache)
 {
-	return mmu_memory_cache_alloc(&vcpu->arch.mmu_pte_list_desc_cache);
+	return mmu_memory_cache_alloc(cache);
 }
 
 static void mmu_free_pte_list_desc(struct pte_list_desc *pte_list_desc)
@@ -865,23 +1050,73 @@ void vmrun_mmu_gfn_allow_lpage(struct vmrun_memory_slot *slot, gfn_t gfn)
 	update_gfn_disallow_lpage_count(slot, gfn, -1);
 }
 
-static void account_shadowed(struct vmrun *vmrun, struct vmrun_mmu_page *sp)
+/*
+ * Same as calling update_gfn_disallow_lpage_count() for each gfn in
+ * [start, start + npages), but touching each large page frame once.
+ */
+static void update_gfn_range_disallow_lpage_count(struct vmrun_memory_slot *slot,
+						  gfn_t start,
+						  unsigned long npages,
+						  int count)
+{
+	struct vmrun_lpage_info *linfo;
+	gfn_t gfn, next, end = start + npages;
+	int i;
+
+	for (i = PT_DIRECTORY_LEVEL; i <= PT_MAX_HUGEPAGE_LEVEL; ++i) {
+		for (gfn = start; gfn < end; gfn = next) {
+			next = min(end, (gfn | (VMRUN_PAGES_PER_HPAGE(i) - 1)) + 1);
+			linfo = lpage_info_slot(gfn, slot, i);
+			linfo->disallow_lpage += count * (int)(next - gfn);
+			WARN_ON(linfo->disallow_lpage < 0);
+		}
+	}
+}
+
+void vmrun_mmu_gfn_range_disallow_lpage(struct vmrun_memory_slot *slot,
+					gfn_t start, unsigned long npages)
+{
+	update_gfn_range_disallow_lpage_count(slot, start, npages, 1);
+}
+
+void vmrun_mmu_gfn_range_allow_lpage(struct vmrun_memory_slot *slot,
+				     gfn_t start, unsigned long npages)
+{
+	update_gfn_range_disallow_lpage_count(slot, start, npages, -1);
+}
+
+/*
+ * Returns an error, with nothing accounted, if the gfn of a non-leaf
+ * page could not be write tracked.
+ */
+static int account_shadowed(struct vmrun_vcpu *vcpu, struct vmrun_mmu_page *sp)
 {
+	struct vmrun *vmrun = vcpu->vmrun;
 	struct vmrun_memslots *slots;
 	struct vmrun_memory_slot *slot;
 	gfn_t gfn;
+	int r;
 
-	vmrun->arch.indirect_shadow_pages++;
 	gfn = sp->gfn;
 	slots = vmrun_memslots_for_spte_role(vmrun, sp->role);
 	slot = __gfn_to_memslot(slots, gfn);
 
-	/* the non-leaf shadow pages are keeping readonly. */
-	if (sp->role.level > PT_PAGE_TABLE_LEVEL)
-		return vmrun_slot_page_track_add_page(vmrun, slot, gfn,
-						    KVM_PAGE_TRACK_WRITE);
+	/*
+	 * the non-leaf shadow pages are keeping readonly.  The overflow
+	 * entry this may need was reserved by mmu_topup_memory_caches().
+	 */
+	if (sp->role.level > PT_PAGE_TABLE_LEVEL) {
+		r = __vmrun_slot_page_track_add_page(vmrun, slot, gfn,
+						     KVM_PAGE_TRACK_WRITE,
+						     &vcpu->mmu_page_track_cache);
+		if (WARN_ON_ONCE(r))
+			return r;
+	} else {
+		vmrun_mmu_gfn_disallow_lpage(slot, gfn);
+	}
 
-	vmrun_mmu_gfn_disallow_lpage(slot, gfn);
+	vmrun->arch.indirect_shadow_pages++;
+	return 0;
 }
 
 static void unaccount_shadowed(struct vmrun *vmrun, struct vmrun_mmu_page *sp)
@@ -940,12 +1175,18 @@ static int host_mapping_level(struct vmrun *vmrun, gfn_t gfn)
 	return ret;
 }
 
+/*
+ * A slot is dirty-logged when VMRUN_MEM_LOG_DIRTY_PAGES is set, whether
+ * writes go to the dirty ring or to dirty_bitmap; in ring mode there is
+ * no bitmap, so the flag is what must keep huge pages and prefetched
+ * SPTEs away from it.
+ */
 static inline bool memslot_valid_for_gpte(struct vmrun_memory_slot *slot,
 					  bool no_dirty_log)
 {
 	if (!slot || slot->flags & KVM_MEMSLOT_INVALID)
 		return false;
-	if (no_dirty_log && slot->dirty_bitmap)
+	if (no_dirty_log && (slot->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
 		return false;
 
 	return true;
@@ -983,7 +1224,7 @@ static int mapping_level(struct vmrun_vcpu *vcpu, gfn_t large_gfn,
 	if (host_level == PT_PAGE_TABLE_LEVEL)
 		return host_level;
 
-	max_level = min(vmrun_x86_ops->get_lpage_level(), host_level);
+	max_level = min(vmrun_get_lpage_level(), host_level);
 
 	for (level = PT_DIRECTORY_LEVEL; level <= max_level; ++level)
 		if (__mmu_gfn_lpage_is_disallowed(large_gfn, level, slot))
@@ -997,73 +1238,80 @@ static int mapping_level(struct vmrun_vcpu *vcpu, gfn_t large_gfn,
  *
  * If the bit zero of rmap_head->val is clear, then it points to the only spte
  * in this rmap chain. Otherwise, (rmap_head->val & ~1) points to a struct
- * pte_list_desc containing more mappings.
+ * pte_list_desc containing more mappings.  New descriptors are pushed at
+ * the head, so adding a mapping and counting the chain are O(1).
  */
 
 /*
  * Returns the number of pointers in the rmap chain, not counting the new one.
  */
-static int pte_list_add(struct vmrun_vcpu *vcpu, u64 *spte,
+static int pte_list_add(struct vmrun_mmu_memory_cache *cache, u64 *spte,
 			struct vmrun_rmap_head *rmap_head)
 {
 	struct pte_list_desc *desc;
-	int i, count = 0;
+	int count = 0;
 
 	if (!rmap_head->val) {
 		rmap_printk("pte_list_add: %p %llx 0->1\n", spte, *spte);
 		rmap_head->val = (unsigned long)spte;
 	} else if (!(rmap_head->val & 1)) {
 		rmap_printk("pte_list_add: %p %llx 1->many\n", spte, *spte);
-		desc = mmu_alloc_pte_list_desc(vcpu);
+		desc = mmu_alloc_pte_list_desc(cache);
 		desc->sptes[0] = (u64 *)rmap_head->val;
 		desc->sptes[1] = spte;
+		desc->spte_count = 2;
+		desc->tail_count = 0;
 		rmap_head->val = (unsigned long)desc | 1;
 		++count;
 	} else {
 		rmap_printk("pte_list_add: %p %llx many->many\n", spte, *spte);
 		desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
-		while (desc->sptes[PTE_LIST_EXT-1] && desc->more) {
-			desc = desc->more;
-			count += PTE_LIST_EXT;
-		}
-		if (desc->sptes[PTE_LIST_EXT-1]) {
-			desc->more = mmu_alloc_pte_list_desc(vcpu);
-			desc = desc->more;
+		count = desc->tail_count + desc->spte_count;
+
+		/* The old head is full, it becomes the first tail descriptor. */
+		if (desc->spte_count == PTE_LIST_EXT) {
+			desc = mmu_alloc_pte_list_desc(cache);
+			desc->more = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+			desc->spte_count = 0;
+			desc->tail_count = count;
+			rmap_head->val = (unsigned long)desc | 1;
 		}
-		for (i = 0; desc->sptes[i]; ++i)
-			++count;
-		desc->sptes[i] = spte;
+		desc->sptes[desc->spte_count++] = spte;
 	}
 	return count;
 }
 
+/*
+ * Fill the hole at @desc->sptes[@i] with the last spte of the head
+ * descriptor, which keeps the tail descriptors full, and free the head
+ * once it is empty.
+ */
 static void
 pte_list_desc_remove_entry(struct vmrun_rmap_head *rmap_head,
-			   struct pte_list_desc *desc, int i,
-			   struct pte_list_desc *prev_desc)
+			   struct pte_list_desc *desc, int i)
 {
+	struct pte_list_desc *head_desc;
 	int j;
 
-	for (j = PTE_LIST_EXT - 1; !desc->sptes[j] && j > i; --j)
-		;
-	desc->sptes[i] = desc->sptes[j];
-	desc->sptes[j] = NULL;
-	if (j != 0)
+	head_desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+	j = head_desc->spte_count - 1;
+	BUG_ON(j < 0);
+
+	desc->sptes[i] = head_desc->sptes[j];
+	head_desc->sptes[j] = NULL;
+	if (--head_desc->spte_count)
 		return;
-	if (!prev_desc && !desc->more)
-		rmap_head->val = (unsigned long)desc->sptes[0];
+
+	if (!head_desc->more)
+		rmap_head->val = 0;
 	else
-		if (prev_desc)
-			prev_desc->more = desc->more;
-		else
-			rmap_head->val = (unsigned long)desc->more | 1;
-	mmu_free_pte_list_desc(desc);
+		rmap_head->val = (unsigned long)head_desc->more | 1;
+	mmu_free_pte_list_desc(head_desc);
 }
 
 static void pte_list_remove(u64 *spte, struct vmrun_rmap_head *rmap_head)
 {
 	struct pte_list_desc *desc;
-	struct pte_list_desc *prev_desc;
 	int i;
 
 	if (!rmap_head->val) {
@@ -1079,16 +1327,14 @@ static void pte_list_remove(u64 *spte, struct vmrun_rmap_head *rmap_head)
 	} else {
 		rmap_printk("pte_list_remove:  %p many->many\n", spte);
 		desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
-		prev_desc = NULL;
 		while (desc) {
-			for (i = 0; i < PTE_LIST_EXT && desc->sptes[i]; ++i) {
+			for (i = 0; i < desc->spte_count; ++i) {
 				if (desc->sptes[i] == spte) {
 					pte_list_desc_remove_entry(rmap_head,
-							desc, i, prev_desc);
+								   desc, i);
 					return;
 				}
 			}
-			prev_desc = desc;
 			desc = desc->more;
 		}
 		pr_err("pte_list_remove: %p many->many\n", spte);
@@ -1096,6 +1342,23 @@ static void pte_list_remove(u64 *spte, struct vmrun_rmap_head *rmap_head)
 	}
 }
 
+/*
+ * Returns the spte if it is the only one in the chain, NULL otherwise.  A
+ * chain that shrank back to one entry keeps its head descriptor.
+ */
+static u64 *pte_list_single(struct vmrun_rmap_head *rmap_head)
+{
+	struct pte_list_desc *desc;
+
+	if (!(rmap_head->val & 1))
+		return (u64 *)rmap_head->val;
+
+	desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+	if (desc->spte_count != 1 || desc->more)
+		return NULL;
+	return desc->sptes[0];
+}
+
 static struct vmrun_rmap_head *__gfn_to_rmap(gfn_t gfn, int level,
 					   struct vmrun_memory_slot *slot)
 {
@@ -1124,15 +1387,22 @@ static bool rmap_can_add(struct vmrun_vcpu *vcpu)
 	return mmu_memory_cache_free_objects(cache);
 }
 
-static int rmap_add(struct vmrun_vcpu *vcpu, u64 *spte, gfn_t gfn)
+static int __rmap_add(struct vmrun *vmrun, struct vmrun_mmu_memory_cache *cache,
+		      u64 *spte, gfn_t gfn)
 {
 	struct vmrun_mmu_page *sp;
 	struct vmrun_rmap_head *rmap_head;
 
 	sp = page_header(__pa(spte));
 	vmrun_mmu_page_set_gfn(sp, spte - sp->spt, gfn);
-	rmap_head = gfn_to_rmap(vcpu->vmrun, gfn, sp);
-	return pte_list_add(vcpu, spte, rmap_head);
+	rmap_head = gfn_to_rmap(vmrun, gfn, sp);
+	return pte_list_add(cache, spte, rmap_head);
+}
+
+static int rmap_add(struct vmrun_vcpu *vcpu, u64 *spte, gfn_t gfn)
+{
+	return __rmap_add(vcpu->vmrun, &vcpu->arch.mmu_pte_list_desc_cache,
+			  spte, gfn);
 }
 
 static void rmap_remove(struct vmrun *vmrun, u64 *spte)
@@ -1196,11 +1466,10 @@ static u64 *rmap_get_next(struct rmap_iterator *iter)
 	u64 *sptep;
 
 	if (iter->desc) {
-		if (iter->pos < PTE_LIST_EXT - 1) {
+		if (iter->pos < iter->desc->spte_count - 1) {
 			++iter->pos;
 			sptep = iter->desc->sptes[iter->pos];
-			if (sptep)
-				goto out;
+			goto out;
 		}
 
 		iter->desc = iter->desc->more;
@@ -1375,6 +1644,10 @@ static void vmrun_mmu_write_protect_pt_masked(struct vmrun *vmrun,
 {
 	struct vmrun_rmap_head *rmap_head;
 
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_clear_dirty_pt_masked(vmrun, slot,
+				slot->base_gfn + gfn_offset, mask, true);
+
 	while (mask) {
 		rmap_head = __gfn_to_rmap(slot->base_gfn + gfn_offset + __ffs(mask),
 					  PT_PAGE_TABLE_LEVEL, slot);
@@ -1401,6 +1674,10 @@ void vmrun_mmu_clear_dirty_pt_masked(struct vmrun *vmrun,
 {
 	struct vmrun_rmap_head *rmap_head;
 
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_clear_dirty_pt_masked(vmrun, slot,
+				slot->base_gfn + gfn_offset, mask, false);
+
 	while (mask) {
 		rmap_head = __gfn_to_rmap(slot->base_gfn + gfn_offset + __ffs(mask),
 					  PT_PAGE_TABLE_LEVEL, slot);
@@ -1448,6 +1725,8 @@ int vmrun_arch_write_log_dirty(struct vmrun_vcpu *vcpu)
 	return 0;
 }
 
+static bool vmrun_zap_rmapp(struct vmrun *vmrun, struct vmrun_rmap_head *rmap_head);
+
 bool vmrun_mmu_slot_gfn_write_protect(struct vmrun *vmrun,
 				    struct vmrun_memory_slot *slot, u64 gfn)
 {
@@ -1455,14 +1734,50 @@ bool vmrun_mmu_slot_gfn_write_protect(struct vmrun *vmrun,
 	int i;
 	bool write_protected = false;
 
-	for (i = PT_PAGE_TABLE_LEVEL; i <= PT_MAX_HUGEPAGE_LEVEL; ++i) {
+	rmap_head = __gfn_to_rmap(gfn, PT_PAGE_TABLE_LEVEL, slot);
+	write_protected |= __rmap_write_protect(vmrun, rmap_head, true);
+
+	/*
+	 * Huge mappings covering the gfn are dropped rather than write
+	 * protected, so that the rest of a 2mb or 1gb region stays
+	 * writable: the caller has already disallowed large pages here,
+	 * so the next fault maps the region with smaller pages.
+	 */
+	for (i = PT_DIRECTORY_LEVEL; i <= PT_MAX_HUGEPAGE_LEVEL; ++i) {
 		rmap_head = __gfn_to_rmap(gfn, i, slot);
-		write_protected |= __rmap_write_protect(vmrun, rmap_head, true);
+		write_protected |= vmrun_zap_rmapp(vmrun, rmap_head);
 	}
 
+	if (vmrun->tdp_mmu_enabled)
+		write_protected |= vmrun_tdp_mmu_write_protect_gfn(vmrun, slot,
+								   gfn);
+
 	return write_protected;
 }
 
+/*
+ * Drop every mapping of @gfn, so that the next guest access to it
+ * faults.  Marking the sptes for access tracking is not enough: with
+ * A/D bits, as NPT always has, that only clears the accessed bit.
+ */
+bool vmrun_mmu_slot_gfn_zap(struct vmrun *vmrun,
+			    struct vmrun_memory_slot *slot, u64 gfn)
+{
+	struct vmrun_rmap_head *rmap_head;
+	bool zapped = false;
+	int i;
+
+	for (i = PT_PAGE_TABLE_LEVEL; i <= PT_MAX_HUGEPAGE_LEVEL; ++i) {
+		rmap_head = __gfn_to_rmap(gfn, i, slot);
+		zapped |= vmrun_zap_rmapp(vmrun, rmap_head);
+	}
+
+	if (vmrun->tdp_mmu_enabled)
+		zapped |= vmrun_tdp_mmu_zap_gfn_range(vmrun, gfn, gfn + 1);
+
+	return zapped;
+}
+
 static bool rmap_write_protect(struct vmrun_vcpu *vcpu, u64 gfn)
 {
 	struct vmrun_memory_slot *slot;
@@ -1619,16 +1934,19 @@ static int vmrun_handle_hva_range(struct vmrun *vmrun,
 {
 	struct vmrun_memslots *slots;
 	struct vmrun_memory_slot *memslot;
+	struct interval_tree_node *node;
 	struct slot_rmap_walk_iterator iterator;
 	int ret = 0;
 	int i;
 
 	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++) {
 		slots = __vmrun_memslots(vmrun, i);
-		vmrun_for_each_memslot(memslot, slots) {
+		vmrun_for_each_memslot_in_hva_range(node, slots, start, end - 1) {
 			unsigned long hva_start, hva_end;
 			gfn_t gfn_start, gfn_end;
 
+			memslot = container_of(node, struct vmrun_memory_slot,
+					       hva_node);
 			hva_start = max(start, memslot->userspace_addr);
 			hva_end = min(end, memslot->userspace_addr +
 				      (memslot->npages << PAGE_SHIFT));
@@ -1666,17 +1984,31 @@ static int vmrun_handle_hva(struct vmrun *vmrun, unsigned long hva,
 
 int vmrun_unmap_hva(struct vmrun *vmrun, unsigned long hva)
 {
-	return vmrun_handle_hva(vmrun, hva, 0, vmrun_unmap_rmapp);
+	int r;
+
+	r = vmrun_handle_hva(vmrun, hva, 0, vmrun_unmap_rmapp);
+	if (vmrun->tdp_mmu_enabled)
+		r |= vmrun_tdp_mmu_unmap_hva_range(vmrun, hva, hva + 1);
+
+	return r;
 }
 
 int vmrun_unmap_hva_range(struct vmrun *vmrun, unsigned long start, unsigned long end)
 {
-	return vmrun_handle_hva_range(vmrun, start, end, 0, vmrun_unmap_rmapp);
+	int r;
+
+	r = vmrun_handle_hva_range(vmrun, start, end, 0, vmrun_unmap_rmapp);
+	if (vmrun->tdp_mmu_enabled)
+		r |= vmrun_tdp_mmu_unmap_hva_range(vmrun, start, end);
+
+	return r;
 }
 
 void vmrun_set_spte_hva(struct vmrun *vmrun, unsigned long hva, pte_t pte)
 {
 	vmrun_handle_hva(vmrun, hva, (unsigned long)&pte, vmrun_set_pte_rmapp);
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_set_spte_hva(vmrun, hva);
 }
 
 static int vmrun_age_rmapp(struct vmrun *vmrun, struct vmrun_rmap_head *rmap_head,
@@ -1722,14 +2054,53 @@ static void rmap_recycle(struct vmrun_vcpu *vcpu, u64 *spte, gfn_t gfn)
 	vmrun_flush_remote_tlbs(vcpu->vmrun);
 }
 
+/*
+ * Shadow pages, if any, are only reachable through the rmaps, which need
+ * mmu_lock.  A page created right after the check maps a page that is
+ * young anyway.
+ */
+static bool vmrun_has_shadow_mmu_pages(struct vmrun *vmrun)
+{
+	return !list_empty_careful(&vmrun->arch.active_mmu_pages) ||
+	       !list_empty_careful(&vmrun->obsolete_mmu_pages);
+}
+
+/*
+ * Test and clear the Accessed state of [start, end).  The TDP MMU is
+ * aged without mmu_lock, so that host reclaim does not contend with
+ * guest page faults; the caller flushes TLBs if needed.
+ */
 int vmrun_age_hva(struct vmrun *vmrun, unsigned long start, unsigned long end)
 {
-	return vmrun_handle_hva_range(vmrun, start, end, 0, vmrun_age_rmapp);
+	int young = 0;
+
+	if (vmrun->tdp_mmu_enabled)
+		young = vmrun_tdp_mmu_age_hva_range(vmrun, start, end);
+
+	if (vmrun_has_shadow_mmu_pages(vmrun)) {
+		write_lock(&vmrun->mmu_lock);
+		young |= vmrun_handle_hva_range(vmrun, start, end, 0,
+						vmrun_age_rmapp);
+		write_unlock(&vmrun->mmu_lock);
+	}
+
+	return young;
 }
 
 int vmrun_test_age_hva(struct vmrun *vmrun, unsigned long hva)
 {
-	return vmrun_handle_hva(vmrun, hva, 0, vmrun_test_age_rmapp);
+	int young = 0;
+
+	if (vmrun->tdp_mmu_enabled)
+		young = vmrun_tdp_mmu_test_age_hva(vmrun, hva);
+
+	if (!young && vmrun_has_shadow_mmu_pages(vmrun)) {
+		write_lock(&vmrun->mmu_lock);
+		young = vmrun_handle_hva(vmrun, hva, 0, vmrun_test_age_rmapp);
+		write_unlock(&vmrun->mmu_lock);
+	}
+
+	return young;
 }
 
 #ifdef MMU_DEBUG
@@ -1748,16 +2119,9 @@ static int is_empty_shadow_page(u64 *spt)
 }
 #endif
 
-/*
- * This value is the sum of all of the vmrun instances's
- * vmrun->arch.n_used_mmu_pages values.  We need a global,
- * aggregate version in order to make the slab shrinker
- * faster
- */
 static inline void vmrun_mod_used_mmu_pages(struct vmrun *vmrun, int nr)
 {
 	vmrun->arch.n_used_mmu_pages += nr;
-	percpu_counter_add(&vmrun_total_used_mmu_pages, nr);
 }
 
 static void vmrun_mmu_free_page(struct vmrun_mmu_page *sp)
@@ -1771,18 +2135,64 @@ static void vmrun_mmu_free_page(struct vmrun_mmu_page *sp)
 	kmem_cache_free(mmu_page_header_cache, sp);
 }
 
-static unsigned vmrun_page_table_hashfn(gfn_t gfn)
+static struct hlist_head *mmu_page_hash_bucket(struct vmrun *vmrun, gfn_t gfn)
+{
+	return &vmrun->mmu_page_hash[hash_64(gfn, vmrun->mmu_page_hash_shift)];
+}
+
+/*
+ * Double the shadow page hash while there are more shadow pages than
+ * buckets, so that lookups keep walking chains of one or two pages.  The
+ * new table is allocated before taking mmu_lock and dropped if another
+ * vCPU resized the hash in the meantime.
+ */
+static void mmu_page_hash_maybe_grow(struct vmrun *vmrun)
 {
-	return hash_64(gfn, KVM_MMU_HASH_SHIFT);
+	unsigned int shift = READ_ONCE(vmrun->mmu_page_hash_shift);
+	struct hlist_head *hash, *old;
+	struct vmrun_mmu_page *sp;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	/* The TDP MMU does not put its pages in the hash. */
+	if (vmrun->tdp_mmu_enabled || shift >= VMRUN_MMU_HASH_MAX_SHIFT ||
+	    READ_ONCE(vmrun->arch.n_used_mmu_pages) <= (1u << shift))
+		return;
+
+	hash = kvzalloc(sizeof(*hash) << (shift + 1), GFP_KERNEL);
+	if (!hash)
+		return;
+
+	write_lock(&vmrun->mmu_lock);
+	if (vmrun->mmu_page_hash_shift != shift) {
+		write_unlock(&vmrun->mmu_lock);
+		kvfree(hash);
+		return;
+	}
+
+	old = vmrun->mmu_page_hash;
+	for (i = 0; i < (1u << shift); i++)
+		hlist_for_each_entry_safe(sp, tmp, &old[i], hash_link) {
+			hlist_del(&sp->hash_link);
+			hlist_add_head(&sp->hash_link,
+				       &hash[hash_64(sp->gfn, shift + 1)]);
+		}
+
+	vmrun->mmu_page_hash = hash;
+	vmrun->mmu_page_hash_shift = shift + 1;
+	++vmrun->stat.mmu_page_hash_resizes;
+	write_unlock(&vmrun->mmu_lock);
+
+	kvfree(old);
 }
 
-static void mmu_page_add_parent_pte(struct vmrun_vcpu *vcpu,
+static void mmu_page_add_parent_pte(struct vmrun_mmu_memory_cache *cache,
 				    struct vmrun_mmu_page *sp, u64 *parent_pte)
 {
 	if (!parent_pte)
 		return;
 
-	pte_list_add(vcpu, parent_pte, &sp->parent_ptes);
+	pte_list_add(cache, parent_pte, &sp->parent_ptes);
 }
 
 static void mmu_page_remove_parent_pte(struct vmrun_mmu_page *sp,
@@ -1798,26 +2208,35 @@ static void drop_parent_pte(struct vmrun_mmu_page *sp,
 	mmu_spte_clear_no_track(parent_pte);
 }
 
-static struct vmrun_mmu_page *vmrun_mmu_alloc_page(struct vmrun_vcpu *vcpu, int direct)
+static struct vmrun_mmu_page *
+__vmrun_mmu_alloc_page(struct vmrun *vmrun,
+		       struct vmrun_mmu_memory_cache *header_cache,
+		       struct vmrun_mmu_memory_cache *page_cache, int direct)
 {
 	struct vmrun_mmu_page *sp;
 
-	sp = mmu_memory_cache_alloc(&vcpu->arch.mmu_page_header_cache);
-	sp->spt = mmu_memory_cache_alloc(&vcpu->arch.mmu_page_cache);
+	sp = mmu_memory_cache_alloc(header_cache);
+	sp->spt = mmu_memory_cache_alloc(page_cache);
 	if (!direct)
-		sp->gfns = mmu_memory_cache_alloc(&vcpu->arch.mmu_page_cache);
+		sp->gfns = mmu_memory_cache_alloc(page_cache);
 	set_page_private(virt_to_page(sp->spt), (unsigned long)sp);
 
 	/*
-	 * The active_mmu_pages list is the FIFO list, do not move the
-	 * page until it is zapped. vmrun_zap_obsolete_pages depends on
-	 * this feature. See the comments in vmrun_zap_obsolete_pages().
+	 * New pages go to the head of active_mmu_pages, the reclaim clock
+	 * hand starts from the tail.
 	 */
-	list_add(&sp->link, &vcpu->vmrun->arch.active_mmu_pages);
-	vmrun_mod_used_mmu_pages(vcpu->vmrun, +1);
+	list_add(&sp->link, &vmrun->arch.active_mmu_pages);
+	vmrun_mod_used_mmu_pages(vmrun, +1);
 	return sp;
 }
 
+static struct vmrun_mmu_page *vmrun_mmu_alloc_page(struct vmrun_vcpu *vcpu, int direct)
+{
+	return __vmrun_mmu_alloc_page(vcpu->vmrun,
+				      &vcpu->arch.mmu_page_header_cache,
+				      &vcpu->arch.mmu_page_cache, direct);
+}
+
 static void mark_unsync(u64 *spte);
 static void vmrun_mmu_mark_parents_unsync(struct vmrun_mmu_page *sp)
 {
@@ -1957,6 +2376,8 @@ static int vmrun_mmu_prepare_zap_page(struct vmrun *vmrun, struct vmrun_mmu_page
 				    struct list_head *invalid_list);
 static void vmrun_mmu_commit_zap_page(struct vmrun *vmrun,
 				    struct list_head *invalid_list);
+static void mmu_reclaim_note_create(struct vmrun *vmrun, gfn_t gfn,
+				    union vmrun_mmu_page_role role);
 
 /*
  * NOTE: we should pay more attention on the zapped-obsolete page
@@ -1968,7 +2389,7 @@ static void vmrun_mmu_commit_zap_page(struct vmrun *vmrun,
  */
 #define for_each_valid_sp(_vmrun, _sp, _gfn)				\
 	hlist_for_each_entry(_sp,					\
-	  &(_vmrun)->arch.mmu_page_hash[vmrun_page_table_hashfn(_gfn)], hash_link) \
+	  mmu_page_hash_bucket(_vmrun, _gfn), hash_link)		\
 		if (is_obsolete_sp((_vmrun), (_sp)) || (_sp)->role.invalid) {    \
 		} else
 
@@ -2142,9 +2563,9 @@ static void mmu_sync_children(struct vmrun_vcpu *vcpu,
 			flush |= vmrun_sync_page(vcpu, sp, &invalid_list);
 			mmu_pages_clear_parents(&parents);
 		}
-		if (need_resched() || spin_needbreak(&vcpu->vmrun->mmu_lock)) {
+		if (need_resched()) {
 			vmrun_mmu_flush_or_zap(vcpu, &invalid_list, false, flush);
-			cond_resched_lock(&vcpu->vmrun->mmu_lock);
+			vmrun_cond_resched_mmu_lock(vcpu->vmrun);
 			flush = false;
 		}
 	}
@@ -2164,6 +2585,24 @@ static void clear_sp_write_flooding_count(u64 *spte)
 	__clear_sp_write_flooding_count(sp);
 }
 
+static void __vmrun_mmu_invalidate_zap_all_pages(struct vmrun *vmrun);
+
+/*
+ * @sp, a new indirect page, could not be write tracked, so the guest
+ * could change the page table it shadows unnoticed.  The caller still
+ * links it, so retire it together with every other page: the vCPUs
+ * reload their roots before they enter the guest again, and
+ * zap_obsolete_work frees it.  role.invalid hides it from lookups and
+ * keeps vmrun_mmu_prepare_zap_page() from unaccounting it.
+ */
+static void mmu_retire_untracked_page(struct vmrun *vmrun,
+				      struct vmrun_mmu_page *sp)
+{
+	sp->mmu_valid_gen = vmrun->arch.mmu_valid_gen;
+	sp->role.invalid = 1;
+	__vmrun_mmu_invalidate_zap_all_pages(vmrun);
+}
+
 static struct vmrun_mmu_page *vmrun_mmu_get_page(struct vmrun_vcpu *vcpu,
 					     gfn_t gfn,
 					     gva_t gaddr,
@@ -2218,25 +2657,30 @@ static struct vmrun_mmu_page *vmrun_mmu_get_page(struct vmrun_vcpu *vcpu,
 			vmrun_make_request(KVM_REQ_MMU_SYNC, vcpu);
 
 		__clear_sp_write_flooding_count(sp);
+		sp->referenced = true;
 		trace_vmrun_mmu_get_page(sp, false);
 		goto out;
 	}
 
 	++vcpu->vmrun->stat.mmu_cache_miss;
+	mmu_reclaim_note_create(vcpu->vmrun, gfn, role);
 
 	sp = vmrun_mmu_alloc_page(vcpu, direct);
 
 	sp->gfn = gfn;
 	sp->role = role;
-	hlist_add_head(&sp->hash_link,
-		&vcpu->vmrun->arch.mmu_page_hash[vmrun_page_table_hashfn(gfn)]);
+	hlist_add_head(&sp->hash_link, mmu_page_hash_bucket(vcpu->vmrun, gfn));
 	if (!direct) {
 		/*
 		 * we should do write protection before syncing pages
 		 * otherwise the content of the synced shadow page may
 		 * be inconsistent with guest page table.
 		 */
-		account_shadowed(vcpu->vmrun, sp);
+		if (account_shadowed(vcpu, sp)) {
+			mmu_retire_untracked_page(vcpu->vmrun, sp);
+			clear_page(sp->spt);
+			goto out;
+		}
 		if (level == PT_PAGE_TABLE_LEVEL &&
 		      rmap_write_protect(vcpu, gfn))
 			vmrun_flush_remote_tlbs(vcpu->vmrun);
@@ -2250,6 +2694,7 @@ static struct vmrun_mmu_page *vmrun_mmu_get_page(struct vmrun_vcpu *vcpu,
 
 	vmrun_mmu_flush_or_zap(vcpu, &invalid_list, false, flush);
 out:
+	vcpu->vmrun->stat.mmu_page_hash_collisions += collisions;
 	if (collisions > vcpu->vmrun->stat.max_mmu_page_hash_collisions)
 		vcpu->vmrun->stat.max_mmu_page_hash_collisions = collisions;
 	return sp;
@@ -2304,8 +2749,8 @@ static void shadow_walk_next(struct vmrun_shadow_walk_iterator *iterator)
 	return __shadow_walk_next(iterator, *iterator->sptep);
 }
 
-static void link_shadow_page(struct vmrun_vcpu *vcpu, u64 *sptep,
-			     struct vmrun_mmu_page *sp)
+static void __link_shadow_page(struct vmrun_mmu_memory_cache *cache,
+			       u64 *sptep, struct vmrun_mmu_page *sp)
 {
 	u64 spte;
 
@@ -2321,12 +2766,18 @@ static void link_shadow_page(struct vmrun_vcpu *vcpu, u64 *sptep,
 
 	mmu_spte_set(sptep, spte);
 
-	mmu_page_add_parent_pte(vcpu, sp, sptep);
+	mmu_page_add_parent_pte(cache, sp, sptep);
 
 	if (sp->unsync_children || sp->unsync)
 		mark_unsync(sptep);
 }
 
+static void link_shadow_page(struct vmrun_vcpu *vcpu, u64 *sptep,
+			     struct vmrun_mmu_page *sp)
+{
+	__link_shadow_page(&vcpu->arch.mmu_pte_list_desc_cache, sptep, sp);
+}
+
 static void validate_direct_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
 				   unsigned direct_access)
 {
@@ -2477,42 +2928,204 @@ static void vmrun_mmu_commit_zap_page(struct vmrun *vmrun,
 	}
 }
 
-static bool prepare_zap_oldest_mmu_page(struct vmrun *vmrun,
-					struct list_head *invalid_list)
-{
-	struct vmrun_mmu_page *sp;
-
-	if (list_empty(&vmrun->arch.active_mmu_pages))
-		return false;
+/*
+ * Shadow pages are reclaimed in clock order, starting from the tail of
+ * active_mmu_pages.  A page used since the hand last passed it gets a
+ * second chance and moves to the head, and active roots are never
+ * picked.  Among the unused pages of a short window, unsync pages and
+ * then the lowest level ones go first, as they are the cheapest to
+ * rebuild.  Obsolete pages are not on active_mmu_pages, see
+ * vmrun_zap_obsolete_pages().
+ */
+#define MMU_RECLAIM_WINDOW	16
 
-	sp = list_last_entry(&vmrun->arch.active_mmu_pages,
-			     struct vmrun_mmu_page, link);
-	return vmrun_mmu_prepare_zap_page(vmrun, sp, invalid_list);
-}
+/* Pages rebuilt within this many ms of their reclaim count as refaults. */
+static unsigned int reclaim_refault_ms = 100;
+module_param(reclaim_refault_ms, uint, 0644);
 
 /*
- * Changing the number of mmu pages allocated to the vm
- * Note: if goal_nr_mmu_pages is too small, you will get dead lock
+ * Whether @sp was looked up since the last call, or walked through by
+ * the hardware if its parent SPTEs have accessed bits.
  */
-void vmrun_mmu_change_mmu_pages(struct vmrun *vmrun, unsigned int goal_nr_mmu_pages)
+static bool mmu_page_test_and_clear_young(struct vmrun_mmu_page *sp)
 {
-	LIST_HEAD(invalid_list);
-
-	spin_lock(&vmrun->mmu_lock);
+	bool young = sp->referenced;
+	struct rmap_iterator iter;
+	u64 *sptep, mask;
 
-	if (vmrun->arch.n_used_mmu_pages > goal_nr_mmu_pages) {
-		/* Need to free some mmu pages to achieve the goal. */
-		while (vmrun->arch.n_used_mmu_pages > goal_nr_mmu_pages)
-			if (!prepare_zap_oldest_mmu_page(vmrun, &invalid_list))
-				break;
+	sp->referenced = false;
 
-		vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
-		goal_nr_mmu_pages = vmrun->arch.n_used_mmu_pages;
+	for_each_rmap_spte(&sp->parent_ptes, &iter, sptep) {
+		mask = spte_shadow_accessed_mask(*sptep);
+		if (mask && (*sptep & mask)) {
+			clear_bit(ffs(mask) - 1, (unsigned long *)sptep);
+			young = true;
+		}
 	}
 
-	vmrun->arch.n_max_mmu_pages = goal_nr_mmu_pages;
-
-	spin_unlock(&vmrun->mmu_lock);
+	return young;
+}
+
+/* Whether @sp should be reclaimed before @victim. */
+static bool mmu_page_better_victim(struct vmrun_mmu_page *sp,
+				   struct vmrun_mmu_page *victim)
+{
+	if (sp->unsync != victim->unsync)
+		return sp->unsync;
+	return sp->role.level < victim->role.level;
+}
+
+static struct vmrun_mmu_page *mmu_reclaim_pick_victim(struct vmrun *vmrun)
+{
+	struct list_head *head = &vmrun->arch.active_mmu_pages;
+	unsigned int nr = vmrun->arch.n_used_mmu_pages;
+	struct vmrun_mmu_page *sp, *tmp, *victim = NULL;
+	unsigned int scanned = 0, window = 0;
+
+	list_for_each_entry_safe_reverse(sp, tmp, head, link) {
+		if (scanned++ > nr)
+			break;
+
+		if (sp->root_count) {
+			list_move(&sp->link, head);
+			continue;
+		}
+
+		if (mmu_page_test_and_clear_young(sp)) {
+			list_move(&sp->link, head);
+			continue;
+		}
+
+		if (!victim || mmu_page_better_victim(sp, victim))
+			victim = sp;
+
+		if (victim->unsync || ++window == MMU_RECLAIM_WINDOW)
+			break;
+	}
+
+	return victim;
+}
+
+static void mmu_reclaim_note_zap(struct vmrun *vmrun,
+				 struct vmrun_mmu_page *sp)
+{
+	struct vmrun_mmu_reclaimed_page *r;
+
+	r = &vmrun->mmu_reclaim_history[hash_64(sp->gfn ^ sp->role.word,
+					vmrun->mmu_reclaim_history_shift)];
+	r->gfn = sp->gfn;
+	r->role = sp->role.word;
+	r->when = jiffies;
+}
+
+/* Count the pages that are rebuilt right after being reclaimed. */
+static void mmu_reclaim_note_create(struct vmrun *vmrun, gfn_t gfn,
+				    union vmrun_mmu_page_role role)
+{
+	struct vmrun_mmu_reclaimed_page *r;
+
+	r = &vmrun->mmu_reclaim_history[hash_64(gfn ^ role.word,
+					vmrun->mmu_reclaim_history_shift)];
+	if (!r->when || r->gfn != gfn || r->role != role.word)
+		return;
+
+	if (time_before(jiffies, r->when +
+			msecs_to_jiffies(READ_ONCE(reclaim_refault_ms))))
+		++vmrun->stat.mmu_reclaim_refaults;
+	r->when = 0;
+}
+
+/*
+ * Zap the first page still waiting on obsolete_mmu_pages, instead of
+ * waiting for zap_obsolete_work, which needs mmu_lock.  Returns false
+ * once the list is empty.
+ */
+static bool prepare_zap_obsolete_mmu_page(struct vmrun *vmrun,
+					  struct list_head *invalid_list)
+{
+	struct vmrun_mmu_page *sp;
+
+	while (!list_empty(&vmrun->obsolete_mmu_pages)) {
+		sp = list_first_entry(&vmrun->obsolete_mmu_pages,
+				      struct vmrun_mmu_page, link);
+
+		/* See vmrun_zap_obsolete_pages(). */
+		if (sp->role.invalid && sp->root_count) {
+			list_move(&sp->link, &vmrun->arch.active_mmu_pages);
+			continue;
+		}
+
+		vmrun_mmu_prepare_zap_page(vmrun, sp, invalid_list);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Zap one shadow page: an obsolete one if any is left, since those still
+ * count in n_used_mmu_pages, else one picked by the reclaim clock; the
+ * second scan finds a victim if every page was young.  Returns false if
+ * only active roots are left.
+ */
+static bool prepare_zap_victim_mmu_page(struct vmrun *vmrun,
+					struct list_head *invalid_list)
+{
+	struct vmrun_mmu_page *sp;
+
+	if (prepare_zap_obsolete_mmu_page(vmrun, invalid_list))
+		return true;
+
+	sp = mmu_reclaim_pick_victim(vmrun);
+	if (!sp)
+		sp = mmu_reclaim_pick_victim(vmrun);
+	if (!sp)
+		return false;
+
+	mmu_reclaim_note_zap(vmrun, sp);
+	vmrun_mmu_prepare_zap_page(vmrun, sp, invalid_list);
+	return true;
+}
+
+/*
+ * Changing the number of mmu pages allocated to the vm
+ * Note: if goal_nr_mmu_pages is too small, you will get dead lock
+ */
+void vmrun_mmu_change_mmu_pages(struct vmrun *vmrun, unsigned int goal_nr_mmu_pages)
+{
+	struct vmrun_mmu_reclaimed_page *history = NULL;
+	unsigned int shift;
+	LIST_HEAD(invalid_list);
+
+	shift = clamp_t(unsigned int, order_base_2(goal_nr_mmu_pages),
+			VMRUN_MMU_RECLAIM_HISTORY_MIN_SHIFT,
+			VMRUN_MMU_RECLAIM_HISTORY_MAX_SHIFT);
+	if (shift != READ_ONCE(vmrun->mmu_reclaim_history_shift))
+		history = kvzalloc(sizeof(*history) << shift, GFP_KERNEL);
+
+	write_lock(&vmrun->mmu_lock);
+
+	/* Keep the old history if the new one could not be allocated. */
+	if (history) {
+		swap(history, vmrun->mmu_reclaim_history);
+		vmrun->mmu_reclaim_history_shift = shift;
+	}
+
+	if (vmrun->arch.n_used_mmu_pages > goal_nr_mmu_pages) {
+		/* Need to free some mmu pages to achieve the goal. */
+		while (vmrun->arch.n_used_mmu_pages > goal_nr_mmu_pages)
+			if (!prepare_zap_victim_mmu_page(vmrun, &invalid_list))
+				break;
+
+		vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+		goal_nr_mmu_pages = vmrun->arch.n_used_mmu_pages;
+	}
+
+	vmrun->arch.n_max_mmu_pages = goal_nr_mmu_pages;
+
+	write_unlock(&vmrun->mmu_lock);
+
+	kvfree(history);
 }
 
 int vmrun_mmu_unprotect_page(struct vmrun *vmrun, gfn_t gfn)
@@ -2523,7 +3136,7 @@ int vmrun_mmu_unprotect_page(struct vmrun *vmrun, gfn_t gfn)
 
 	pgprintk("%s: looking for gfn %llx\n", __func__, gfn);
 	r = 0;
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	for_each_gfn_indirect_valid_sp(vmrun, sp, gfn) {
 		pgprintk("%s: gfn %llx role %x\n", __func__, gfn,
 			 sp->role.word);
@@ -2531,7 +3144,7 @@ int vmrun_mmu_unprotect_page(struct vmrun *vmrun, gfn_t gfn)
 		vmrun_mmu_prepare_zap_page(vmrun, sp, &invalid_list);
 	}
 	vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 
 	return r;
 }
@@ -2576,20 +3189,32 @@ static bool vmrun_is_mmio_pfn(vmrun_pfn_t pfn)
 	return true;
 }
 
-static int set_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
-		    unsigned pte_access, int level,
-		    gfn_t gfn, vmrun_pfn_t pfn, bool speculative,
-		    bool can_unsync, bool host_writable)
+/* make_spte() results */
+#define SET_SPTE_WRITE_PROTECTED_PT	BIT(0)
+#define SET_SPTE_SKIP			BIT(1)
+
+/*
+ * Compute the leaf SPTE mapping @gfn to @pfn without installing it, so that
+ * both the shadow MMU (under mmu_lock) and the TDP MMU (with cmpxchg) can
+ * share the access, memory type and dirty-tracking policy.
+ */
+static int make_spte(struct vmrun_vcpu *vcpu, unsigned pte_access, int level,
+		     gfn_t gfn, vmrun_pfn_t pfn, u64 old_spte, bool speculative,
+		     bool can_unsync, bool host_writable, bool ad_disabled,
+		     u64 *new_spte)
 {
 	u64 spte = 0;
 	int ret = 0;
-	struct vmrun_mmu_page *sp;
 
-	if (set_mmio_spte(vcpu, sptep, gfn, pfn, pte_access))
-		return 0;
+	/*
+	 * Never map an access tracked page: not when prefetching, and not
+	 * when it was tracked again after this fault stopped tracking it.
+	 * The guest refaults, and the access gets reported.
+	 */
+	if (vmrun_page_track_is_active(vcpu, gfn, VMRUN_PAGE_TRACK_ACCESS))
+		return SET_SPTE_SKIP;
 
-	sp = page_header(__pa(sptep));
-	if (sp_ad_disabled(sp))
+	if (ad_disabled)
 		spte |= shadow_acc_track_value;
 
 	/*
@@ -2634,7 +3259,7 @@ static int set_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
 		 */
 		if (level > PT_PAGE_TABLE_LEVEL &&
 		    mmu_gfn_lpage_is_disallowed(vcpu, gfn, level))
-			goto done;
+			return SET_SPTE_SKIP;
 
 		spte |= PT_WRITABLE_MASK | SPTE_MMU_WRITEABLE;
 
@@ -2644,13 +3269,13 @@ static int set_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
 		 * is responsibility of mmu_get_page / vmrun_sync_page.
 		 * Same reasoning can be applied to dirty page accounting.
 		 */
-		if (!can_unsync && is_writable_pte(*sptep))
-			goto set_pte;
+		if (!can_unsync && is_writable_pte(old_spte))
+			goto out;
 
 		if (mmu_need_write_protect(vcpu, gfn, can_unsync)) {
 			pgprintk("%s: found shadow page for %llx, marking ro\n",
 				 __func__, gfn);
-			ret = 1;
+			ret |= SET_SPTE_WRITE_PROTECTED_PT;
 			pte_access &= ~ACC_WRITE_MASK;
 			spte &= ~(PT_WRITABLE_MASK | SPTE_MMU_WRITEABLE);
 		}
@@ -2664,11 +3289,34 @@ static int set_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
 	if (speculative)
 		spte = mark_spte_for_access_track(spte);
 
-set_pte:
+out:
+	*new_spte = spte;
+	return ret;
+}
+
+static int set_spte(struct vmrun_vcpu *vcpu, u64 *sptep,
+		    unsigned pte_access, int level,
+		    gfn_t gfn, vmrun_pfn_t pfn, bool speculative,
+		    bool can_unsync, bool host_writable)
+{
+	u64 spte;
+	int ret;
+	struct vmrun_mmu_page *sp;
+
+	if (set_mmio_spte(vcpu, sptep, gfn, pfn, pte_access))
+		return 0;
+
+	sp = page_header(__pa(sptep));
+
+	ret = make_spte(vcpu, pte_access, level, gfn, pfn, *sptep, speculative,
+			can_unsync, host_writable, sp_ad_disabled(sp), &spte);
+	if (ret & SET_SPTE_SKIP)
+		return 0;
+
 	if (mmu_spte_update(sptep, spte))
 		vmrun_flush_remote_tlbs(vcpu->vmrun);
-done:
-	return ret;
+
+	return ret & SET_SPTE_WRITE_PROTECTED_PT;
 }
 
 static bool mmu_set_spte(struct vmrun_vcpu *vcpu, u64 *sptep, unsigned pte_access,
@@ -2747,14 +3395,87 @@ static vmrun_pfn_t pte_prefetch_gfn_to_pfn(struct vmrun_vcpu *vcpu, gfn_t gfn,
 	return gfn_to_pfn_memslot_atomic(slot, gfn);
 }
 
+/*
+ * Return the prefetch window of @slot for a fault on entry @index of the
+ * last-level page table @pt, after adapting it to how the guest used the
+ * previous window.
+ *
+ * The window right before the one about to be filled is sampled; for the
+ * first window of a table there is none, so the following window is used,
+ * and once the window spans the whole table the already-populated entries
+ * of the table itself are.  Present SPTEs that were accessed count as hits,
+ * present SPTEs that were never accessed were prefetched for nothing and
+ * count as misses; the faulting entry is skipped.  Speculative
+ * SPTEs are created without the accessed bit, or marked for access
+ * tracking when A/D bits are disabled, so is_accessed_spte() tells the
+ * two apart in both cases.  The balance accumulates per memslot; a full
+ * window of net hits doubles the window, half a window of net misses
+ * halves it.  Sequential touch patterns thus grow the window toward the
+ * whole page table within a few faults, sparse ones keep it small.
+ *
+ * The TDP MMU calls this with mmu_lock held for read, so updates can race;
+ * losing one only delays the adaptation.
+ */
+static unsigned int direct_pte_prefetch_window(struct vmrun_memory_slot *slot,
+					       u64 *pt, unsigned int index)
+{
+	unsigned int window = READ_ONCE(slot->arch.prefetch_window);
+	unsigned int start = index & ~(window - 1);
+	unsigned int first, last, i;
+	int hits = 0, misses = 0, score;
+	u64 spte;
+
+	if (start >= window) {
+		first = start - window;
+		last = start;
+	} else if (start + 2 * window <= PT64_ENT_PER_PAGE) {
+		first = start + window;
+		last = start + 2 * window;
+	} else {
+		first = 0;
+		last = PT64_ENT_PER_PAGE;
+	}
+
+	for (i = first; i < last; i++) {
+		if (i == index)
+			continue;
+
+		spte = READ_ONCE(pt[i]);
+		if (!is_shadow_present_pte(spte))
+			continue;
+
+		if (is_accessed_spte(spte))
+			hits++;
+		else
+			misses++;
+	}
+
+	score = READ_ONCE(slot->arch.prefetch_score) + hits - misses;
+
+	if (score >= (int)window && window < PTE_PREFETCH_MAX) {
+		window *= 2;
+		score = 0;
+	} else if (score <= -(int)(window / 2) && window > PTE_PREFETCH_NUM) {
+		window /= 2;
+		score = 0;
+	} else {
+		score = clamp(score, -(int)window, (int)window);
+	}
+
+	WRITE_ONCE(slot->arch.prefetch_window, window);
+	WRITE_ONCE(slot->arch.prefetch_score, score);
+
+	return window;
+}
+
 static int direct_pte_prefetch_many(struct vmrun_vcpu *vcpu,
 				    struct vmrun_mmu_page *sp,
 				    u64 *start, u64 *end)
 {
-	struct page *pages[PTE_PREFETCH_NUM];
+	struct page *pages[PTE_PREFETCH_BATCH];
 	struct vmrun_memory_slot *slot;
 	unsigned access = sp->role.access;
-	int i, ret;
+	int i, nr, ret;
 	gfn_t gfn;
 
 	gfn = vmrun_mmu_page_get_gfn(sp, start - sp->spt);
@@ -2762,13 +3483,27 @@ static int direct_pte_prefetch_many(struct vmrun_vcpu *vcpu,
 	if (!slot)
 		return -1;
 
-	ret = gfn_to_page_many_atomic(slot, gfn, pages, end - start);
-	if (ret <= 0)
-		return -1;
+	while (start < end) {
+		/*
+		 * Each new SPTE may need a pte_list_desc for its rmap, and
+		 * the cache was only topped up for this fault.
+		 */
+		nr = min_t(int, end - start, PTE_PREFETCH_BATCH);
+		nr = min(nr, vcpu->arch.mmu_pte_list_desc_cache.nobjs);
+		if (!nr)
+			return -1;
+
+		ret = gfn_to_page_many_atomic(slot, gfn, pages, nr);
+		if (ret <= 0)
+			return -1;
 
-	for (i = 0; i < ret; i++, gfn++, start++)
-		mmu_set_spte(vcpu, start, access, 0, sp->role.level, gfn,
-			     page_to_pfn(pages[i]), true, true);
+		for (i = 0; i < ret; i++, gfn++, start++)
+			mmu_set_spte(vcpu, start, access, 0, sp->role.level, gfn,
+				     page_to_pfn(pages[i]), true, true);
+
+		if (ret < nr)
+			return -1;
+	}
 
 	return 0;
 }
@@ -2776,15 +3511,24 @@ static int direct_pte_prefetch_many(struct vmrun_vcpu *vcpu,
 static void __direct_pte_prefetch(struct vmrun_vcpu *vcpu,
 				  struct vmrun_mmu_page *sp, u64 *sptep)
 {
+	struct vmrun_memory_slot *slot;
 	u64 *spte, *start = NULL;
+	unsigned int window;
 	int i;
 
 	WARN_ON(!sp->role.direct);
 
-	i = (sptep - sp->spt) & ~(PTE_PREFETCH_NUM - 1);
+	slot = vmrun_vcpu_gfn_to_memslot(vcpu,
+			vmrun_mmu_page_get_gfn(sp, sptep - sp->spt));
+	if (!slot)
+		return;
+
+	window = direct_pte_prefetch_window(slot, sp->spt, sptep - sp->spt);
+
+	i = (sptep - sp->spt) & ~(window - 1);
 	spte = sp->spt + i;
 
-	for (i = 0; i < PTE_PREFETCH_NUM; i++, spte++) {
+	for (i = 0; i < window; i++, spte++) {
 		if (is_shadow_present_pte(*spte) || spte == sptep) {
 			if (!start)
 				continue;
@@ -2803,13 +3547,10 @@ static void direct_pte_prefetch(struct vmrun_vcpu *vcpu, u64 *sptep)
 	sp = page_header(__pa(sptep));
 
 	/*
-	 * Without accessed bits, there's no way to distinguish between
-	 * actually accessed translations and prefetched, so disable pte
-	 * prefetch if accessed bits aren't available.
+	 * Prefetching is fine without accessed bits too: speculative SPTEs
+	 * are then marked for access tracking, so aging still tells them
+	 * apart from the translations the guest actually used.
 	 */
-	if (sp_ad_disabled(sp))
-		return;
-
 	if (sp->role.level > PT_PAGE_TABLE_LEVEL)
 		return;
 
@@ -2852,105 +3593,1529 @@ static int __direct_map(struct vmrun_vcpu *vcpu, int write, int map_writable,
 	return emulate;
 }
 
-static void vmrun_send_hwpoison_signal(unsigned long address, struct task_struct *tsk)
+/*
+ * The SPTE for entry @index of a page table at @child_level that replaces
+ * the huge leaf @huge_spte, mapping the same memory with the same access.
+ */
+static u64 make_huge_page_split_spte(u64 huge_spte, int child_level,
+				     int index)
 {
-	siginfo_t info;
+	u64 child_spte = huge_spte;
 
-	info.si_signo	= SIGBUS;
-	info.si_errno	= 0;
-	info.si_code	= BUS_MCEERR_AR;
-	info.si_addr	= (void __user *)address;
-	info.si_addr_lsb = PAGE_SHIFT;
+	child_spte |= (u64)(index * VMRUN_PAGES_PER_HPAGE(child_level))
+			<< PAGE_SHIFT;
 
-	send_sig_info(SIGBUS, &info, tsk);
+	if (child_level == PT_PAGE_TABLE_LEVEL)
+		child_spte &= ~PT_PAGE_SIZE_MASK;
+
+	return child_spte;
 }
 
-static int vmrun_handle_bad_page(struct vmrun_vcpu *vcpu, gfn_t gfn, vmrun_pfn_t pfn)
+static bool mmu_split_caches_short(struct vmrun *vmrun, int descs)
 {
-	/*
-	 * Do not cache the mmio info caused by writing the readonly gfn
-	 * into the spte otherwise read access on readonly gfn also can
-	 * caused mmio page fault and treat it as mmio access.
-	 * Return 1 to tell vmrun to emulate it.
-	 */
-	if (pfn == KVM_PFN_ERR_RO_FAULT)
-		return 1;
-
-	if (pfn == KVM_PFN_ERR_HWPOISON) {
-		vmrun_send_hwpoison_signal(vmrun_vcpu_gfn_to_hva(vcpu, gfn), current);
-		return 0;
-	}
-
-	return -EFAULT;
+	return vmrun->split_page_header_cache.nobjs < 1 ||
+	       vmrun->split_page_cache.nobjs < 1 ||
+	       vmrun->split_desc_cache.nobjs < descs;
 }
 
-static void transparent_hugepage_adjust(struct vmrun_vcpu *vcpu,
-					gfn_t *gfnp, vmrun_pfn_t *pfnp,
-					int *levelp)
+/*
+ * Refill the eager split caches, with room for @descs pte_list_desc.
+ * Called with mmu_lock held for write, which is dropped around the
+ * allocations; the caches are filled to capacity, so this happens once
+ * every few dozen splits.
+ */
+static int mmu_topup_split_caches(struct vmrun *vmrun, int descs)
 {
-	vmrun_pfn_t pfn = *pfnp;
-	gfn_t gfn = *gfnp;
-	int level = *levelp;
+	int r;
 
-	/*
-	 * Check if it's a transparent hugepage. If this would be an
-	 * hugetlbfs page, level wouldn't be set to
-	 * PT_PAGE_TABLE_LEVEL and there would be no adjustment done
-	 * here.
-	 */
-	if (!is_error_noslot_pfn(pfn) && !vmrun_is_reserved_pfn(pfn) &&
-	    level == PT_PAGE_TABLE_LEVEL &&
-	    PageTransCompoundMap(pfn_to_page(pfn)) &&
-	    !mmu_gfn_lpage_is_disallowed(vcpu, gfn, PT_DIRECTORY_LEVEL)) {
-		unsigned long mask;
-		/*
-		 * mmu_notifier_retry was successful and we hold the
-		 * mmu_lock here, so the pmd can't become splitting
-		 * from under us, and in turn
-		 * __split_huge_page_refcount() can't run from under
-		 * us and we can safely transfer the refcount from
-		 * PG_tail to PG_head as we switch the pfn to tail to
-		 * head.
-		 */
-		*levelp = level = PT_DIRECTORY_LEVEL;
-		mask = KVM_PAGES_PER_HPAGE(level) - 1;
-		VM_BUG_ON((gfn & mask) != (pfn & mask));
-		if (pfn & mask) {
-			gfn &= ~mask;
-			*gfnp = gfn;
-			vmrun_release_pfn_clean(pfn);
-			pfn &= ~mask;
-			vmrun_get_pfn(pfn);
-			*pfnp = pfn;
-		}
-	}
-}
+	write_unlock(&vmrun->mmu_lock);
+	cond_resched();
 
-static bool handle_abnormal_pfn(struct vmrun_vcpu *vcpu, gva_t gva, gfn_t gfn,
-				vmrun_pfn_t pfn, unsigned access, int *ret_val)
-{
-	/* The pfn is invalid, report the error! */
-	if (unlikely(is_error_pfn(pfn))) {
-		*ret_val = vmrun_handle_bad_page(vcpu, gfn, pfn);
-		return true;
-	}
+	r = mmu_topup_memory_cache(&vmrun->split_page_header_cache,
+				   mmu_page_header_cache, 1,
+				   MMU_HEADER_CACHE_CAPACITY);
+	if (!r)
+		r = mmu_topup_memory_cache_page(&vmrun->split_page_cache, 1,
+						MMU_PAGE_CACHE_CAPACITY);
+	if (!r)
+		r = mmu_topup_memory_cache(&vmrun->split_desc_cache,
+					   pte_list_desc_cache, descs,
+					   MMU_DESC_CACHE_CAPACITY);
 
-	if (unlikely(is_noslot_pfn(pfn)))
-		vcpu_cache_mmio_info(vcpu, gva, gfn, access);
+	write_lock(&vmrun->mmu_lock);
+	return r;
+}
 
-	return false;
+static void mmu_free_split_caches(struct vmrun *vmrun)
+{
+	mmu_free_memory_cache(&vmrun->split_page_header_cache,
+			      mmu_page_header_cache);
+	mmu_free_memory_cache_page(&vmrun->split_page_cache);
+	mmu_free_memory_cache(&vmrun->split_desc_cache, pte_list_desc_cache);
 }
 
-static bool page_fault_can_be_fast(u32 error_code)
+/*
+ * Whether the host backs @pfn, aligned to a huge page at @level, with a
+ * page at least that large, so that it may be mapped by a huge SPTE.
+ */
+static bool host_pfn_is_huge(vmrun_pfn_t pfn, int level)
 {
-	/*
-	 * Do not fix the mmio spte with invalid generation number which
-	 * need to be updated by slow page fault path.
-	 */
-	if (unlikely(error_code & PFERR_RSVD_MASK))
+	struct page *page;
+
+	if (vmrun_is_reserved_pfn(pfn))
 		return false;
 
-	/* See if the page fault is due to an NX violation */
+	page = pfn_to_page(pfn);
+	if (level == PT_DIRECTORY_LEVEL && PageTransCompoundMap(page))
+		return true;
+
+	return PageHuge(page) &&
+	       (PAGE_SIZE << compound_order(compound_head(page))) >=
+			VMRUN_HPAGE_SIZE(level);
+}
+
+/*
+ * Build the huge SPTE at @level that can replace the page table @spt:
+ * all of its entries must be present leaves with the same attributes,
+ * mapping physically contiguous memory aligned to the huge page.  The
+ * accessed and dirty bits of the entries are merged, and the huge SPTE
+ * is writable only if all of them are: dirty logging and write tracking
+ * leave entries write-protected one by one.  SPTE_MMU_WRITEABLE is kept
+ * as it is, so fast page fault can still make it writable later.
+ */
+static bool make_huge_spte_from_table(u64 *spt, int level, u64 *huge_spte)
+{
+	u64 merge_mask = shadow_accessed_mask | shadow_dirty_mask |
+			 PT_WRITABLE_MASK;
+	u64 first = READ_ONCE(spt[0]);
+	vmrun_pfn_t pfn = spte_to_pfn(first);
+	u64 writable = PT_WRITABLE_MASK;
+	int child_level = level - 1;
+	u64 attr, ad = 0, spte;
+	int i;
+
+	if (!is_shadow_present_pte(first) || is_access_track_spte(first) ||
+	    (pfn & (VMRUN_PAGES_PER_HPAGE(level) - 1)))
+		return false;
+
+	attr = first & ~(PT64_BASE_ADDR_MASK | merge_mask);
+
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		spte = READ_ONCE(spt[i]);
+
+		if (!is_shadow_present_pte(spte) ||
+		    !is_last_spte(spte, child_level) ||
+		    is_access_track_spte(spte) ||
+		    (spte & ~(PT64_BASE_ADDR_MASK | merge_mask)) != attr ||
+		    spte_to_pfn(spte) !=
+			pfn + i * VMRUN_PAGES_PER_HPAGE(child_level))
+			return false;
+
+		ad |= spte & (shadow_accessed_mask | shadow_dirty_mask);
+		writable &= spte;
+	}
+
+	*huge_spte = attr | ad | writable | ((u64)pfn << PAGE_SHIFT) |
+		     PT_PAGE_SIZE_MASK;
+	return true;
+}
+
+/*
+ * TDP MMU
+ *
+ * With two-dimensional paging every vCPU of an address space maps the
+ * same GPA space, so the TDP MMU keeps one root per role and lets vCPUs
+ * populate it concurrently with mmu_lock held for read.  Non-leaf and
+ * leaf SPTEs are installed with cmpxchg64; a vCPU that loses the race
+ * gives its page back and lets the guest refault.  Page-table pages that
+ * are detached by a zap are freed only after an RCU grace period, so
+ * faulting vCPUs and lockless walkers can keep walking them.  Zaps,
+ * memslot updates and MMU notifier invalidations still take mmu_lock
+ * for write.
+ *
+ * TDP MMU pages are not hashed, have no parent_ptes and do not put their
+ * leaf SPTEs in the rmaps; the slot and hva based operations below walk
+ * the roots instead.  Memslot ids do not encode the address space, so
+ * slot based operations visit the roots of both; the extra write
+ * protection or zap on the other one is harmless.
+ */
+static bool __read_mostly tdp_mmu_enabled = true;
+module_param_named(tdp_mmu, tdp_mmu_enabled, bool, 0444);
+
+struct tdp_iter {
+	/* The gfn the walk is heading for, at the lowest level */
+	gfn_t next_last_level_gfn;
+	/* next_last_level_gfn when the walk last yielded mmu_lock */
+	gfn_t yielded_gfn;
+	/* Pointers to the page tables traversed to reach the current SPTE */
+	u64 *pt_path[PT64_ROOT_5LEVEL];
+	u64 *sptep;
+	/* The lowest gfn mapped by the current SPTE */
+	gfn_t gfn;
+	int root_level;
+	int min_level;
+	int level;
+	/* A snapshot of *sptep, refreshed whenever the walk moves */
+	u64 old_spte;
+	bool valid;
+};
+
+static gfn_t tdp_round_gfn_for_level(gfn_t gfn, int level)
+{
+	return gfn & -VMRUN_PAGES_PER_HPAGE(level);
+}
+
+static u64 *tdp_spte_to_child_pt(u64 spte, int level)
+{
+	if (!is_shadow_present_pte(spte) || is_last_spte(spte, level))
+		return NULL;
+
+	return __va(spte & PT64_BASE_ADDR_MASK);
+}
+
+static void tdp_iter_refresh_sptep(struct tdp_iter *iter)
+{
+	iter->sptep = iter->pt_path[iter->level - 1] +
+		SHADOW_PT_INDEX(iter->gfn << PAGE_SHIFT, iter->level);
+	iter->old_spte = READ_ONCE(*iter->sptep);
+}
+
+static void tdp_iter_start(struct tdp_iter *iter, u64 *root_pt, int root_level,
+			   int min_level, gfn_t next_last_level_gfn)
+{
+	iter->next_last_level_gfn = next_last_level_gfn;
+	iter->yielded_gfn = next_last_level_gfn;
+	iter->root_level = root_level;
+	iter->min_level = min_level;
+	iter->level = root_level;
+	iter->pt_path[iter->level - 1] = root_pt;
+
+	iter->gfn = tdp_round_gfn_for_level(next_last_level_gfn, iter->level);
+	tdp_iter_refresh_sptep(iter);
+
+	iter->valid = true;
+}
+
+/*
+ * Restart the walk from the root, towards the gfn it had reached.  Used
+ * after mmu_lock was dropped, since the paging structure may have
+ * changed underneath the iterator.
+ */
+static void tdp_iter_restart(struct tdp_iter *iter)
+{
+	iter->yielded_gfn = iter->next_last_level_gfn;
+	iter->level = iter->root_level;
+
+	iter->gfn = tdp_round_gfn_for_level(iter->next_last_level_gfn,
+					    iter->level);
+	tdp_iter_refresh_sptep(iter);
+
+	iter->valid = true;
+}
+
+static bool tdp_iter_step_down(struct tdp_iter *iter)
+{
+	u64 *child_pt;
+
+	if (iter->level == iter->min_level)
+		return false;
+
+	/*
+	 * Reread the SPTE before stepping down to avoid traversing into a
+	 * page table that is no longer linked from this entry.
+	 */
+	iter->old_spte = READ_ONCE(*iter->sptep);
+
+	child_pt = tdp_spte_to_child_pt(iter->old_spte, iter->level);
+	if (!child_pt)
+		return false;
+
+	iter->level--;
+	iter->pt_path[iter->level - 1] = child_pt;
+	iter->gfn = tdp_round_gfn_for_level(iter->next_last_level_gfn,
+					    iter->level);
+	tdp_iter_refresh_sptep(iter);
+
+	return true;
+}
+
+static bool tdp_iter_step_side(struct tdp_iter *iter)
+{
+	/* Already at the last entry of the current page table? */
+	if (SHADOW_PT_INDEX(iter->gfn << PAGE_SHIFT, iter->level) ==
+	    (PT64_ENT_PER_PAGE - 1))
+		return false;
+
+	iter->gfn += VMRUN_PAGES_PER_HPAGE(iter->level);
+	iter->next_last_level_gfn = iter->gfn;
+	iter->sptep++;
+	iter->old_spte = READ_ONCE(*iter->sptep);
+
+	return true;
+}
+
+static bool tdp_iter_step_up(struct tdp_iter *iter)
+{
+	if (iter->level == iter->root_level)
+		return false;
+
+	iter->level++;
+	iter->gfn = tdp_round_gfn_for_level(iter->gfn, iter->level);
+	tdp_iter_refresh_sptep(iter);
+
+	return true;
+}
+
+/*
+ * Pre-order traversal: go down if the current SPTE points to a page
+ * table, otherwise to the next entry, climbing up as page tables are
+ * exhausted.
+ */
+static void tdp_iter_next(struct tdp_iter *iter)
+{
+	if (tdp_iter_step_down(iter))
+		return;
+
+	do {
+		if (tdp_iter_step_side(iter))
+			return;
+	} while (tdp_iter_step_up(iter));
+
+	iter->valid = false;
+}
+
+#define for_each_tdp_pte_min_level(_iter, _root, _min_level, _start, _end) \
+	for (tdp_iter_start(&(_iter), (_root)->spt, (_root)->role.level,    \
+			    _min_level, _start);			     \
+	     (_iter).valid && (_iter).gfn < (_end);			     \
+	     tdp_iter_next(&(_iter)))
+
+#define for_each_tdp_pte(_iter, _root, _start, _end)			     \
+	for_each_tdp_pte_min_level(_iter, _root, PT_PAGE_TABLE_LEVEL,	     \
+				   _start, _end)
+
+static gfn_t tdp_mmu_max_gfn(struct vmrun_mmu_page *root)
+{
+	return VMRUN_PAGES_PER_HPAGE(root->role.level + 1);
+}
+
+static int tdp_mmu_root_as_id(struct vmrun_mmu_page *root)
+{
+	return root->role.smm ? 1 : 0;
+}
+
+static struct vmrun_mmu_page *
+__tdp_mmu_alloc_sp(struct vmrun_mmu_memory_cache *header_cache,
+		   struct vmrun_mmu_memory_cache *page_cache, gfn_t gfn,
+		   union vmrun_mmu_page_role role)
+{
+	struct vmrun_mmu_page *sp;
+
+	sp = mmu_memory_cache_alloc(header_cache);
+	sp->spt = mmu_memory_cache_alloc(page_cache);
+	set_page_private(virt_to_page(sp->spt), (unsigned long)sp);
+	clear_page(sp->spt);
+
+	sp->role = role;
+	sp->gfn = gfn;
+	sp->tdp_mmu_page = true;
+
+	return sp;
+}
+
+static struct vmrun_mmu_page *tdp_mmu_alloc_sp(struct vmrun_vcpu *vcpu,
+					       gfn_t gfn,
+					       union vmrun_mmu_page_role role)
+{
+	return __tdp_mmu_alloc_sp(&vcpu->arch.mmu_page_header_cache,
+				  &vcpu->arch.mmu_page_cache, gfn, role);
+}
+
+/* The SPTE linking @sp into its parent, see link_shadow_page(). */
+static u64 tdp_mmu_make_nonleaf_spte(struct vmrun_mmu_page *sp)
+{
+	u64 spte;
+
+	spte = __pa(sp->spt) | shadow_present_mask | PT_WRITABLE_MASK |
+	       shadow_user_mask | shadow_x_mask | shadow_me_mask;
+
+	if (sp_ad_disabled(sp))
+		spte |= shadow_acc_track_value;
+	else
+		spte |= shadow_accessed_mask;
+
+	return spte;
+}
+
+static void tdp_mmu_mod_pages(struct vmrun *vmrun, int nr)
+{
+	vmrun_mod_used_mmu_pages(vmrun, nr);
+	vmrun->n_tdp_mmu_pages += nr;
+}
+
+static void tdp_mmu_free_sp(struct vmrun_mmu_page *sp)
+{
+	free_page((unsigned long)sp->spt);
+	kmem_cache_free(mmu_page_header_cache, sp);
+}
+
+static void tdp_mmu_free_sp_rcu_callback(struct rcu_head *head)
+{
+	struct vmrun_mmu_page *sp = container_of(head, struct vmrun_mmu_page,
+						 rcu_head);
+
+	tdp_mmu_free_sp(sp);
+}
+
+/* Called with mmu_lock held for read or write. */
+static void tdp_mmu_link_sp(struct vmrun *vmrun, struct vmrun_mmu_page *sp)
+{
+	spin_lock(&vmrun->tdp_mmu_pages_lock);
+	list_add(&sp->link, &vmrun->tdp_mmu_pages);
+	tdp_mmu_mod_pages(vmrun, +1);
+	spin_unlock(&vmrun->tdp_mmu_pages_lock);
+}
+
+static void tdp_mmu_unlink_sp(struct vmrun *vmrun, struct vmrun_mmu_page *sp)
+{
+	spin_lock(&vmrun->tdp_mmu_pages_lock);
+	list_del(&sp->link);
+	tdp_mmu_mod_pages(vmrun, -1);
+	spin_unlock(&vmrun->tdp_mmu_pages_lock);
+}
+
+static void handle_changed_spte(struct vmrun *vmrun, gfn_t gfn, u64 old_spte,
+				u64 new_spte, int level, bool record_acc_track);
+
+/*
+ * A page table was unlinked from the paging structure: clear its entries,
+ * propagate the A/D state of the leaves it held and free it once no
+ * walker can reach it anymore.  mmu_lock must be held for write; the
+ * caller flushes TLBs before leaving its RCU read-side section.
+ */
+static void handle_removed_tdp_mmu_page(struct vmrun *vmrun, u64 *pt)
+{
+	struct vmrun_mmu_page *sp = page_header(__pa(pt));
+	int level = sp->role.level;
+	gfn_t base_gfn = sp->gfn;
+	u64 old_spte;
+	int i;
+
+	tdp_mmu_unlink_sp(vmrun, sp);
+
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		/* Lockless writers (fast_page_fault) may still race here. */
+		old_spte = xchg(pt + i, 0ull);
+		handle_changed_spte(vmrun,
+			base_gfn + i * VMRUN_PAGES_PER_HPAGE(level),
+			old_spte, 0, level, true);
+	}
+
+	call_rcu(&sp->rcu_head, tdp_mmu_free_sp_rcu_callback);
+}
+
+static void handle_changed_spte(struct vmrun *vmrun, gfn_t gfn, u64 old_spte,
+				u64 new_spte, int level, bool record_acc_track)
+{
+	bool was_present = is_shadow_present_pte(old_spte);
+	bool is_present = is_shadow_present_pte(new_spte);
+	bool was_leaf = was_present && is_last_spte(old_spte, level);
+	bool pfn_changed = spte_to_pfn(old_spte) != spte_to_pfn(new_spte);
+
+	if (old_spte == new_spte)
+		return;
+
+	if (was_leaf) {
+		if (record_acc_track && is_accessed_spte(old_spte) &&
+		    (!is_present || !is_accessed_spte(new_spte) || pfn_changed))
+			vmrun_set_pfn_accessed(spte_to_pfn(old_spte));
+
+		if (is_dirty_spte(old_spte) &&
+		    (!is_present || !is_dirty_spte(new_spte) || pfn_changed))
+			vmrun_set_pfn_dirty(spte_to_pfn(old_spte));
+	}
+
+	if (was_present && !was_leaf && (!is_present || pfn_changed))
+		handle_removed_tdp_mmu_page(vmrun,
+				tdp_spte_to_child_pt(old_spte, level));
+}
+
+/*
+ * Install @new_spte with mmu_lock held for read.  Fails, refreshing
+ * iter->old_spte, if another vCPU changed the SPTE first.  Must not be
+ * used to remove a page table, which needs mmu_lock held for write.
+ */
+static bool tdp_mmu_set_spte_atomic(struct vmrun *vmrun, struct tdp_iter *iter,
+				    u64 new_spte)
+{
+	u64 old_spte;
+
+	WARN_ON_ONCE(tdp_spte_to_child_pt(iter->old_spte, iter->level));
+
+	old_spte = cmpxchg64(iter->sptep, iter->old_spte, new_spte);
+	if (old_spte != iter->old_spte) {
+		iter->old_spte = old_spte;
+		return false;
+	}
+
+	handle_changed_spte(vmrun, iter->gfn, old_spte, new_spte, iter->level,
+			    true);
+	iter->old_spte = new_spte;
+	return true;
+}
+
+/* Change an SPTE with mmu_lock held for write. */
+static void __tdp_mmu_set_spte(struct vmrun *vmrun, struct tdp_iter *iter,
+			       u64 new_spte, bool record_acc_track)
+{
+	u64 old_spte = xchg(iter->sptep, new_spte);
+
+	handle_changed_spte(vmrun, iter->gfn, old_spte, new_spte, iter->level,
+			    record_acc_track);
+	iter->old_spte = new_spte;
+}
+
+static void tdp_mmu_set_spte(struct vmrun *vmrun, struct tdp_iter *iter,
+			     u64 new_spte)
+{
+	__tdp_mmu_set_spte(vmrun, iter, new_spte, true);
+}
+
+/*
+ * Yield mmu_lock (held for write) if a reschedule is due and the walk has
+ * made progress since it last yielded.  Pending TLB flushes are done first,
+ * both because the flush would otherwise be lost and because page tables
+ * freed by the walk may be reused as soon as the RCU section ends.
+ */
+static bool tdp_mmu_iter_cond_resched(struct vmrun *vmrun,
+				      struct tdp_iter *iter, bool flush)
+{
+	if (iter->next_last_level_gfn == iter->yielded_gfn)
+		return false;
+
+	if (!need_resched())
+		return false;
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	rcu_read_unlock();
+	vmrun_cond_resched_mmu_lock(vmrun);
+	rcu_read_lock();
+
+	tdp_iter_restart(iter);
+	return true;
+}
+
+static void tdp_mmu_get_root(struct vmrun_mmu_page *root)
+{
+	++root->root_count;
+}
+
+static bool zap_gfn_range(struct vmrun *vmrun, struct vmrun_mmu_page *root,
+			  gfn_t start, gfn_t end, bool can_yield);
+
+/* Drop a reference to @root; called with mmu_lock held for write. */
+void vmrun_tdp_mmu_put_root(struct vmrun *vmrun, struct vmrun_mmu_page *root)
+{
+	WARN_ON(root->root_count <= 0);
+
+	if (--root->root_count)
+		return;
+
+	list_del_rcu(&root->link);
+	zap_gfn_range(vmrun, root, 0, tdp_mmu_max_gfn(root), false);
+	tdp_mmu_mod_pages(vmrun, -1);
+
+	call_rcu(&root->rcu_head, tdp_mmu_free_sp_rcu_callback);
+}
+
+/*
+ * Return the root after @prev, holding a reference to it, and drop the
+ * reference to @prev.  Lets a walk over all roots yield mmu_lock without
+ * the current root going away under it.
+ */
+static struct vmrun_mmu_page *tdp_mmu_next_root(struct vmrun *vmrun,
+						struct vmrun_mmu_page *prev)
+{
+	struct vmrun_mmu_page *next;
+
+	if (prev)
+		next = list_next_entry(prev, link);
+	else
+		next = list_first_entry(&vmrun->tdp_mmu_roots,
+					struct vmrun_mmu_page, link);
+
+	if (&next->link == &vmrun->tdp_mmu_roots)
+		next = NULL;
+	else
+		tdp_mmu_get_root(next);
+
+	if (prev)
+		vmrun_tdp_mmu_put_root(vmrun, prev);
+
+	return next;
+}
+
+/* The loop body must not break out, or a root reference is leaked. */
+#define for_each_tdp_mmu_root_yield_safe(_vmrun, _root)			\
+	for (_root = tdp_mmu_next_root(_vmrun, NULL);			\
+	     _root;							\
+	     _root = tdp_mmu_next_root(_vmrun, _root))
+
+#define for_each_tdp_mmu_root(_vmrun, _root)				\
+	list_for_each_entry(_root, &(_vmrun)->tdp_mmu_roots, link)
+
+/*
+ * Roots are added and removed with mmu_lock held for write and freed
+ * after an RCU grace period, so they can also be walked without
+ * mmu_lock inside an RCU read-side section.
+ */
+#define for_each_tdp_mmu_root_rcu(_vmrun, _root)			\
+	list_for_each_entry_rcu(_root, &(_vmrun)->tdp_mmu_roots, link)
+
+hpa_t vmrun_tdp_mmu_get_vcpu_root_hpa(struct vmrun_vcpu *vcpu)
+{
+	struct vmrun *vmrun = vcpu->vmrun;
+	union vmrun_mmu_page_role role;
+	struct vmrun_mmu_page *root;
+
+	role = vcpu->arch.mmu.base_role;
+	role.level = vcpu->arch.mmu.shadow_root_level;
+	role.direct = 1;
+	role.access = ACC_ALL;
+
+	write_lock(&vmrun->mmu_lock);
+
+	/* All vCPUs with the same role share a root. */
+	for_each_tdp_mmu_root(vmrun, root) {
+		if (root->role.word == role.word) {
+			tdp_mmu_get_root(root);
+			goto out;
+		}
+	}
+
+	root = tdp_mmu_alloc_sp(vcpu, 0, role);
+	root->root_count = 1;
+	list_add_rcu(&root->link, &vmrun->tdp_mmu_roots);
+	tdp_mmu_mod_pages(vmrun, +1);
+
+out:
+	write_unlock(&vmrun->mmu_lock);
+	return __pa(root->spt);
+}
+
+/*
+ * Zap the SPTEs mapping [start, end) under @root.  mmu_lock must be held
+ * for write.  Page tables freed here are only released after the TLB
+ * flush, which is done before the RCU read-side section ends.
+ */
+static bool zap_gfn_range(struct vmrun *vmrun, struct vmrun_mmu_page *root,
+			  gfn_t start, gfn_t end, bool can_yield)
+{
+	struct tdp_iter iter;
+	bool flush = false;
+	bool zapped = false;
+
+	rcu_read_lock();
+
+	for_each_tdp_pte(iter, root, start, end) {
+		if (can_yield &&
+		    tdp_mmu_iter_cond_resched(vmrun, &iter, flush)) {
+			flush = false;
+			continue;
+		}
+
+		if (!is_shadow_present_pte(iter.old_spte))
+			continue;
+
+		/*
+		 * A page table that covers more than the range is not zapped
+		 * as a whole; the walk descends and zaps its entries instead.
+		 */
+		if ((iter.gfn < start ||
+		     iter.gfn + VMRUN_PAGES_PER_HPAGE(iter.level) > end) &&
+		    !is_last_spte(iter.old_spte, iter.level))
+			continue;
+
+		tdp_mmu_set_spte(vmrun, &iter, 0);
+		flush = zapped = true;
+	}
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	rcu_read_unlock();
+	return zapped;
+}
+
+bool vmrun_tdp_mmu_zap_gfn_range(struct vmrun *vmrun, gfn_t start, gfn_t end)
+{
+	struct vmrun_mmu_page *root;
+	bool zapped = false;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root)
+		zapped |= zap_gfn_range(vmrun, root, start, end, true);
+
+	return zapped;
+}
+
+void vmrun_tdp_mmu_zap_all(struct vmrun *vmrun)
+{
+	struct vmrun_mmu_page *root;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root)
+		zap_gfn_range(vmrun, root, 0, tdp_mmu_max_gfn(root), true);
+}
+
+/*
+ * Map the non-present neighbours of a 4K leaf that was just installed,
+ * within the adaptive prefetch window of the memslot.  The TDP MMU keeps
+ * no rmaps, so a prefetched SPTE only has to win a cmpxchg against 0;
+ * if another vCPU got there first its SPTE is kept.
+ */
+static void tdp_mmu_pte_prefetch(struct vmrun_vcpu *vcpu,
+				 struct tdp_iter *iter)
+{
+	u64 *pt = iter->pt_path[PT_PAGE_TABLE_LEVEL - 1];
+	struct vmrun_mmu_page *sp = page_header(__pa(pt));
+	struct page *pages[PTE_PREFETCH_BATCH];
+	struct vmrun_memory_slot *slot;
+	unsigned int index = iter->sptep - pt;
+	unsigned int i, end, window;
+	vmrun_pfn_t pfn;
+	u64 new_spte;
+	int j, nr, ret;
+
+	slot = gfn_to_memslot_dirty_bitmap(vcpu, iter->gfn, true);
+	if (!slot)
+		return;
+
+	window = direct_pte_prefetch_window(slot, pt, index);
+	i = index & ~(window - 1);
+	end = i + window;
+
+	while (i < end) {
+		if (is_shadow_present_pte(READ_ONCE(pt[i]))) {
+			i++;
+			continue;
+		}
+
+		for (nr = 1; i + nr < end && nr < PTE_PREFETCH_BATCH; nr++)
+			if (is_shadow_present_pte(READ_ONCE(pt[i + nr])))
+				break;
+
+		slot = gfn_to_memslot_dirty_bitmap(vcpu, sp->gfn + i, true);
+		if (!slot)
+			return;
+
+		ret = gfn_to_page_many_atomic(slot, sp->gfn + i, pages, nr);
+		if (ret <= 0)
+			return;
+
+		for (j = 0; j < ret; j++) {
+			pfn = page_to_pfn(pages[j]);
+			if (!(make_spte(vcpu, ACC_ALL, PT_PAGE_TABLE_LEVEL,
+					sp->gfn + i + j, pfn, 0, true, true, true,
+					sp_ad_disabled(sp), &new_spte) &
+			      SET_SPTE_SKIP))
+				cmpxchg64(pt + i + j, 0ull, new_spte);
+			vmrun_release_pfn_clean(pfn);
+		}
+
+		if (ret < nr)
+			return;
+		i += nr;
+	}
+}
+
+/*
+ * Install the leaf SPTE for a fault.  @pfn maps @base_gfn, the first gfn
+ * of the (possibly huge) mapping that was asked for; the leaf may end up
+ * at a lower level if a page table already covers the range.
+ */
+static int tdp_mmu_map_handle_target_level(struct vmrun_vcpu *vcpu,
+					   struct tdp_iter *iter, int write,
+					   int map_writable, gfn_t base_gfn,
+					   vmrun_pfn_t pfn, bool prefault)
+{
+	struct vmrun_mmu_page *sp = page_header(__pa(iter->sptep));
+	u64 old_spte = iter->old_spte;
+	u64 new_spte;
+	int make_spte_ret = 0;
+	int emulate = 0;
+
+	if (unlikely(is_noslot_pfn(pfn)))
+		new_spte = make_mmio_spte(vcpu, iter->gfn, ACC_ALL);
+	else
+		make_spte_ret = make_spte(vcpu, ACC_ALL, iter->level, iter->gfn,
+					  pfn + (iter->gfn - base_gfn),
+					  iter->old_spte, prefault, true,
+					  map_writable, sp_ad_disabled(sp),
+					  &new_spte);
+
+	/* Spurious fault, or lost a race with another vCPU: just retry. */
+	if ((make_spte_ret & SET_SPTE_SKIP) || new_spte == iter->old_spte)
+		return 0;
+
+	if (!tdp_mmu_set_spte_atomic(vcpu->vmrun, iter, new_spte))
+		return 0;
+
+	/*
+	 * The old mapping may still be cached by other vCPUs.  Compare with
+	 * the saved copy: a successful cmpxchg already updated old_spte.
+	 */
+	if (is_shadow_present_pte(old_spte) &&
+	    is_last_spte(old_spte, iter->level) &&
+	    spte_to_pfn(old_spte) != spte_to_pfn(new_spte))
+		vmrun_flush_remote_tlbs(vcpu->vmrun);
+
+	if (make_spte_ret & SET_SPTE_WRITE_PROTECTED_PT) {
+		if (write)
+			emulate = 1;
+		vmrun_make_request(KVM_REQ_TLB_FLUSH, vcpu);
+	}
+
+	if (unlikely(is_mmio_spte(new_spte))) {
+		emulate = 1;
+	} else {
+		++vcpu->stat.pf_fixed;
+		if (iter->level == PT_PAGE_TABLE_LEVEL)
+			tdp_mmu_pte_prefetch(vcpu, iter);
+	}
+
+	return emulate;
+}
+
+/*
+ * Handle a TDP page fault with mmu_lock held for read.  Returns 1 if the
+ * access must be emulated, 0 if the guest can be resumed (including when
+ * another vCPU raced with us and the fault will simply be taken again).
+ */
+static int vmrun_tdp_mmu_map(struct vmrun_vcpu *vcpu, gpa_t gpa, int write,
+			     int map_writable, int level, gfn_t base_gfn,
+			     vmrun_pfn_t pfn, bool prefault)
+{
+	struct vmrun *vmrun = vcpu->vmrun;
+	struct vmrun_mmu_page *root = page_header(vcpu->arch.mmu.root_hpa);
+	union vmrun_mmu_page_role role;
+	struct vmrun_mmu_page *sp;
+	struct tdp_iter iter;
+	u64 new_spte;
+	int emulate = 0;
+
+	rcu_read_lock();
+
+	for_each_tdp_pte(iter, root, gpa >> PAGE_SHIFT, (gpa >> PAGE_SHIFT) + 1) {
+		if (iter.level <= level) {
+			/* A page table below us: map at the next level down. */
+			if (!tdp_spte_to_child_pt(iter.old_spte, iter.level))
+				break;
+			level = iter.level - 1;
+			continue;
+		}
+
+		/*
+		 * A huge page is in the way of a smaller mapping: zap it and
+		 * link a page table in its place.
+		 */
+		if (is_shadow_present_pte(iter.old_spte) &&
+		    is_large_pte(iter.old_spte)) {
+			if (!tdp_mmu_set_spte_atomic(vmrun, &iter, 0))
+				goto out;
+			vmrun_flush_remote_tlbs(vmrun);
+		}
+
+		if (!is_shadow_present_pte(iter.old_spte)) {
+			role = root->role;
+			role.level = iter.level - 1;
+			sp = tdp_mmu_alloc_sp(vcpu, iter.gfn, role);
+			new_spte = tdp_mmu_make_nonleaf_spte(sp);
+
+			if (!tdp_mmu_set_spte_atomic(vmrun, &iter, new_spte)) {
+				tdp_mmu_free_sp(sp);
+				goto out;
+			}
+			tdp_mmu_link_sp(vmrun, sp);
+		}
+	}
+
+	if (iter.valid && iter.level == level)
+		emulate = tdp_mmu_map_handle_target_level(vcpu, &iter, write,
+							  map_writable, base_gfn,
+							  pfn, prefault);
+
+out:
+	rcu_read_unlock();
+	vmrun_release_pfn_clean(pfn);
+	return emulate;
+}
+
+typedef int (*tdp_handler_t)(struct vmrun *vmrun,
+			     struct vmrun_memory_slot *slot,
+			     struct vmrun_mmu_page *root,
+			     gfn_t start, gfn_t end, unsigned long data);
+
+static int tdp_mmu_handle_hva_root(struct vmrun *vmrun,
+				   struct vmrun_mmu_page *root,
+				   unsigned long start, unsigned long end,
+				   unsigned long data, tdp_handler_t handler)
+{
+	struct vmrun_memslots *slots;
+	struct vmrun_memory_slot *memslot;
+	struct interval_tree_node *node;
+	int ret = 0;
+
+	slots = __vmrun_memslots(vmrun, tdp_mmu_root_as_id(root));
+	vmrun_for_each_memslot_in_hva_range(node, slots, start, end - 1) {
+		unsigned long hva_start, hva_end;
+		gfn_t gfn_start, gfn_end;
+
+		memslot = container_of(node, struct vmrun_memory_slot,
+				       hva_node);
+		hva_start = max(start, memslot->userspace_addr);
+		hva_end = min(end, memslot->userspace_addr +
+			      (memslot->npages << PAGE_SHIFT));
+		if (hva_start >= hva_end)
+			continue;
+
+		gfn_start = hva_to_gfn_memslot(hva_start, memslot);
+		gfn_end = hva_to_gfn_memslot(hva_end + PAGE_SIZE - 1, memslot);
+
+		ret |= handler(vmrun, memslot, root, gfn_start, gfn_end, data);
+	}
+
+	return ret;
+}
+
+static int tdp_mmu_handle_hva_range(struct vmrun *vmrun, unsigned long start,
+				    unsigned long end, unsigned long data,
+				    tdp_handler_t handler)
+{
+	struct vmrun_mmu_page *root;
+	int ret = 0;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root)
+		ret |= tdp_mmu_handle_hva_root(vmrun, root, start, end, data,
+					       handler);
+
+	return ret;
+}
+
+/*
+ * Like tdp_mmu_handle_hva_range(), but without mmu_lock.  @handler
+ * may only change SPTEs atomically and must not free page tables.
+ */
+static int tdp_mmu_handle_hva_range_lockless(struct vmrun *vmrun,
+					     unsigned long start,
+					     unsigned long end,
+					     unsigned long data,
+					     tdp_handler_t handler)
+{
+	struct vmrun_mmu_page *root;
+	int ret = 0;
+
+	rcu_read_lock();
+
+	for_each_tdp_mmu_root_rcu(vmrun, root)
+		ret |= tdp_mmu_handle_hva_root(vmrun, root, start, end, data,
+					       handler);
+
+	rcu_read_unlock();
+	return ret;
+}
+
+static int zap_gfn_range_hva_wrapper(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot,
+				     struct vmrun_mmu_page *root,
+				     gfn_t start, gfn_t end, unsigned long data)
+{
+	return zap_gfn_range(vmrun, root, start, end, false);
+}
+
+int vmrun_tdp_mmu_unmap_hva_range(struct vmrun *vmrun, unsigned long start,
+				  unsigned long end)
+{
+	return tdp_mmu_handle_hva_range(vmrun, start, end, 0,
+					zap_gfn_range_hva_wrapper);
+}
+
+/*
+ * A changed host PTE is handled by dropping the mapping; the next guest
+ * access faults the new page in.
+ */
+void vmrun_tdp_mmu_set_spte_hva(struct vmrun *vmrun, unsigned long hva)
+{
+	tdp_mmu_handle_hva_range(vmrun, hva, hva + 1, 0,
+				 zap_gfn_range_hva_wrapper);
+}
+
+/*
+ * Called without mmu_lock: the Accessed bit is cleared with an atomic
+ * bit operation, and an SPTE without A/D bits is marked for access
+ * tracking with cmpxchg.  If the latter races with a fault or a zap,
+ * the SPTE is left alone; it was just used or is going away anyway.
+ */
+static int age_gfn_range(struct vmrun *vmrun, struct vmrun_memory_slot *slot,
+			 struct vmrun_mmu_page *root, gfn_t start, gfn_t end,
+			 unsigned long unused)
+{
+	struct tdp_iter iter;
+	u64 new_spte;
+	int young = 0;
+
+	rcu_read_lock();
+
+	for_each_tdp_pte(iter, root, start, end) {
+		if (!is_shadow_present_pte(iter.old_spte) ||
+		    !is_last_spte(iter.old_spte, iter.level) ||
+		    !is_accessed_spte(iter.old_spte))
+			continue;
+
+		if (spte_ad_enabled(iter.old_spte)) {
+			young |= test_and_clear_bit(ffs(shadow_accessed_mask) - 1,
+						    (unsigned long *)iter.sptep);
+			continue;
+		}
+
+		new_spte = mark_spte_for_access_track(iter.old_spte);
+		if (cmpxchg64(iter.sptep, iter.old_spte, new_spte) !=
+		    iter.old_spte)
+			continue;
+
+		/*
+		 * Capture the dirty status of the page, so that it does not
+		 * get lost now that the SPTE is marked for access tracking.
+		 */
+		if (is_writable_pte(iter.old_spte))
+			vmrun_set_pfn_dirty(spte_to_pfn(iter.old_spte));
+
+		handle_changed_spte(vmrun, iter.gfn, iter.old_spte, new_spte,
+				    iter.level, false);
+		iter.old_spte = new_spte;
+		young = 1;
+	}
+
+	rcu_read_unlock();
+	return young;
+}
+
+int vmrun_tdp_mmu_age_hva_range(struct vmrun *vmrun, unsigned long start,
+				unsigned long end)
+{
+	return tdp_mmu_handle_hva_range_lockless(vmrun, start, end, 0,
+						 age_gfn_range);
+}
+
+static int test_age_gfn(struct vmrun *vmrun, struct vmrun_memory_slot *slot,
+			struct vmrun_mmu_page *root, gfn_t gfn, gfn_t unused,
+			unsigned long unused2)
+{
+	struct tdp_iter iter;
+	int young = 0;
+
+	rcu_read_lock();
+
+	for_each_tdp_pte(iter, root, gfn, gfn + 1) {
+		if (is_shadow_present_pte(iter.old_spte) &&
+		    is_last_spte(iter.old_spte, iter.level) &&
+		    is_accessed_spte(iter.old_spte))
+			young = 1;
+	}
+
+	rcu_read_unlock();
+	return young;
+}
+
+int vmrun_tdp_mmu_test_age_hva(struct vmrun *vmrun, unsigned long hva)
+{
+	return tdp_mmu_handle_hva_range_lockless(vmrun, hva, hva + 1, 0,
+						 test_age_gfn);
+}
+
+/*
+ * Write protect all leaf SPTEs at or above @min_level in @slot.  Only
+ * PT_WRITABLE_MASK is dropped, so fast_page_fault can restore write access
+ * for dirty logging.  Returns true if a TLB flush is needed.
+ */
+bool vmrun_tdp_mmu_wrprot_slot(struct vmrun *vmrun,
+			       struct vmrun_memory_slot *slot, int min_level)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	bool spte_set = false;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, min_level,
+					   slot->base_gfn,
+					   slot->base_gfn + slot->npages) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, spte_set)) {
+				spte_set = false;
+				continue;
+			}
+
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_last_spte(iter.old_spte, iter.level) ||
+			    !is_writable_pte(iter.old_spte))
+				continue;
+
+			tdp_mmu_set_spte(vmrun, &iter,
+					 iter.old_spte & ~PT_WRITABLE_MASK);
+			spte_set = true;
+		}
+
+		rcu_read_unlock();
+	}
+
+	return spte_set;
+}
+
+/*
+ * Clear the D bit of the 4K SPTEs in @slot, or write protect the SPTEs
+ * that have A/D bits disabled, so that the next write is logged.
+ * Returns true if an SPTE was changed.
+ */
+bool vmrun_tdp_mmu_clear_dirty_slot(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	bool spte_set = false;
+	u64 new_spte;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, PT_PAGE_TABLE_LEVEL,
+					   slot->base_gfn,
+					   slot->base_gfn + slot->npages) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, spte_set)) {
+				spte_set = false;
+				continue;
+			}
+
+			if (iter.level > PT_PAGE_TABLE_LEVEL ||
+			    !is_shadow_present_pte(iter.old_spte))
+				continue;
+
+			if (spte_ad_enabled(iter.old_spte)) {
+				if (!(iter.old_spte & shadow_dirty_mask))
+					continue;
+				new_spte = iter.old_spte & ~shadow_dirty_mask;
+			} else {
+				if (!is_writable_pte(iter.old_spte))
+					continue;
+				new_spte = iter.old_spte & ~PT_WRITABLE_MASK;
+			}
+
+			tdp_mmu_set_spte(vmrun, &iter, new_spte);
+			spte_set = true;
+		}
+
+		rcu_read_unlock();
+	}
+
+	return spte_set;
+}
+
+/*
+ * Set the D bit of every leaf SPTE in @slot that has A/D bits enabled,
+ * so that those pages are no longer logged.  Returns true if an SPTE
+ * was changed.
+ */
+bool vmrun_tdp_mmu_set_dirty_slot(struct vmrun *vmrun,
+				  struct vmrun_memory_slot *slot)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	bool spte_set = false;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, PT_PAGE_TABLE_LEVEL,
+					   slot->base_gfn,
+					   slot->base_gfn + slot->npages) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, spte_set)) {
+				spte_set = false;
+				continue;
+			}
+
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_last_spte(iter.old_spte, iter.level) ||
+			    !spte_ad_enabled(iter.old_spte) ||
+			    (iter.old_spte & shadow_dirty_mask))
+				continue;
+
+			tdp_mmu_set_spte(vmrun, &iter,
+					 iter.old_spte | shadow_dirty_mask);
+			spte_set = true;
+		}
+
+		rcu_read_unlock();
+	}
+
+	return spte_set;
+}
+
+/*
+ * Write protect (or clear the D bit of) the 4K SPTEs of the gfns in @mask,
+ * relative to @gfn.  Used for dirty logging, where there are no huge
+ * mappings.
+ */
+void vmrun_tdp_mmu_clear_dirty_pt_masked(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t gfn, unsigned long mask,
+					 bool wrprot)
+{
+	struct vmrun_mmu_page *root;
+	unsigned long root_mask;
+	struct tdp_iter iter;
+	u64 new_spte;
+
+	if (!mask)
+		return;
+
+	for_each_tdp_mmu_root(vmrun, root) {
+		/* Every root, SMM included, maps the whole mask. */
+		root_mask = mask;
+
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, PT_PAGE_TABLE_LEVEL,
+					   gfn + __ffs(root_mask),
+					   gfn + BITS_PER_LONG) {
+			if (!root_mask)
+				break;
+
+			if (iter.level > PT_PAGE_TABLE_LEVEL ||
+			    !(root_mask & (1UL << (iter.gfn - gfn))))
+				continue;
+
+			root_mask &= ~(1UL << (iter.gfn - gfn));
+
+			if (!is_shadow_present_pte(iter.old_spte))
+				continue;
+
+			if (wrprot || !spte_ad_enabled(iter.old_spte)) {
+				if (!is_writable_pte(iter.old_spte))
+					continue;
+				new_spte = iter.old_spte & ~PT_WRITABLE_MASK;
+			} else {
+				if (!(iter.old_spte & shadow_dirty_mask))
+					continue;
+				new_spte = iter.old_spte & ~shadow_dirty_mask;
+			}
+
+			tdp_mmu_set_spte(vmrun, &iter, new_spte);
+		}
+
+		rcu_read_unlock();
+	}
+}
+
+/*
+ * Remove write access from every SPTE mapping @gfn, including the
+ * MMU-writable bit so that fast_page_fault cannot restore it.  Huge
+ * leaves are zapped instead, like vmrun_mmu_slot_gfn_write_protect does,
+ * and the region is refaulted with smaller pages.  Used by page
+ * tracking.  Returns true if an SPTE was changed.
+ */
+bool vmrun_tdp_mmu_write_protect_gfn(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot, gfn_t gfn)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	bool spte_set = false;
+
+	for_each_tdp_mmu_root(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte(iter, root, gfn, gfn + 1) {
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_last_spte(iter.old_spte, iter.level))
+				continue;
+
+			if (iter.level > PT_PAGE_TABLE_LEVEL) {
+				tdp_mmu_set_spte(vmrun, &iter, 0);
+				spte_set = true;
+				continue;
+			}
+
+			if (!(iter.old_spte & (PT_WRITABLE_MASK |
+					       SPTE_MMU_WRITEABLE)))
+				continue;
+
+			tdp_mmu_set_spte(vmrun, &iter, iter.old_spte &
+				~(PT_WRITABLE_MASK | SPTE_MMU_WRITEABLE));
+			spte_set = true;
+		}
+
+		rcu_read_unlock();
+	}
+
+	return spte_set;
+}
+
+/*
+ * Replace the page tables at @level - 1 in [start, end) of @slot that map
+ * a host huge page in full with a huge leaf.  The detached tables go
+ * through handle_removed_tdp_mmu_page(), which hands the A/D state of
+ * their entries to the pages.  mmu_lock must be held for write.
+ */
+void vmrun_tdp_mmu_recover_huge_pages(struct vmrun *vmrun,
+				      struct vmrun_memory_slot *slot,
+				      gfn_t start, gfn_t end, int level)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	bool flush = false;
+	u64 huge_spte;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, level, start, end) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, flush)) {
+				flush = false;
+				continue;
+			}
+
+			if (iter.level != level ||
+			    !is_shadow_present_pte(iter.old_spte) ||
+			    is_last_spte(iter.old_spte, level) ||
+			    __mmu_gfn_lpage_is_disallowed(iter.gfn, level, slot))
+				continue;
+
+			if (!make_huge_spte_from_table(
+				tdp_spte_to_child_pt(iter.old_spte, level),
+				level, &huge_spte) ||
+			    !host_pfn_is_huge(spte_to_pfn(huge_spte), level))
+				continue;
+
+			tdp_mmu_set_spte(vmrun, &iter, huge_spte);
+			flush = true;
+		}
+
+		if (flush)
+			vmrun_flush_remote_tlbs(vmrun);
+		flush = false;
+
+		rcu_read_unlock();
+	}
+}
+
+/*
+ * Zap the 4K mappings in [start, end) of pages that the host backs with a
+ * huge page, so that they can be refaulted as huge mappings once dirty
+ * logging stops.
+ */
+void vmrun_tdp_mmu_zap_collapsible_sptes(struct vmrun *vmrun,
+					 const struct vmrun_memory_slot *slot,
+					 gfn_t start, gfn_t end)
+{
+	struct vmrun_mmu_page *root;
+	struct tdp_iter iter;
+	vmrun_pfn_t pfn;
+	bool spte_set = false;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		rcu_read_lock();
+
+		for_each_tdp_pte(iter, root, start, end) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, spte_set)) {
+				spte_set = false;
+				continue;
+			}
+
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_last_spte(iter.old_spte, iter.level) ||
+			    iter.level > PT_PAGE_TABLE_LEVEL)
+				continue;
+
+			pfn = spte_to_pfn(iter.old_spte);
+			if (vmrun_is_reserved_pfn(pfn) ||
+			    !PageTransCompoundMap(pfn_to_page(pfn)))
+				continue;
+
+			tdp_mmu_set_spte(vmrun, &iter, 0);
+			spte_set = true;
+		}
+
+		if (spte_set)
+			vmrun_flush_remote_tlbs(vmrun);
+		spte_set = false;
+
+		rcu_read_unlock();
+	}
+}
+
+/*
+ * Split the huge leaves mapping @slot into fully populated page tables.
+ * The walk is top-down, so a 1GB leaf becomes 2MB leaves which are then
+ * split in turn.  mmu_lock is held for write; it is dropped to refill the
+ * split caches and to reschedule.  The page tables map exactly what the
+ * huge leaves did, so stale TLB entries are harmless and a single flush
+ * at the end suffices; returns true if that flush is needed.
+ */
+bool vmrun_tdp_mmu_split_huge_pages(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot)
+{
+	union vmrun_mmu_page_role role;
+	struct vmrun_mmu_page *root, *sp;
+	struct tdp_iter iter;
+	bool flush = false;
+	int i, r = 0;
+
+	for_each_tdp_mmu_root_yield_safe(vmrun, root) {
+		if (r)
+			continue;
+
+		rcu_read_lock();
+
+		for_each_tdp_pte_min_level(iter, root, PT_DIRECTORY_LEVEL,
+					   slot->base_gfn,
+					   slot->base_gfn + slot->npages) {
+			if (tdp_mmu_iter_cond_resched(vmrun, &iter, false))
+				continue;
+
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_large_pte(iter.old_spte))
+				continue;
+
+			if (mmu_split_caches_short(vmrun, 0)) {
+				rcu_read_unlock();
+				r = mmu_topup_split_caches(vmrun, 0);
+				rcu_read_lock();
+				if (r)
+					break;
+				tdp_iter_restart(&iter);
+				continue;
+			}
+
+			role = root->role;
+			role.level = iter.level - 1;
+			sp = __tdp_mmu_alloc_sp(&vmrun->split_page_header_cache,
+						&vmrun->split_page_cache,
+						iter.gfn, role);
+
+			for (i = 0; i < PT64_ENT_PER_PAGE; i++)
+				sp->spt[i] = make_huge_page_split_spte(
+						iter.old_spte, role.level, i);
+
+			tdp_mmu_set_spte(vmrun, &iter,
+					 tdp_mmu_make_nonleaf_spte(sp));
+			tdp_mmu_link_sp(vmrun, sp);
+			flush = true;
+		}
+
+		rcu_read_unlock();
+	}
+
+	return flush;
+}
+
+static void vmrun_send_hwpoison_signal(unsigned long address, struct task_struct *tsk)
+{
+	siginfo_t info;
+
+	info.si_signo	= SIGBUS;
+	info.si_errno	= 0;
+	info.si_code	= BUS_MCEERR_AR;
+	info.si_addr	= (void __user *)address;
+	info.si_addr_lsb = PAGE_SHIFT;
+
+	send_sig_info(SIGBUS, &info, tsk);
+}
+
+static int vmrun_handle_bad_page(struct vmrun_vcpu *vcpu, gfn_t gfn, vmrun_pfn_t pfn)
+{
+	/*
+	 * Do not cache the mmio info caused by writing the readonly gfn
+	 * into the spte otherwise read access on readonly gfn also can
+	 * caused mmio page fault and treat it as mmio access.
+	 * Return 1 to tell vmrun to emulate it.
+	 */
+	if (pfn == KVM_PFN_ERR_RO_FAULT)
+		return 1;
+
+	if (pfn == KVM_PFN_ERR_HWPOISON) {
+		vmrun_send_hwpoison_signal(vmrun_vcpu_gfn_to_hva(vcpu, gfn), current);
+		return 0;
+	}
+
+	return -EFAULT;
+}
+
+static void transparent_hugepage_adjust(struct vmrun_vcpu *vcpu,
+					gfn_t *gfnp, vmrun_pfn_t *pfnp,
+					int *levelp)
+{
+	vmrun_pfn_t pfn = *pfnp;
+	gfn_t gfn = *gfnp;
+	int level = *levelp;
+
+	/*
+	 * Check if it's a transparent hugepage. If this would be an
+	 * hugetlbfs page, level wouldn't be set to
+	 * PT_PAGE_TABLE_LEVEL and there would be no adjustment done
+	 * here.
+	 */
+	if (!is_error_noslot_pfn(pfn) && !vmrun_is_reserved_pfn(pfn) &&
+	    level == PT_PAGE_TABLE_LEVEL &&
+	    PageTransCompoundMap(pfn_to_page(pfn)) &&
+	    !mmu_gfn_lpage_is_disallowed(vcpu, gfn, PT_DIRECTORY_LEVEL)) {
+		unsigned long mask;
+		/*
+		 * mmu_notifier_retry was successful and we hold the
+		 * mmu_lock here, so the pmd can't become splitting
+		 * from under us, and in turn
+		 * __split_huge_page_refcount() can't run from under
+		 * us and we can safely transfer the refcount from
+		 * PG_tail to PG_head as we switch the pfn to tail to
+		 * head.
+		 */
+		*levelp = level = PT_DIRECTORY_LEVEL;
+		mask = KVM_PAGES_PER_HPAGE(level) - 1;
+		VM_BUG_ON((gfn & mask) != (pfn & mask));
+		if (pfn & mask) {
+			gfn &= ~mask;
+			*gfnp = gfn;
+			vmrun_release_pfn_clean(pfn);
+			pfn &= ~mask;
+			vmrun_get_pfn(pfn);
+			*pfnp = pfn;
+		}
+	}
+}
+
+static bool handle_abnormal_pfn(struct vmrun_vcpu *vcpu, gva_t gva, gfn_t gfn,
+				vmrun_pfn_t pfn, unsigned access, int *ret_val)
+{
+	/* The pfn is invalid, report the error! */
+	if (unlikely(is_error_pfn(pfn))) {
+		*ret_val = vmrun_handle_bad_page(vcpu, gfn, pfn);
+		return true;
+	}
+
+	if (unlikely(is_noslot_pfn(pfn)))
+		vcpu_cache_mmio_info(vcpu, gva, gfn, access);
+
+	return false;
+}
+
+static bool page_fault_can_be_fast(u32 error_code)
+{
+	/*
+	 * Do not fix the mmio spte with invalid generation number which
+	 * need to be updated by slow page fault path.
+	 */
+	if (unlikely(error_code & PFERR_RSVD_MASK))
+		return false;
+
+	/* See if the page fault is due to an NX violation */
 	if (unlikely(((error_code & (PFERR_FETCH_MASK | PFERR_PRESENT_MASK))
 		      == (PFERR_FETCH_MASK | PFERR_PRESENT_MASK))))
 		return false;
@@ -3152,11 +5317,12 @@ static int nonpaging_map(struct vmrun_vcpu *vcpu, gva_t v, u32 error_code,
 	level = mapping_level(vcpu, gfn, &force_pt_level);
 	if (likely(!force_pt_level)) {
 		/*
-		 * This path builds a PAE pagetable - so we can map
-		 * 2mb pages at maximum. Therefore check if the level
-		 * is larger than that.
+		 * A PAE root can map 2mb pages at maximum, as its
+		 * entries are PDPTEs.  With a 4-level root 1gb pages
+		 * are fine.
 		 */
-		if (level > PT_DIRECTORY_LEVEL)
+		if (level > PT_DIRECTORY_LEVEL &&
+		    vcpu->arch.mmu.shadow_root_level < PT64_ROOT_4LEVEL)
 			level = PT_DIRECTORY_LEVEL;
 
 		gfn &= ~(KVM_PAGES_PER_HPAGE(level) - 1);
@@ -3174,7 +5340,7 @@ static int nonpaging_map(struct vmrun_vcpu *vcpu, gva_t v, u32 error_code,
 	if (handle_abnormal_pfn(vcpu, v, gfn, pfn, ACC_ALL, &r))
 		return r;
 
-	spin_lock(&vcpu->vmrun->mmu_lock);
+	write_lock(&vcpu->vmrun->mmu_lock);
 	if (mmu_notifier_retry(vcpu->vmrun, mmu_seq))
 		goto out_unlock;
 	if (make_mmu_pages_available(vcpu) < 0)
@@ -3182,12 +5348,12 @@ static int nonpaging_map(struct vmrun_vcpu *vcpu, gva_t v, u32 error_code,
 	if (likely(!force_pt_level))
 		transparent_hugepage_adjust(vcpu, &gfn, &pfn, &level);
 	r = __direct_map(vcpu, write, map_writable, level, gfn, pfn, prefault);
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 
 	return r;
 
 out_unlock:
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 	vmrun_release_pfn_clean(pfn);
 	return 0;
 }
@@ -3207,19 +5373,25 @@ static void mmu_free_roots(struct vmrun_vcpu *vcpu)
 	     vcpu->arch.mmu.direct_map)) {
 		hpa_t root = vcpu->arch.mmu.root_hpa;
 
-		spin_lock(&vcpu->vmrun->mmu_lock);
+		write_lock(&vcpu->vmrun->mmu_lock);
 		sp = page_header(root);
+		if (sp->tdp_mmu_page) {
+			vmrun_tdp_mmu_put_root(vcpu->vmrun, sp);
+			write_unlock(&vcpu->vmrun->mmu_lock);
+			vcpu->arch.mmu.root_hpa = INVALID_PAGE;
+			return;
+		}
 		--sp->root_count;
 		if (!sp->root_count && sp->role.invalid) {
 			vmrun_mmu_prepare_zap_page(vcpu->vmrun, sp, &invalid_list);
 			vmrun_mmu_commit_zap_page(vcpu->vmrun, &invalid_list);
 		}
-		spin_unlock(&vcpu->vmrun->mmu_lock);
+		write_unlock(&vcpu->vmrun->mmu_lock);
 		vcpu->arch.mmu.root_hpa = INVALID_PAGE;
 		return;
 	}
 
-	spin_lock(&vcpu->vmrun->mmu_lock);
+	write_lock(&vcpu->vmrun->mmu_lock);
 	for (i = 0; i < 4; ++i) {
 		hpa_t root = vcpu->arch.mmu.pae_root[i];
 
@@ -3234,7 +5406,7 @@ static void mmu_free_roots(struct vmrun_vcpu *vcpu)
 		vcpu->arch.mmu.pae_root[i] = INVALID_PAGE;
 	}
 	vmrun_mmu_commit_zap_page(vcpu->vmrun, &invalid_list);
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 	vcpu->arch.mmu.root_hpa = INVALID_PAGE;
 }
 
@@ -3255,32 +5427,34 @@ static int mmu_alloc_direct_roots(struct vmrun_vcpu *vcpu)
 	struct vmrun_mmu_page *sp;
 	unsigned i;
 
-	if (vcpu->arch.mmu.shadow_root_level >= PT64_ROOT_4LEVEL) {
-		spin_lock(&vcpu->vmrun->mmu_lock);
+	if (vcpu->vmrun->tdp_mmu_enabled) {
+		vcpu->arch.mmu.root_hpa = vmrun_tdp_mmu_get_vcpu_root_hpa(vcpu);
+	} else if (vcpu->arch.mmu.shadow_root_level >= PT64_ROOT_4LEVEL) {
+		write_lock(&vcpu->vmrun->mmu_lock);
 		if(make_mmu_pages_available(vcpu) < 0) {
-			spin_unlock(&vcpu->vmrun->mmu_lock);
+			write_unlock(&vcpu->vmrun->mmu_lock);
 			return 1;
 		}
 		sp = vmrun_mmu_get_page(vcpu, 0, 0,
 				vcpu->arch.mmu.shadow_root_level, 1, ACC_ALL);
 		++sp->root_count;
-		spin_unlock(&vcpu->vmrun->mmu_lock);
+		write_unlock(&vcpu->vmrun->mmu_lock);
 		vcpu->arch.mmu.root_hpa = __pa(sp->spt);
 	} else if (vcpu->arch.mmu.shadow_root_level == PT32E_ROOT_LEVEL) {
 		for (i = 0; i < 4; ++i) {
 			hpa_t root = vcpu->arch.mmu.pae_root[i];
 
 			MMU_WARN_ON(VALID_PAGE(root));
-			spin_lock(&vcpu->vmrun->mmu_lock);
+			write_lock(&vcpu->vmrun->mmu_lock);
 			if (make_mmu_pages_available(vcpu) < 0) {
-				spin_unlock(&vcpu->vmrun->mmu_lock);
+				write_unlock(&vcpu->vmrun->mmu_lock);
 				return 1;
 			}
 			sp = vmrun_mmu_get_page(vcpu, i << (30 - PAGE_SHIFT),
 					i << 30, PT32_ROOT_LEVEL, 1, ACC_ALL);
 			root = __pa(sp->spt);
 			++sp->root_count;
-			spin_unlock(&vcpu->vmrun->mmu_lock);
+			write_unlock(&vcpu->vmrun->mmu_lock);
 			vcpu->arch.mmu.pae_root[i] = root | PT_PRESENT_MASK;
 		}
 		vcpu->arch.mmu.root_hpa = __pa(vcpu->arch.mmu.pae_root);
@@ -3311,16 +5485,16 @@ static int mmu_alloc_shadow_roots(struct vmrun_vcpu *vcpu)
 
 		MMU_WARN_ON(VALID_PAGE(root));
 
-		spin_lock(&vcpu->vmrun->mmu_lock);
+		write_lock(&vcpu->vmrun->mmu_lock);
 		if (make_mmu_pages_available(vcpu) < 0) {
-			spin_unlock(&vcpu->vmrun->mmu_lock);
+			write_unlock(&vcpu->vmrun->mmu_lock);
 			return 1;
 		}
 		sp = vmrun_mmu_get_page(vcpu, root_gfn, 0,
 				vcpu->arch.mmu.shadow_root_level, 0, ACC_ALL);
 		root = __pa(sp->spt);
 		++sp->root_count;
-		spin_unlock(&vcpu->vmrun->mmu_lock);
+		write_unlock(&vcpu->vmrun->mmu_lock);
 		vcpu->arch.mmu.root_hpa = root;
 		return 0;
 	}
@@ -3348,16 +5522,16 @@ static int mmu_alloc_shadow_roots(struct vmrun_vcpu *vcpu)
 			if (mmu_check_root(vcpu, root_gfn))
 				return 1;
 		}
-		spin_lock(&vcpu->vmrun->mmu_lock);
+		write_lock(&vcpu->vmrun->mmu_lock);
 		if (make_mmu_pages_available(vcpu) < 0) {
-			spin_unlock(&vcpu->vmrun->mmu_lock);
+			write_unlock(&vcpu->vmrun->mmu_lock);
 			return 1;
 		}
 		sp = vmrun_mmu_get_page(vcpu, root_gfn, i << 30, PT32_ROOT_LEVEL,
 				      0, ACC_ALL);
 		root = __pa(sp->spt);
 		++sp->root_count;
-		spin_unlock(&vcpu->vmrun->mmu_lock);
+		write_unlock(&vcpu->vmrun->mmu_lock);
 
 		vcpu->arch.mmu.pae_root[i] = root | pm_mask;
 	}
@@ -3433,9 +5607,9 @@ static void mmu_sync_roots(struct vmrun_vcpu *vcpu)
 
 void vmrun_mmu_sync_roots(struct vmrun_vcpu *vcpu)
 {
-	spin_lock(&vcpu->vmrun->mmu_lock);
+	write_lock(&vcpu->vmrun->mmu_lock);
 	mmu_sync_roots(vcpu);
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 }
 EXPORT_SYMBOL_GPL(vmrun_mmu_sync_roots);
 
@@ -3593,6 +5767,14 @@ static bool page_fault_handle_page_track(struct vmrun_vcpu *vcpu,
 	if (unlikely(error_code & PFERR_RSVD_MASK))
 		return false;
 
+	/*
+	 * Report the first touch of an access tracked page and stop
+	 * tracking it; the rest of the fault then maps it as usual.
+	 */
+	if (unlikely(vmrun_page_track_is_active(vcpu, gfn,
+						VMRUN_PAGE_TRACK_ACCESS)))
+		vmrun_page_track_access_fault(vcpu, gfn);
+
 	if (!(error_code & PFERR_PRESENT_MASK) ||
 	      !(error_code & PFERR_WRITE_MASK))
 		return false;
@@ -3650,7 +5832,6 @@ static int vmrun_arch_setup_async_pf(struct vmrun_vcpu *vcpu, gva_t gva, gfn_t g
 {
 	struct vmrun_arch_async_pf arch;
 
-	arch.token = (vcpu->arch.apf.id++ << 12) | vcpu->vcpu_id;
 	arch.gfn = gfn;
 	arch.direct_map = vcpu->arch.mmu.direct_map;
 	arch.cr3 = vcpu->arch.mmu.get_cr3(vcpu);
@@ -3658,16 +5839,34 @@ static int vmrun_arch_setup_async_pf(struct vmrun_vcpu *vcpu, gva_t gva, gfn_t g
 	return vmrun_setup_async_pf(vcpu, gva, vmrun_vcpu_gfn_to_hva(vcpu, gfn), &arch);
 }
 
-bool vmrun_can_do_async_pf(struct vmrun_vcpu *vcpu)
+/*
+ * Called when draining a finished page-in: map the page right away
+ * so that the guest does not take the fault again, unless the paging
+ * mode changed under the page-in.
+ */
+void vmrun_arch_async_page_ready(struct vmrun_vcpu *vcpu,
+				 struct vmrun_async_pf *work)
 {
-	if (unlikely(!lapic_in_kernel(vcpu) ||
-		     vmrun_event_needs_reinjection(vcpu)))
-		return false;
+	int r;
 
-	if (!vcpu->arch.apf.delivery_as_pf_vmexit && is_guest_mode(vcpu))
-		return false;
+	if (vcpu->arch.mmu.direct_map != work->arch.direct_map)
+		return;
 
-	return vmrun_x86_ops->interrupt_allowed(vcpu);
+	r = vmrun_mmu_reload(vcpu);
+	if (unlikely(r))
+		return;
+
+	if (!vcpu->arch.mmu.direct_map &&
+	      work->arch.cr3 != vcpu->arch.mmu.get_cr3(vcpu))
+		return;
+
+	vcpu->arch.mmu.page_fault(vcpu, work->gva, 0, true);
+}
+
+bool vmrun_can_do_async_pf(struct vmrun_vcpu *vcpu)
+{
+	/* The vCPU is only halted, so it does not matter if it can take a #PF. */
+	return !unlikely(vmrun_event_needs_reinjection(vcpu));
 }
 
 static bool try_async_pf(struct vmrun_vcpu *vcpu, bool prefault, gfn_t gfn,
@@ -3685,8 +5884,13 @@ static bool try_async_pf(struct vmrun_vcpu *vcpu, bool prefault, gfn_t gfn,
 	if (!prefault && vmrun_can_do_async_pf(vcpu)) {
 		trace_vmrun_try_async_get_page(gva, gfn);
 		if (vmrun_find_async_pf_gfn(vcpu, gfn)) {
+			/*
+			 * The guest touched a page that is already being
+			 * brought in; wait for it instead of queueing it
+			 * twice.
+			 */
 			trace_vmrun_async_pf_doublefault(gva, gfn);
-			vmrun_make_request(KVM_REQ_APF_HALT, vcpu);
+			vcpu->apf.halted = true;
 			return true;
 		} else if (vmrun_arch_setup_async_pf(vcpu, gva, gfn))
 			return true;
@@ -3781,7 +5985,27 @@ static int tdp_page_fault(struct vmrun_vcpu *vcpu, gva_t gpa, u32 error_code,
 	if (handle_abnormal_pfn(vcpu, 0, gfn, pfn, ACC_ALL, &r))
 		return r;
 
-	spin_lock(&vcpu->vmrun->mmu_lock);
+	if (vcpu->vmrun->tdp_mmu_enabled) {
+		/*
+		 * TDP MMU pages are not subject to the page limit, and the
+		 * fault only needs mmu_lock for read.
+		 */
+		read_lock(&vcpu->vmrun->mmu_lock);
+		if (mmu_notifier_retry(vcpu->vmrun, mmu_seq)) {
+			read_unlock(&vcpu->vmrun->mmu_lock);
+			vmrun_release_pfn_clean(pfn);
+			return 0;
+		}
+		if (likely(!force_pt_level))
+			transparent_hugepage_adjust(vcpu, &gfn, &pfn, &level);
+		r = vmrun_tdp_mmu_map(vcpu, gpa, write, map_writable, level,
+				      gfn, pfn, prefault);
+		read_unlock(&vcpu->vmrun->mmu_lock);
+
+		return r;
+	}
+
+	write_lock(&vcpu->vmrun->mmu_lock);
 	if (mmu_notifier_retry(vcpu->vmrun, mmu_seq))
 		goto out_unlock;
 	if (make_mmu_pages_available(vcpu) < 0)
@@ -3789,12 +6013,12 @@ static int tdp_page_fault(struct vmrun_vcpu *vcpu, gva_t gpa, u32 error_code,
 	if (likely(!force_pt_level))
 		transparent_hugepage_adjust(vcpu, &gfn, &pfn, &level);
 	r = __direct_map(vcpu, write, map_writable, level, gfn, pfn, prefault);
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 
 	return r;
 
 out_unlock:
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 	vmrun_release_pfn_clean(pfn);
 	return 0;
 }
@@ -4344,10 +6568,10 @@ static void init_vmrun_tdp_mmu(struct vmrun_vcpu *vcpu)
 	context->sync_page = nonpaging_sync_page;
 	context->invlpg = nonpaging_invlpg;
 	context->update_pte = nonpaging_update_pte;
-	context->shadow_root_level = vmrun_x86_ops->get_tdp_level(vcpu);
+	context->shadow_root_level = vmrun_get_tdp_level(vcpu);
 	context->root_hpa = INVALID_PAGE;
 	context->direct_map = true;
-	context->set_cr3 = vmrun_x86_ops->set_tdp_cr3;
+	context->set_cr3 = vmrun_set_tdp_cr3;
 	context->get_cr3 = get_cr3;
 	context->get_pdptr = vmrun_pdptr_read;
 	context->inject_page_fault = vmrun_inject_page_fault;
@@ -4711,7 +6935,7 @@ static void vmrun_mmu_pte_write(struct vmrun_vcpu *vcpu, gpa_t gpa,
 	 */
 	mmu_topup_memory_caches(vcpu);
 
-	spin_lock(&vcpu->vmrun->mmu_lock);
+	write_lock(&vcpu->vmrun->mmu_lock);
 	++vcpu->vmrun->stat.mmu_pte_write;
 	vmrun_mmu_audit(vcpu, AUDIT_PRE_PTE_WRITE);
 
@@ -4742,7 +6966,7 @@ static void vmrun_mmu_pte_write(struct vmrun_vcpu *vcpu, gpa_t gpa,
 	}
 	vmrun_mmu_flush_or_zap(vcpu, &invalid_list, remote_flush, local_flush);
 	vmrun_mmu_audit(vcpu, AUDIT_POST_PTE_WRITE);
-	spin_unlock(&vcpu->vmrun->mmu_lock);
+	write_unlock(&vcpu->vmrun->mmu_lock);
 }
 
 int vmrun_mmu_unprotect_page_virt(struct vmrun_vcpu *vcpu, gva_t gva)
@@ -4769,7 +6993,7 @@ static int make_mmu_pages_available(struct vmrun_vcpu *vcpu)
 		return 0;
 
 	while (vmrun_mmu_available_pages(vcpu->vmrun) < KVM_REFILL_PAGES) {
-		if (!prepare_zap_oldest_mmu_page(vcpu->vmrun, &invalid_list))
+		if (!prepare_zap_victim_mmu_page(vcpu->vmrun, &invalid_list))
 			break;
 
 		++vcpu->vmrun->stat.mmu_recycled;
@@ -4901,6 +7125,9 @@ int vmrun_mmu_create(struct vmrun_vcpu *vcpu)
 	vcpu->arch.mmu.translate_gpa = translate_gpa;
 	vcpu->arch.nested_mmu.translate_gpa = translate_nested_gpa;
 
+	mutex_init(&vcpu->mmu_refill_lock);
+	INIT_WORK(&vcpu->mmu_refill_work, mmu_refill_memory_caches);
+
 	return alloc_mmu_pages(vcpu);
 }
 
@@ -4913,25 +7140,75 @@ void vmrun_mmu_setup(struct vmrun_vcpu *vcpu)
 
 static void vmrun_mmu_invalidate_zap_pages_in_memslot(struct vmrun *vmrun,
 			struct vmrun_memory_slot *slot,
-			struct vmrun_page_track_notifier_node *node)
-{
-	vmrun_mmu_invalidate_zap_all_pages(vmrun);
-}
+			struct vmrun_page_track_notifier_node *node);
+static void mmu_recover_huge_pages_work(struct work_struct *work);
+static void vmrun_zap_obsolete_pages(struct work_struct *work);
+static int mmu_register_shrinker(struct vmrun *vmrun);
 
-void vmrun_mmu_init_vm(struct vmrun *vmrun)
+int vmrun_mmu_init_vm(struct vmrun *vmrun)
 {
 	struct vmrun_page_track_notifier_node *node = &vmrun->arch.mmu_sp_tracker;
 
+	vmrun->mmu_page_hash_shift = VMRUN_MMU_HASH_MIN_SHIFT;
+	vmrun->mmu_page_hash = kvzalloc(sizeof(struct hlist_head) <<
+					VMRUN_MMU_HASH_MIN_SHIFT, GFP_KERNEL);
+	if (!vmrun->mmu_page_hash)
+		return -ENOMEM;
+
+	vmrun->mmu_reclaim_history_shift = VMRUN_MMU_RECLAIM_HISTORY_MIN_SHIFT;
+	vmrun->mmu_reclaim_history =
+		kvzalloc(sizeof(struct vmrun_mmu_reclaimed_page) <<
+			 VMRUN_MMU_RECLAIM_HISTORY_MIN_SHIFT, GFP_KERNEL);
+	if (!vmrun->mmu_reclaim_history) {
+		kvfree(vmrun->mmu_page_hash);
+		return -ENOMEM;
+	}
+
 	node->track_write = vmrun_mmu_pte_write;
 	node->track_flush_slot = vmrun_mmu_invalidate_zap_pages_in_memslot;
 	vmrun_page_track_register_notifier(vmrun, node);
+
+	INIT_LIST_HEAD(&vmrun->tdp_mmu_roots);
+	INIT_LIST_HEAD(&vmrun->tdp_mmu_pages);
+	spin_lock_init(&vmrun->tdp_mmu_pages_lock);
+	vmrun->tdp_mmu_enabled = tdp_enabled && tdp_mmu_enabled;
+
+	INIT_LIST_HEAD(&vmrun->obsolete_mmu_pages);
+	INIT_WORK(&vmrun->zap_obsolete_work, vmrun_zap_obsolete_pages);
+
+	INIT_DELAYED_WORK(&vmrun->recover_huge_pages_work,
+			  mmu_recover_huge_pages_work);
+	vmrun->recover_huge_pages_slot = -1;
+
+	if (mmu_register_shrinker(vmrun)) {
+		vmrun_page_track_unregister_notifier(vmrun, node);
+		kvfree(vmrun->mmu_reclaim_history);
+		kvfree(vmrun->mmu_page_hash);
+		return -ENOMEM;
+	}
+	return 0;
 }
 
 void vmrun_mmu_uninit_vm(struct vmrun *vmrun)
 {
 	struct vmrun_page_track_notifier_node *node = &vmrun->arch.mmu_sp_tracker;
 
+	unregister_shrinker(&vmrun->mmu_shrinker);
+	cancel_delayed_work_sync(&vmrun->recover_huge_pages_work);
+	flush_work(&vmrun->zap_obsolete_work);
 	vmrun_page_track_unregister_notifier(vmrun, node);
+	mmu_free_split_caches(vmrun);
+
+	if (vmrun->tdp_mmu_enabled) {
+		WARN_ON(!list_empty(&vmrun->tdp_mmu_roots));
+		/* Wait for the RCU callbacks freeing TDP MMU pages. */
+		rcu_barrier();
+	}
+
+	kvfree(vmrun->mmu_reclaim_history);
+	vmrun->mmu_reclaim_history = NULL;
+	kvfree(vmrun->mmu_page_hash);
+	vmrun->mmu_page_hash = NULL;
 }
 
 /* The return value indicates if tlb flush on all vcpus is needed. */
@@ -4951,12 +7228,12 @@ slot_handle_level_range(struct vmrun *vmrun, struct vmrun_memory_slot *memslot,
 		if (iterator.rmap)
 			flush |= fn(vmrun, iterator.rmap);
 
-		if (need_resched() || spin_needbreak(&vmrun->mmu_lock)) {
+		if (need_resched()) {
 			if (flush && lock_flush_tlb) {
 				vmrun_flush_remote_tlbs(vmrun);
 				flush = false;
 			}
-			cond_resched_lock(&vmrun->mmu_lock);
+			vmrun_cond_resched_mmu_lock(vmrun);
 		}
 	}
 
@@ -5009,7 +7286,7 @@ void vmrun_zap_gfn_range(struct vmrun *vmrun, gfn_t gfn_start, gfn_t gfn_end)
 	struct vmrun_memory_slot *memslot;
 	int i;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	for (i = 0; i < KVM_ADDRESS_SPACE_NUM; i++) {
 		slots = __vmrun_memslots(vmrun, i);
 		vmrun_for_each_memslot(memslot, slots) {
@@ -5026,7 +7303,102 @@ void vmrun_zap_gfn_range(struct vmrun *vmrun, gfn_t gfn_start, gfn_t gfn_end)
 		}
 	}
 
-	spin_unlock(&vmrun->mmu_lock);
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_zap_gfn_range(vmrun, gfn_start, gfn_end);
+
+	write_unlock(&vmrun->mmu_lock);
+}
+
+/*
+ * Free the pages prepared on @invalid_list, or only flush the TLBs if there
+ * are none and @flush is set; either way nothing is left pending, as must be
+ * the case before mmu_lock can be dropped.
+ */
+static void vmrun_mmu_commit_zap_or_flush(struct vmrun *vmrun,
+					  struct list_head *invalid_list,
+					  bool flush)
+{
+	if (!list_empty(invalid_list))
+		vmrun_mmu_commit_zap_page(vmrun, invalid_list);
+	else if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+}
+
+/*
+ * The page-track flush_slot notifier: @slot is being deleted or moved.
+ * Only its own mappings are zapped, the leaf SPTEs through its rmaps and
+ * the shadow pages whose gfn lies in it, instead of bumping the MMU
+ * generation and having every vCPU rebuild its whole MMU.
+ */
+static void vmrun_mmu_invalidate_zap_pages_in_memslot(struct vmrun *vmrun,
+			struct vmrun_memory_slot *slot,
+			struct vmrun_page_track_notifier_node *node)
+{
+	gfn_t start = slot->base_gfn, end = slot->base_gfn + slot->npages;
+	struct vmrun_mmu_page *sp, *tmp;
+	LIST_HEAD(invalid_list);
+	bool flush;
+	gfn_t gfn;
+
+	/* Obsolete pages in the slot must go while it still exists. */
+	flush_work(&vmrun->zap_obsolete_work);
+
+	write_lock(&vmrun->mmu_lock);
+
+	flush = slot_handle_all_level(vmrun, slot, vmrun_zap_rmapp, true);
+
+	/*
+	 * Look the shadow pages up by gfn for small slots, and walk all of
+	 * them when there are fewer pages than gfns in the slot.
+	 */
+	if (slot->npages <= vmrun->arch.n_used_mmu_pages) {
+		for (gfn = start; gfn < end; gfn++) {
+			for_each_valid_sp(vmrun, sp, gfn)
+				if (sp->gfn == gfn)
+					vmrun_mmu_prepare_zap_page(vmrun, sp,
+								   &invalid_list);
+
+			if (need_resched()) {
+				vmrun_mmu_commit_zap_or_flush(vmrun,
+							      &invalid_list,
+							      flush);
+				flush = false;
+				vmrun_cond_resched_mmu_lock(vmrun);
+			}
+		}
+	} else {
+restart:
+		list_for_each_entry_safe(sp, tmp, &vmrun->arch.active_mmu_pages,
+					 link) {
+			if (sp->role.invalid || sp->gfn < start || sp->gfn >= end)
+				continue;
+
+			/* Zapped unsync children may include @tmp. */
+			if (vmrun_mmu_prepare_zap_page(vmrun, sp,
+						       &invalid_list) > 1)
+				goto restart;
+
+			if (need_resched()) {
+				vmrun_mmu_commit_zap_or_flush(vmrun,
+							      &invalid_list,
+							      flush);
+				flush = false;
+				vmrun_cond_resched_mmu_lock(vmrun);
+				goto restart;
+			}
+		}
+	}
+
+	/*
+	 * The TDP MMU zap can yield mmu_lock too, and flushes what it zaps
+	 * by itself.
+	 */
+	vmrun_mmu_commit_zap_or_flush(vmrun, &invalid_list, flush);
+
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_zap_gfn_range(vmrun, start, end);
+
+	write_unlock(&vmrun->mmu_lock);
 }
 
 static bool slot_rmap_write_protect(struct vmrun *vmrun,
@@ -5040,10 +7412,13 @@ void vmrun_mmu_slot_remove_write_access(struct vmrun *vmrun,
 {
 	bool flush;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	flush = slot_handle_all_level(vmrun, memslot, slot_rmap_write_protect,
 				      false);
-	spin_unlock(&vmrun->mmu_lock);
+	if (vmrun->tdp_mmu_enabled)
+		flush |= vmrun_tdp_mmu_wrprot_slot(vmrun, memslot,
+						   PT_PAGE_TABLE_LEVEL);
+	write_unlock(&vmrun->mmu_lock);
 
 	/*
 	 * vmrun_mmu_slot_remove_write_access() and vmrun_vm_ioctl_get_dirty_log()
@@ -5100,24 +7475,227 @@ restart:
 	return need_tlb_flush;
 }
 
-void vmrun_mmu_zap_collapsible_sptes(struct vmrun *vmrun,
-				   const struct vmrun_memory_slot *memslot)
+/*
+ * Huge pages are rebuilt in place once dirty logging stops, a chunk of
+ * 2MB frames per run of a per-VM delayed work, so that neither the vCPUs
+ * nor the ioctl that turned logging off stall on a large slot.
+ */
+static int recover_huge_pages_chunk = 512;
+module_param(recover_huge_pages_chunk, int, 0644);
+
+static unsigned int recover_huge_pages_period_ms = 10;
+module_param(recover_huge_pages_period_ms, uint, 0644);
+
+/*
+ * Replace the direct page table at @level - 1 that maps @gfn by a huge
+ * SPTE in its parent.  Only tables with a single parent are considered,
+ * which for the direct map is always the case outside of roots.
+ */
+static bool mmu_recover_huge_page(struct vmrun *vmrun,
+				  struct vmrun_memory_slot *slot, gfn_t gfn,
+				  int level, struct list_head *invalid_list)
+{
+	struct vmrun_mmu_page *sp, *parent_sp;
+	u64 *parent_sptep, huge_spte;
+
+	if (__mmu_gfn_lpage_is_disallowed(gfn, level, slot))
+		return false;
+
+	for_each_valid_sp(vmrun, sp, gfn) {
+		if (sp->gfn != gfn || !sp->role.direct ||
+		    sp->role.level != level - 1 || sp->root_count)
+			continue;
+
+		parent_sptep = pte_list_single(&sp->parent_ptes);
+		if (!parent_sptep)
+			continue;
+
+		parent_sp = page_header(__pa(parent_sptep));
+		if (!parent_sp->role.direct || is_obsolete_sp(vmrun, parent_sp))
+			continue;
+
+		if (!make_huge_spte_from_table(sp->spt, level, &huge_spte) ||
+		    !host_pfn_is_huge(spte_to_pfn(huge_spte), level))
+			continue;
+
+		/*
+		 * Zapping the table clears the parent SPTE and moves the A/D
+		 * state of the small SPTEs to the pages; the table is freed
+		 * only after the TLB flush in vmrun_mmu_commit_zap_page.
+		 */
+		vmrun_mmu_prepare_zap_page(vmrun, sp, invalid_list);
+		mmu_spte_set(parent_sptep, huge_spte);
+		__rmap_add(vmrun, &vmrun->split_desc_cache, parent_sptep, gfn);
+		++vmrun->stat.lpages;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Recover the huge mappings at @level whose frame ends in (start, end].
+ * Called with mmu_lock held for write; zapped page tables are committed
+ * before the lock is dropped.
+ */
+static void mmu_recover_huge_pages_range(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t start, gfn_t end, int level)
+{
+	gfn_t pages = VMRUN_PAGES_PER_HPAGE(level);
+	LIST_HEAD(invalid_list);
+	gfn_t gfn;
+
+	for (gfn = round_down(start, pages); gfn + pages <= end; gfn += pages) {
+		if (mmu_split_caches_short(vmrun, 1)) {
+			vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+			if (mmu_topup_split_caches(vmrun, 1))
+				break;
+		}
+
+		mmu_recover_huge_page(vmrun, slot, gfn, level, &invalid_list);
+
+		if (need_resched()) {
+			vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+			vmrun_cond_resched_mmu_lock(vmrun);
+		}
+	}
+
+	vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_recover_huge_pages(vmrun, slot,
+						 round_down(start, pages),
+						 round_down(end, pages), level);
+}
+
+static void mmu_recover_huge_pages_chunk(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t start, gfn_t end)
+{
+	bool flush;
+	int level;
+
+	write_lock(&vmrun->mmu_lock);
+
+	for (level = PT_DIRECTORY_LEVEL; level <= PT_MAX_HUGEPAGE_LEVEL; level++)
+		mmu_recover_huge_pages_range(vmrun, slot, start, end, level);
+
+	/*
+	 * Tables that are not fully populated cannot be replaced in place;
+	 * zap their small SPTEs so that faults create the huge mappings.
+	 */
+	flush = slot_handle_level_range(vmrun, slot,
+					vmrun_mmu_zap_collapsible_spte,
+					PT_PAGE_TABLE_LEVEL, PT_PAGE_TABLE_LEVEL,
+					start, end - 1, true);
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_zap_collapsible_sptes(vmrun, slot, start, end);
+
+	write_unlock(&vmrun->mmu_lock);
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+}
+
+static void mmu_recover_huge_pages_work(struct work_struct *work)
+{
+	struct vmrun *vmrun = container_of(to_delayed_work(work), struct vmrun,
+					   recover_huge_pages_work);
+	int chunk = max(READ_ONCE(recover_huge_pages_chunk), 1);
+	struct vmrun_memory_slot *slot;
+	bool more = false;
+	gfn_t start, end;
+	int as_id, id;
+
+	mutex_lock(&vmrun->slots_lock);
+
+	for (as_id = 0; as_id < VMRUN_ADDRESS_SPACE_NUM; as_id++) {
+		id = find_first_bit(vmrun->recover_huge_pages_slots[as_id],
+				    VMRUN_MEM_SLOTS_NUM);
+		if (id < VMRUN_MEM_SLOTS_NUM)
+			break;
+	}
+	if (as_id == VMRUN_ADDRESS_SPACE_NUM)
+		goto out;
+
+	slot = id_to_memslot(__vmrun_memslots(vmrun, as_id), id);
+	if (vmrun->recover_huge_pages_slot != ((as_id << 16) | id)) {
+		vmrun->recover_huge_pages_slot = (as_id << 16) | id;
+		vmrun->recover_huge_pages_gfn = slot->base_gfn;
+	}
+
+	start = vmrun->recover_huge_pages_gfn;
+	end = min_t(gfn_t, slot->base_gfn + slot->npages,
+		    round_down(start, VMRUN_PAGES_PER_HPAGE(PT_DIRECTORY_LEVEL)) +
+		    (gfn_t)chunk * VMRUN_PAGES_PER_HPAGE(PT_DIRECTORY_LEVEL));
+
+	if (slot->npages && !(slot->flags & VMRUN_MEM_LOG_DIRTY_PAGES) &&
+	    start < end)
+		mmu_recover_huge_pages_chunk(vmrun, slot, start, end);
+	else
+		end = slot->base_gfn + slot->npages;
+
+	if (end >= slot->base_gfn + slot->npages) {
+		clear_bit(id, vmrun->recover_huge_pages_slots[as_id]);
+		vmrun->recover_huge_pages_slot = -1;
+	} else {
+		vmrun->recover_huge_pages_gfn = end;
+	}
+
+	for (as_id = 0; as_id < VMRUN_ADDRESS_SPACE_NUM; as_id++)
+		more |= !bitmap_empty(vmrun->recover_huge_pages_slots[as_id],
+				      VMRUN_MEM_SLOTS_NUM);
+	if (more)
+		schedule_delayed_work(&vmrun->recover_huge_pages_work,
+			msecs_to_jiffies(READ_ONCE(recover_huge_pages_period_ms)));
+out:
+	mutex_unlock(&vmrun->slots_lock);
+}
+
+/*
+ * Dirty logging was turned off for @memslot: rebuild the huge mappings
+ * that were split for it, in the background.  Called with slots_lock held.
+ */
+void vmrun_mmu_start_huge_page_recovery(struct vmrun *vmrun, int as_id,
+					const struct vmrun_memory_slot *memslot)
+{
+	lockdep_assert_held(&vmrun->slots_lock);
+
+	set_bit(memslot->id, vmrun->recover_huge_pages_slots[as_id]);
+	if (vmrun->recover_huge_pages_slot == ((as_id << 16) | memslot->id))
+		vmrun->recover_huge_pages_slot = -1;
+
+	schedule_delayed_work(&vmrun->recover_huge_pages_work, 0);
+}
+EXPORT_SYMBOL_GPL(vmrun_mmu_start_huge_page_recovery);
+
+/*
+ * @memslot is going away or dirty logging was turned back on.  A run
+ * already in progress finishes its chunk under slots_lock before this
+ * can be called.
+ */
+void vmrun_mmu_stop_huge_page_recovery(struct vmrun *vmrun, int as_id,
+				       const struct vmrun_memory_slot *memslot)
 {
-	/* FIXME: const-ify all uses of struct vmrun_memory_slot.  */
-	spin_lock(&vmrun->mmu_lock);
-	slot_handle_leaf(vmrun, (struct vmrun_memory_slot *)memslot,
-			 vmrun_mmu_zap_collapsible_spte, true);
-	spin_unlock(&vmrun->mmu_lock);
+	lockdep_assert_held(&vmrun->slots_lock);
+
+	clear_bit(memslot->id, vmrun->recover_huge_pages_slots[as_id]);
+	if (vmrun->recover_huge_pages_slot == ((as_id << 16) | memslot->id))
+		vmrun->recover_huge_pages_slot = -1;
 }
+EXPORT_SYMBOL_GPL(vmrun_mmu_stop_huge_page_recovery);
 
 void vmrun_mmu_slot_leaf_clear_dirty(struct vmrun *vmrun,
 				   struct vmrun_memory_slot *memslot)
 {
 	bool flush;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	flush = slot_handle_leaf(vmrun, memslot, __rmap_clear_dirty, false);
-	spin_unlock(&vmrun->mmu_lock);
+	if (vmrun->tdp_mmu_enabled)
+		flush |= vmrun_tdp_mmu_clear_dirty_slot(vmrun, memslot);
+	write_unlock(&vmrun->mmu_lock);
 
 	lockdep_assert_held(&vmrun->slots_lock);
 
@@ -5137,10 +7715,13 @@ void vmrun_mmu_slot_largepage_remove_write_access(struct vmrun *vmrun,
 {
 	bool flush;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	flush = slot_handle_large_level(vmrun, memslot, slot_rmap_write_protect,
 					false);
-	spin_unlock(&vmrun->mmu_lock);
+	if (vmrun->tdp_mmu_enabled)
+		flush |= vmrun_tdp_mmu_wrprot_slot(vmrun, memslot,
+						   PT_DIRECTORY_LEVEL);
+	write_unlock(&vmrun->mmu_lock);
 
 	/* see vmrun_mmu_slot_remove_write_access */
 	lockdep_assert_held(&vmrun->slots_lock);
@@ -5150,14 +7731,143 @@ void vmrun_mmu_slot_largepage_remove_write_access(struct vmrun *vmrun,
 }
 EXPORT_SYMBOL_GPL(vmrun_mmu_slot_largepage_remove_write_access);
 
+/*
+ * Replace the huge SPTE at @huge_sptep with a fully populated page table
+ * one level down.  Returns 0 if the SPTE was split, -EAGAIN if mmu_lock
+ * was dropped to refill the split caches, -ENOMEM if that failed, and 1
+ * if the SPTE is left to the fault path.
+ */
+static int mmu_split_huge_spte(struct vmrun *vmrun, u64 *huge_sptep)
+{
+	struct vmrun_mmu_page *huge_sp = page_header(__pa(huge_sptep));
+	union vmrun_mmu_page_role role;
+	struct vmrun_memory_slot *slot;
+	struct vmrun_mmu_page *sp;
+	u64 huge_spte = *huge_sptep;
+	gfn_t gfn, child_gfn;
+	int i, descs = 0;
+
+	/*
+	 * Below a shadowed guest huge page the access of the child depends
+	 * on the guest PDE, and obsolete pages are about to be zapped.
+	 */
+	if (!huge_sp->role.direct || is_obsolete_sp(vmrun, huge_sp))
+		return 1;
+
+	gfn = vmrun_mmu_page_get_gfn(huge_sp, huge_sptep - huge_sp->spt);
+	role = huge_sp->role;
+	role.level--;
+
+	/* A page table for this range already exists, let a fault relink it. */
+	for_each_valid_sp(vmrun, sp, gfn)
+		if (sp->gfn == gfn && sp->role.word == role.word)
+			return 1;
+
+	/* Every gfn that is mapped elsewhere may need a pte_list_desc. */
+	slot = __gfn_to_memslot(vmrun_memslots_for_spte_role(vmrun, role), gfn);
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		child_gfn = gfn + i * VMRUN_PAGES_PER_HPAGE(role.level);
+		if (__gfn_to_rmap(child_gfn, role.level, slot)->val)
+			descs++;
+	}
+
+	/* The parent's own rmap entry for the child page table. */
+	descs++;
+	if (descs > VMRUN_NR_MEM_OBJS)
+		return 1;
+
+	if (mmu_split_caches_short(vmrun, descs))
+		return mmu_topup_split_caches(vmrun, descs) ? -ENOMEM : -EAGAIN;
+
+	sp = __vmrun_mmu_alloc_page(vmrun, &vmrun->split_page_header_cache,
+				    &vmrun->split_page_cache, 1);
+	sp->gfn = gfn;
+	sp->role = role;
+	sp->mmu_valid_gen = vmrun->arch.mmu_valid_gen;
+	hlist_add_head(&sp->hash_link, mmu_page_hash_bucket(vmrun, gfn));
+
+	for (i = 0; i < PT64_ENT_PER_PAGE; i++) {
+		sp->spt[i] = make_huge_page_split_spte(huge_spte, role.level, i);
+		__rmap_add(vmrun, &vmrun->split_desc_cache, &sp->spt[i],
+			   gfn + i * VMRUN_PAGES_PER_HPAGE(role.level));
+	}
+
+	if (role.level > PT_PAGE_TABLE_LEVEL)
+		vmrun->stat.lpages += PT64_ENT_PER_PAGE;
+
+	__drop_large_spte(vmrun, huge_sptep);
+	__link_shadow_page(&vmrun->split_desc_cache, huge_sptep, sp);
+
+	return 0;
+}
+
+static bool slot_rmap_split_huge_pages(struct vmrun *vmrun,
+				       struct vmrun_rmap_head *rmap_head)
+{
+	struct rmap_iterator iter;
+	bool flush = false;
+	u64 *sptep;
+
+restart:
+	for_each_rmap_spte(rmap_head, &iter, sptep) {
+		switch (mmu_split_huge_spte(vmrun, sptep)) {
+		case 0:
+			flush = true;
+			goto restart;
+		case -EAGAIN:
+			goto restart;
+		case -ENOMEM:
+			return flush;
+		}
+	}
+
+	return flush;
+}
+
+/*
+ * Split the huge mappings of @memslot when dirty logging is turned on.
+ * Dirty logging works at 4K granularity, and otherwise the first write
+ * to every 2MB or 1GB region faults to demote its mapping, which right
+ * at the start of a migration makes the vCPUs fault in storms.  Levels
+ * are processed top-down so 1GB mappings are split all the way to 4K.
+ */
+void vmrun_mmu_slot_split_huge_pages(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *memslot)
+{
+	bool flush = false;
+	int level;
+
+	write_lock(&vmrun->mmu_lock);
+	for (level = PT_MAX_HUGEPAGE_LEVEL; level > PT_PAGE_TABLE_LEVEL; level--)
+		flush |= slot_handle_level(vmrun, memslot,
+					   slot_rmap_split_huge_pages,
+					   level, level, false);
+	if (vmrun->tdp_mmu_enabled)
+		flush |= vmrun_tdp_mmu_split_huge_pages(vmrun, memslot);
+	write_unlock(&vmrun->mmu_lock);
+
+	lockdep_assert_held(&vmrun->slots_lock);
+
+	/*
+	 * The new page tables map the same memory as the huge SPTEs they
+	 * replace, so flushing once outside mmu_lock is enough; see
+	 * vmrun_mmu_slot_remove_write_access.
+	 */
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+}
+EXPORT_SYMBOL_GPL(vmrun_mmu_slot_split_huge_pages);
+
 void vmrun_mmu_slot_set_dirty(struct vmrun *vmrun,
 			    struct vmrun_memory_slot *memslot)
 {
 	bool flush;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	flush = slot_handle_all_level(vmrun, memslot, __rmap_set_dirty, false);
-	spin_unlock(&vmrun->mmu_lock);
+	if (vmrun->tdp_mmu_enabled)
+		flush |= vmrun_tdp_mmu_set_dirty_slot(vmrun, memslot);
+	write_unlock(&vmrun->mmu_lock);
 
 	lockdep_assert_held(&vmrun->slots_lock);
 
@@ -5167,69 +7877,78 @@ void vmrun_mmu_slot_set_dirty(struct vmrun *vmrun,
 }
 EXPORT_SYMBOL_GPL(vmrun_mmu_slot_set_dirty);
 
-#define BATCH_ZAP_PAGES	10
-static void vmrun_zap_obsolete_pages(struct vmrun *vmrun)
+#define BATCH_ZAP_PAGES	512
+
+/*
+ * Tear down the shadow pages that vmrun_mmu_invalidate_zap_all_pages()
+ * detached, BATCH_ZAP_PAGES at a time with one TLB flush per batch.  The
+ * vCPUs never use obsolete pages, so they already run on the new
+ * generation meanwhile.
+ */
+static void vmrun_zap_obsolete_pages(struct work_struct *work)
 {
-	struct vmrun_mmu_page *sp, *node;
-	int batch = 0;
+	struct vmrun *vmrun = container_of(work, struct vmrun,
+					   zap_obsolete_work);
+	struct vmrun_mmu_page *sp;
+	LIST_HEAD(invalid_list);
+	int batch = 0, idx;
 
-restart:
-	list_for_each_entry_safe_reverse(sp, node,
-	      &vmrun->arch.active_mmu_pages, link) {
-		int ret;
+	idx = srcu_read_lock(&vmrun->srcu);
+	write_lock(&vmrun->mmu_lock);
 
-		/*
-		 * No obsolete page exists before new created page since
-		 * active_mmu_pages is the FIFO list.
-		 */
-		if (!is_obsolete_sp(vmrun, sp))
-			break;
+	while (!list_empty(&vmrun->obsolete_mmu_pages)) {
+		sp = list_first_entry(&vmrun->obsolete_mmu_pages,
+				      struct vmrun_mmu_page, link);
 
 		/*
-		 * Since we are reversely walking the list and the invalid
-		 * list will be moved to the head, skip the invalid page
-		 * can help us to avoid the infinity list walking.
+		 * A zapped root that a vCPU still uses frees itself; other
+		 * invalid pages were retired by mmu_retire_untracked_page().
 		 */
-		if (sp->role.invalid)
+		if (sp->role.invalid && sp->root_count) {
+			list_move(&sp->link, &vmrun->arch.active_mmu_pages);
 			continue;
-
-		/*
-		 * Need not flush tlb since we only zap the sp with invalid
-		 * generation number.
-		 */
-		if (batch >= BATCH_ZAP_PAGES &&
-		      cond_resched_lock(&vmrun->mmu_lock)) {
-			batch = 0;
-			goto restart;
 		}
 
-		ret = vmrun_mmu_prepare_zap_page(vmrun, sp,
-				&vmrun->arch.zapped_obsolete_pages);
-		batch += ret;
+		/* Live roots move back to active_mmu_pages as well. */
+		batch += vmrun_mmu_prepare_zap_page(vmrun, sp, &invalid_list);
 
-		if (ret)
-			goto restart;
+		if (batch >= BATCH_ZAP_PAGES || need_resched()) {
+			/*
+			 * Should flush tlb before free page tables since
+			 * lockless-walking may use the pages.
+			 */
+			vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+			batch = 0;
+			vmrun_cond_resched_mmu_lock(vmrun);
+		}
 	}
 
-	/*
-	 * Should flush tlb before free page tables since lockless-walking
-	 * may use the pages.
-	 */
-	vmrun_mmu_commit_zap_page(vmrun, &vmrun->arch.zapped_obsolete_pages);
+	vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+
+	write_unlock(&vmrun->mmu_lock);
+	srcu_read_unlock(&vmrun->srcu, idx);
 }
 
 /*
- * Fast invalidate all shadow pages and use lock-break technique
- * to zap obsolete pages.
+ * Fast invalidate all shadow pages: bump the generation and leave the
+ * obsolete pages to vmrun_zap_obsolete_pages().
  *
- * It's required when memslot is being deleted or VM is being
- * destroyed, in these cases, we should ensure that KVM MMU does
- * not use any resource of the being-deleted slot or all slots
- * after calling the function.
+ * The vCPUs stop using the obsolete pages right away, but they are
+ * freed later; whoever frees a memslot that they may reference flushes
+ * zap_obsolete_work first, see vmrun_mmu_invalidate_zap_pages_in_memslot()
+ * and vmrun_mmu_uninit_vm().  Their SPTEs keep mapping guest memory until
+ * then, so callers that need the mappings gone use vmrun_mmu_zap_all().
  */
 void vmrun_mmu_invalidate_zap_all_pages(struct vmrun *vmrun)
 {
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
+	__vmrun_mmu_invalidate_zap_all_pages(vmrun);
+	write_unlock(&vmrun->mmu_lock);
+}
+
+/* vmrun_mmu_invalidate_zap_all_pages() with mmu_lock held for write. */
+static void __vmrun_mmu_invalidate_zap_all_pages(struct vmrun *vmrun)
+{
 	trace_vmrun_mmu_invalidate_zap_all_pages(vmrun);
 	vmrun->arch.mmu_valid_gen++;
 
@@ -5244,13 +7963,26 @@ void vmrun_mmu_invalidate_zap_all_pages(struct vmrun *vmrun)
 	 */
 	vmrun_reload_remote_mmus(vmrun);
 
-	vmrun_zap_obsolete_pages(vmrun);
-	spin_unlock(&vmrun->mmu_lock);
+	/* Detach the obsolete pages and free them in the background. */
+	list_splice_init(&vmrun->arch.active_mmu_pages,
+			 &vmrun->obsolete_mmu_pages);
+	schedule_work(&vmrun->zap_obsolete_work);
+
+	if (vmrun->tdp_mmu_enabled)
+		vmrun_tdp_mmu_zap_all(vmrun);
 }
 
-static bool vmrun_has_zapped_obsolete_pages(struct vmrun *vmrun)
+/*
+ * Like vmrun_mmu_invalidate_zap_all_pages(), but the obsolete pages are
+ * zapped and the TLBs flushed before returning.  For callers after which
+ * no SPTE may map the guest's pages any more, such as the MMU notifier's
+ * ->release: a deferred zap would mark pages accessed or dirty after the
+ * mm has freed them.
+ */
+void vmrun_mmu_zap_all(struct vmrun *vmrun)
 {
-	return unlikely(!list_empty_careful(&vmrun->arch.zapped_obsolete_pages));
+	vmrun_mmu_invalidate_zap_all_pages(vmrun);
+	flush_work(&vmrun->zap_obsolete_work);
 }
 
 void vmrun_mmu_invalidate_mmio_sptes(struct vmrun *vmrun, struct vmrun_memslots *slots)
@@ -5265,78 +7997,68 @@ void vmrun_mmu_invalidate_mmio_sptes(struct vmrun *vmrun, struct vmrun_memslots
 	}
 }
 
+/*
+ * Each VM has its own shrinker, reporting its own MMU pages and zapping
+ * a batch proportional to nr_to_scan under its own mmu_lock, so reclaim
+ * neither serializes on vmrun_lock nor picks VMs in list order.
+ */
 static unsigned long
 mmu_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
 {
-	struct vmrun *vmrun;
-	int nr_to_scan = sc->nr_to_scan;
+	struct vmrun *vmrun = container_of(shrink, struct vmrun, mmu_shrinker);
 	unsigned long freed = 0;
+	unsigned int used;
+	LIST_HEAD(invalid_list);
+	int idx;
 
-	spin_lock(&vmrun_lock);
-
-	list_for_each_entry(vmrun, &vm_list, vm_list) {
-		int idx;
-		LIST_HEAD(invalid_list);
+	idx = srcu_read_lock(&vmrun->srcu);
+	write_lock(&vmrun->mmu_lock);
 
-		/*
-		 * Never scan more than sc->nr_to_scan VM instances.
-		 * Will not hit this condition practically since we do not try
-		 * to shrink more than one VM and it is very unlikely to see
-		 * !n_used_mmu_pages so many times.
-		 */
-		if (!nr_to_scan--)
+	while (freed < sc->nr_to_scan) {
+		used = vmrun->arch.n_used_mmu_pages;
+		if (!prepare_zap_victim_mmu_page(vmrun, &invalid_list))
 			break;
-		/*
-		 * n_used_mmu_pages is accessed without holding vmrun->mmu_lock
-		 * here. We may skip a VM instance errorneosly, but we do not
-		 * want to shrink a VM that only started to populate its MMU
-		 * anyway.
-		 */
-		if (!vmrun->arch.n_used_mmu_pages &&
-		      !vmrun_has_zapped_obsolete_pages(vmrun))
-			continue;
+		freed += used - vmrun->arch.n_used_mmu_pages;
 
-		idx = srcu_read_lock(&vmrun->srcu);
-		spin_lock(&vmrun->mmu_lock);
-
-		if (vmrun_has_zapped_obsolete_pages(vmrun)) {
-			vmrun_mmu_commit_zap_page(vmrun,
-			      &vmrun->arch.zapped_obsolete_pages);
-			goto unlock;
+		if (need_resched()) {
+			vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+			vmrun_cond_resched_mmu_lock(vmrun);
 		}
-
-		if (prepare_zap_oldest_mmu_page(vmrun, &invalid_list))
-			freed++;
-		vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
-
-unlock:
-		spin_unlock(&vmrun->mmu_lock);
-		srcu_read_unlock(&vmrun->srcu, idx);
-
-		/*
-		 * unfair on small ones
-		 * per-vm shrinkers cry out
-		 * sadness comes quickly
-		 */
-		list_move_tail(&vmrun->vm_list, &vm_list);
-		break;
 	}
+	vmrun_mmu_commit_zap_page(vmrun, &invalid_list);
+
+	write_unlock(&vmrun->mmu_lock);
+	srcu_read_unlock(&vmrun->srcu, idx);
 
-	spin_unlock(&vmrun_lock);
-	return freed;
+	vmrun->stat.mmu_shrink_freed += freed;
+	return freed ? freed : SHRINK_STOP;
 }
 
 static unsigned long
 mmu_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
 {
-	return percpu_counter_read_positive(&vmrun_total_used_mmu_pages);
+	struct vmrun *vmrun = container_of(shrink, struct vmrun, mmu_shrinker);
+	unsigned int used, tdp;
+
+	/*
+	 * Only shadow pages can be zapped by mmu_shrink_scan(), so the TDP
+	 * MMU pages are left out.  Both counts are read without holding
+	 * vmrun->mmu_lock.  A VM that only started to populate its MMU may
+	 * be skipped, which is fine.
+	 */
+	used = READ_ONCE(vmrun->arch.n_used_mmu_pages);
+	tdp = READ_ONCE(vmrun->n_tdp_mmu_pages);
+
+	return used > tdp ? used - tdp : 0;
 }
 
-static struct shrinker mmu_shrinker = {
-	.count_objects = mmu_shrink_count,
-	.scan_objects = mmu_shrink_scan,
-	.seeks = DEFAULT_SEEKS * 10,
-};
+static int mmu_register_shrinker(struct vmrun *vmrun)
+{
+	vmrun->mmu_shrinker.count_objects = mmu_shrink_count;
+	vmrun->mmu_shrinker.scan_objects = mmu_shrink_scan;
+	vmrun->mmu_shrinker.seeks = DEFAULT_SEEKS * 10;
+	return register_shrinker(&vmrun->mmu_shrinker);
+}
 
 static void mmu_destroy_caches(void)
 {
@@ -5350,6 +8072,7 @@ int vmrun_mmu_module_init(void)
 {
 	vmrun_mmu_clear_all_pte_masks();
 
+	BUILD_BUG_ON(sizeof(struct pte_list_desc) != 64);
 	pte_list_desc_cache = kmem_cache_create("pte_list_desc",
 					    sizeof(struct pte_list_desc),
 					    0, 0, NULL);
@@ -5362,11 +8085,6 @@ int vmrun_mmu_module_init(void)
 	if (!mmu_page_header_cache)
 		goto nomem;
 
-	if (percpu_counter_init(&vmrun_total_used_mmu_pages, 0, GFP_KERNEL))
-		goto nomem;
-
-	register_shrinker(&mmu_shrinker);
-
 	return 0;
 
 nomem:
@@ -5409,7 +8127,5 @@ void vmrun_mmu_destroy(struct vmrun_vcpu *vcpu)
 void vmrun_mmu_module_exit(void)
 {
 	mmu_destroy_caches();
-	percpu_counter_destroy(&vmrun_total_used_mmu_pages);
-	unregister_shrinker(&mmu_shrinker);
 	mmu_audit_disable();
 }
@@ -47,7 +47,19 @@
 #define PT_PAGE_TABLE_LEVEL 1
 #define PT_MAX_HUGEPAGE_LEVEL (PT_PAGE_TABLE_LEVEL + VMRUN_NR_PAGE_SIZES - 1)
 
-void vmrun_mmu_init_vm(struct vmrun *vmrun);
+/*
+ * Bounds of the per-memslot prefetch window for direct SPTEs, and the
+ * number of pages looked up at once while filling it.
+ */
+#define PTE_PREFETCH_NUM		8
+#define PTE_PREFETCH_MAX		512
+#define PTE_PREFETCH_BATCH		64
+
+/* The shadow page hash grows from 4K to 256K buckets with the MMU. */
+#define VMRUN_MMU_HASH_MIN_SHIFT	12
+#define VMRUN_MMU_HASH_MAX_SHIFT	18
+
+int vmrun_mmu_init_vm(struct vmrun *vmrun);
 void vmrun_mmu_uninit_vm(struct vmrun *kvm);
 void vmrun_mmu_destroy(struct vmrun_vcpu *vcpu);
 int vmrun_mmu_create(struct vmrun_vcpu *vcpu);
@@ -58,7 +70,10 @@ void vmrun_mmu_reset_context(struct vmrun_vcpu *vcpu);
 void vmrun_mmu_invalidate_mmio_sptes(struct vmrun *vmrun, struct vmrun_memslots *slots);
 unsigned int vmrun_mmu_calculate_mmu_pages(struct vmrun *vmrun);
 void vmrun_mmu_change_mmu_pages(struct vmrun *vmrun, unsigned int vmrun_nr_mmu_pages);
-void vmrun_mmu_zap_collapsible_sptes(struct vmrun *vmrun, const struct vmrun_memory_slot *memslot);
+void vmrun_mmu_start_huge_page_recovery(struct vmrun *vmrun, int as_id,
+					const struct vmrun_memory_slot *memslot);
+void vmrun_mmu_stop_huge_page_recovery(struct vmrun *vmrun, int as_id,
+				       const struct vmrun_memory_slot *memslot);
 int vmrun_unmap_hva_range(struct vmrun *vmrun, unsigned long start, unsigned long end);
 int vmrun_age_hva(struct vmrun *vmrun, unsigned long start, unsigned long end);
 int vmrun_test_age_hva(struct vmrun *vmrun, unsigned long hva);
@@ -81,9 +96,26 @@ void vmrun_init_shadow_mmu(struct vmrun_vcpu *vcpu);
 void vmrun_init_shadow_ept_mmu(struct vmrun_vcpu *vcpu, bool execonly,
 			     bool accessed_dirty);
 bool vmrun_can_do_async_pf(struct vmrun_vcpu *vcpu);
+void vmrun_arch_async_page_ready(struct vmrun_vcpu *vcpu,
+				 struct vmrun_async_pf *work);
+int vmrun_setup_async_pf(struct vmrun_vcpu *vcpu, gva_t gva, unsigned long hva,
+			 struct vmrun_arch_async_pf *arch);
+bool vmrun_find_async_pf_gfn(struct vmrun_vcpu *vcpu, gfn_t gfn);
+void vmrun_check_async_pf_completion(struct vmrun_vcpu *vcpu);
+void vmrun_clear_async_pf_completion_queue(struct vmrun_vcpu *vcpu);
 int vmrun_handle_page_fault(struct vmrun_vcpu *vcpu, u64 error_code,
 				u64 fault_address, char *insn, int insn_len,
 				bool need_unprotect);
+int vmrun_mmu_page_fault(struct vmrun_vcpu *vcpu, gva_t cr2, u64 error_code,
+		       void *insn, int insn_len);
+
+void vmrun_enable_tdp(void);
+void vmrun_disable_tdp(void);
+void vmrun_set_tdp_cr3(struct vmrun_vcpu *vcpu, unsigned long root);
+int vmrun_get_tdp_level(struct vmrun_vcpu *vcpu);
+int vmrun_get_lpage_level(void);
+unsigned long vmrun_host_page_size(struct vmrun *vmrun, gfn_t gfn);
+void vmrun_vcpu_mark_page_dirty(struct vmrun_vcpu *vcpu, gfn_t gfn);
 
 static inline unsigned int vmrun_mmu_available_pages(struct vmrun *vmrun)
 {
@@ -183,11 +215,51 @@ static inline u8 permission_fault(struct vmrun_vcpu *vcpu,
 }
 
 void vmrun_mmu_invalidate_zap_all_pages(struct vmrun *vmrun);
+void vmrun_mmu_zap_all(struct vmrun *vmrun);
+void vmrun_mmu_slot_split_huge_pages(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *memslot);
 void vmrun_zap_gfn_range(struct vmrun *vmrun, gfn_t gfn_start, gfn_t gfn_end);
 
 void vmrun_mmu_gfn_disallow_lpage(struct vmrun_memory_slot *slot, gfn_t gfn);
 void vmrun_mmu_gfn_allow_lpage(struct vmrun_memory_slot *slot, gfn_t gfn);
+void vmrun_mmu_gfn_range_disallow_lpage(struct vmrun_memory_slot *slot,
+					gfn_t start, unsigned long npages);
+void vmrun_mmu_gfn_range_allow_lpage(struct vmrun_memory_slot *slot,
+				     gfn_t start, unsigned long npages);
 bool vmrun_mmu_slot_gfn_write_protect(struct vmrun *vmrun,
 				    struct vmrun_memory_slot *slot, u64 gfn);
+bool vmrun_mmu_slot_gfn_zap(struct vmrun *vmrun,
+			    struct vmrun_memory_slot *slot, u64 gfn);
 int vmrun_arch_write_log_dirty(struct vmrun_vcpu *vcpu);
+
+hpa_t vmrun_tdp_mmu_get_vcpu_root_hpa(struct vmrun_vcpu *vcpu);
+void vmrun_tdp_mmu_put_root(struct vmrun *vmrun, struct vmrun_mmu_page *root);
+bool vmrun_tdp_mmu_zap_gfn_range(struct vmrun *vmrun, gfn_t start, gfn_t end);
+void vmrun_tdp_mmu_zap_all(struct vmrun *vmrun);
+int vmrun_tdp_mmu_unmap_hva_range(struct vmrun *vmrun, unsigned long start,
+				  unsigned long end);
+void vmrun_tdp_mmu_set_spte_hva(struct vmrun *vmrun, unsigned long hva);
+int vmrun_tdp_mmu_age_hva_range(struct vmrun *vmrun, unsigned long start,
+				unsigned long end);
+int vmrun_tdp_mmu_test_age_hva(struct vmrun *vmrun, unsigned long hva);
+bool vmrun_tdp_mmu_wrprot_slot(struct vmrun *vmrun,
+			       struct vmrun_memory_slot *slot, int min_level);
+bool vmrun_tdp_mmu_clear_dirty_slot(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot);
+bool vmrun_tdp_mmu_set_dirty_slot(struct vmrun *vmrun,
+				  struct vmrun_memory_slot *slot);
+void vmrun_tdp_mmu_clear_dirty_pt_masked(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t gfn, unsigned long mask,
+					 bool wrprot);
+bool vmrun_tdp_mmu_write_protect_gfn(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot, gfn_t gfn);
+void vmrun_tdp_mmu_zap_collapsible_sptes(struct vmrun *vmrun,
+					 const struct vmrun_memory_slot *slot,
+					 gfn_t start, gfn_t end);
+void vmrun_tdp_mmu_recover_huge_pages(struct vmrun *vmrun,
+				      struct vmrun_memory_slot *slot,
+				      gfn_t start, gfn_t end, int level);
+bool vmrun_tdp_mmu_split_huge_pages(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot);
 #endif
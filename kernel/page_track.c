@@ -1,8 +1,8 @@
 /*
  * Support VMRUN gust page tracking
  *
- * This feature allows us to track page access in guest. Currently, only
- * write access is tracked.
+ * This feature allows us to track page access in guest: writes to a
+ * page, or the first access of any kind.
  *
  * Copyright(C) 2015 Intel Corporation.
  *
@@ -17,29 +17,56 @@
 #include "page_track.h"
 #include "mmu.h"
 
+static void gfn_track_free(struct vmrun_gfn_track *track)
+{
+	struct vmrun_gfn_track_overflow *entry, *tmp;
+	struct radix_tree_iter iter;
+	void __rcu **p;
+
+	rbtree_postorder_for_each_entry_safe(entry, tmp, &track->overflow, node)
+		kfree(entry);
+
+	radix_tree_for_each_slot(p, &track->owners, &iter, 0)
+		radix_tree_iter_delete(&track->owners, &iter, p);
+
+	kvfree(track);
+}
+
 void vmrun_page_track_free_memslot(struct vmrun_memory_slot *free,
 				 struct vmrun_memory_slot *dont)
 {
 	int i;
 
 	for (i = 0; i < VMRUN_PAGE_TRACK_MAX; i++)
-		if (!dont || free->arch.gfn_track[i] !=
-		      dont->arch.gfn_track[i]) {
-			kvfree(free->arch.gfn_track[i]);
+		if (free->arch.gfn_track[i] && (!dont ||
+		    free->arch.gfn_track[i] != dont->arch.gfn_track[i])) {
+			gfn_track_free(free->arch.gfn_track[i]);
 			free->arch.gfn_track[i] = NULL;
 		}
 }
 
+/*
+ * One bit per page rather than a counter: 32 KiB per GiB of guest
+ * memory instead of 512 KiB.  The overflow map only allocates for the
+ * pages that are tracked more than once.
+ */
 int vmrun_page_track_create_memslot(struct vmrun_memory_slot *slot,
 				  unsigned long npages)
 {
+	struct vmrun_gfn_track *track;
 	int  i;
 
 	for (i = 0; i < VMRUN_PAGE_TRACK_MAX; i++) {
-		slot->arch.gfn_track[i] = kvzalloc(npages *
-					    sizeof(*slot->arch.gfn_track[i]), GFP_KERNEL);
-		if (!slot->arch.gfn_track[i])
+		track = kvzalloc(sizeof(*track) +
+				 BITS_TO_LONGS(npages) * sizeof(long),
+				 GFP_KERNEL);
+		if (!track)
 			goto track_free;
+
+		track->overflow = RB_ROOT;
+		/* Owners are added under mmu_lock. */
+		INIT_RADIX_TREE(&track->owners, GFP_ATOMIC | __GFP_NOWARN);
+		slot->arch.gfn_track[i] = track;
 	}
 
 	return 0;
@@ -57,19 +84,169 @@ static inline bool page_track_mode_is_valid(enum vmrun_page_track_mode mode)
 	return true;
 }
 
-static void update_gfn_track(struct vmrun_memory_slot *slot, gfn_t gfn,
-			     enum vmrun_page_track_mode mode, short count)
+/* The first overflow entry at or after @index, if any. */
+static struct vmrun_gfn_track_overflow *
+gfn_track_overflow_next(struct vmrun_gfn_track *track, unsigned long index)
 {
-	int index, val;
+	struct vmrun_gfn_track_overflow *entry, *next = NULL;
+	struct rb_node *node = track->overflow.rb_node;
+
+	while (node) {
+		entry = rb_entry(node, struct vmrun_gfn_track_overflow, node);
+		if (entry->index < index) {
+			node = node->rb_right;
+		} else {
+			next = entry;
+			node = node->rb_left;
+		}
+	}
+
+	return next;
+}
+
+static void gfn_track_overflow_insert(struct vmrun_gfn_track *track,
+				      struct vmrun_gfn_track_overflow *new)
+{
+	struct rb_node **link = &track->overflow.rb_node, *parent = NULL;
+	struct vmrun_gfn_track_overflow *entry;
+
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct vmrun_gfn_track_overflow, node);
+		if (new->index < entry->index)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &track->overflow);
+}
+
+/*
+ * Add @count to the number of times @gfn is tracked.  A page tracked a
+ * second time needs an overflow entry, taken from @cache if it has one;
+ * mmu_lock is held, so it is otherwise allocated atomically, and
+ * -ENOMEM is returned with nothing changed if that fails.
+ */
+static int update_gfn_track(struct vmrun_memory_slot *slot, gfn_t gfn,
+			    enum vmrun_page_track_mode mode, short count,
+			    struct vmrun_mmu_memory_cache *cache)
+{
+	struct vmrun_gfn_track *track = slot->arch.gfn_track[mode];
+	struct vmrun_gfn_track_overflow *entry = NULL;
+	unsigned long index;
+	int old = 0, val;
 
 	index = gfn_to_index(gfn, slot->base_gfn, PT_PAGE_TABLE_LEVEL);
 
-	val = slot->arch.gfn_track[mode][index];
+	if (test_bit(index, track->bitmap)) {
+		entry = gfn_track_overflow_next(track, index);
+		if (entry && entry->index != index)
+			entry = NULL;
+		old = entry ? entry->count + 1 : 1;
+	}
+	val = old + count;
+
+	if (WARN_ON(val < 0 || val > USHRT_MAX))
+		return -EINVAL;
+
+	if (val > 1 && !entry) {
+		if (cache && cache->nobjs)
+			entry = cache->objects[--cache->nobjs];
+		else
+			entry = kzalloc(sizeof(*entry),
+					GFP_ATOMIC | __GFP_NOWARN);
+		if (!entry)
+			return -ENOMEM;
+
+		entry->index = index;
+		gfn_track_overflow_insert(track, entry);
+	}
 
-	if (WARN_ON(val + count < 0 || val + count > USHRT_MAX))
-		return;
+	if (val > 1) {
+		entry->count = val - 1;
+	} else if (entry) {
+		rb_erase(&entry->node, &track->overflow);
+		kfree(entry);
+	}
 
-	slot->arch.gfn_track[mode][index] += count;
+	if (!old) {
+		set_bit(index, track->bitmap);
+		WRITE_ONCE(track->tracked, track->tracked + 1);
+	} else if (!val) {
+		clear_bit(index, track->bitmap);
+		WRITE_ONCE(track->tracked, track->tracked - 1);
+	}
+
+	return 0;
+}
+
+/*
+ * update_gfn_track() for each page in [start, start + npages).  A range
+ * nobody tracks yet, or one tracked exactly once, has its bits flipped
+ * in one go; anything else is done page by page.  If adding fails, the
+ * pages already done are dropped again.
+ */
+static int update_gfn_track_range(struct vmrun_memory_slot *slot, gfn_t start,
+				  unsigned long npages,
+				  enum vmrun_page_track_mode mode, short count)
+{
+	struct vmrun_gfn_track *track = slot->arch.gfn_track[mode];
+	struct vmrun_gfn_track_overflow *next;
+	unsigned long first, last;
+	gfn_t gfn;
+	int r;
+
+	first = gfn_to_index(start, slot->base_gfn, PT_PAGE_TABLE_LEVEL);
+	last = first + npages - 1;
+
+	/* Writers hold mmu_lock, so the non-atomic bitmap ops are fine. */
+	if (count > 0 &&
+	    find_next_bit(track->bitmap, last + 1, first) > last) {
+		bitmap_set(track->bitmap, first, npages);
+		WRITE_ONCE(track->tracked, track->tracked + npages);
+		return 0;
+	}
+
+	if (count < 0 &&
+	    find_next_zero_bit(track->bitmap, last + 1, first) > last) {
+		next = gfn_track_overflow_next(track, first);
+		if (!next || next->index > last) {
+			bitmap_clear(track->bitmap, first, npages);
+			WRITE_ONCE(track->tracked, track->tracked - npages);
+			return 0;
+		}
+	}
+
+	for (gfn = start; gfn < start + npages; gfn++) {
+		r = update_gfn_track(slot, gfn, mode, count, NULL);
+		if (r) {
+			while (gfn-- > start)
+				update_gfn_track(slot, gfn, mode, -count, NULL);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Make the next tracked access to @gfn fault.  Returns true if the
+ * caller has to flush the TLBs.
+ */
+static bool page_track_arm_gfn(struct vmrun *vmrun,
+			       struct vmrun_memory_slot *slot, gfn_t gfn,
+			       enum vmrun_page_track_mode mode)
+{
+	switch (mode) {
+	case VMRUN_PAGE_TRACK_WRITE:
+		return vmrun_mmu_slot_gfn_write_protect(vmrun, slot, gfn);
+	case VMRUN_PAGE_TRACK_ACCESS:
+		return vmrun_mmu_slot_gfn_zap(vmrun, slot, gfn);
+	default:
+		return false;
+	}
 }
 
 /*
@@ -79,20 +256,39 @@ static void update_gfn_track(struct vmrun_memory_slot *slot, gfn_t gfn,
  * It should be called under the protection both of mmu-lock and vmrun->srcu
  * or vmrun->slots_lock.
  *
+ * Returns -ENOMEM, with the page left as it was, if it could not be
+ * tracked.
+ *
  * @vmrun: the guest instance we are interested in.
  * @slot: the @gfn belongs to.
  * @gfn: the guest page.
  * @mode: tracking mode, currently only write track is supported.
  */
-void vmrun_slot_page_track_add_page(struct vmrun *vmrun,
-				  struct vmrun_memory_slot *slot, gfn_t gfn,
-				  enum vmrun_page_track_mode mode)
+int vmrun_slot_page_track_add_page(struct vmrun *vmrun,
+				   struct vmrun_memory_slot *slot, gfn_t gfn,
+				   enum vmrun_page_track_mode mode)
 {
+	return __vmrun_slot_page_track_add_page(vmrun, slot, gfn, mode, NULL);
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_add_page);
+
+/*
+ * vmrun_slot_page_track_add_page() for the MMU, which reserves what
+ * tracking the page may need in @cache before it takes mmu_lock.
+ */
+int __vmrun_slot_page_track_add_page(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot, gfn_t gfn,
+				     enum vmrun_page_track_mode mode,
+				     struct vmrun_mmu_memory_cache *cache)
+{
+	int r;
 
 	if (WARN_ON(!page_track_mode_is_valid(mode)))
-		return;
+		return -EINVAL;
 
-	update_gfn_track(slot, gfn, mode, 1);
+	r = update_gfn_track(slot, gfn, mode, 1, cache);
+	if (r)
+		return r;
 
 	/*
 	 * new track stops large page mapping for the
@@ -100,11 +296,11 @@ void vmrun_slot_page_track_add_page(struct vmrun *vmrun,
 	 */
 	vmrun_mmu_gfn_disallow_lpage(slot, gfn);
 
-	if (mode == VMRUN_PAGE_TRACK_WRITE)
-		if (vmrun_mmu_slot_gfn_write_protect(vmrun, slot, gfn))
-			vmrun_flush_remote_tlbs(vmrun);
+	if (page_track_arm_gfn(vmrun, slot, gfn, mode))
+		vmrun_flush_remote_tlbs(vmrun);
+
+	return 0;
 }
-EXPORT_SYMBOL_GPL(vmrun_slot_page_track_add_page);
 
 /*
  * remove the guest page from the tracking pool which stops the interception
@@ -126,7 +322,7 @@ void vmrun_slot_page_track_remove_page(struct vmrun *vmrun,
 	if (WARN_ON(!page_track_mode_is_valid(mode)))
 		return;
 
-	update_gfn_track(slot, gfn, mode, -1);
+	update_gfn_track(slot, gfn, mode, -1, NULL);
 
 	/*
 	 * allow large page mapping for the tracked page
@@ -136,6 +332,256 @@ void vmrun_slot_page_track_remove_page(struct vmrun *vmrun,
 }
 EXPORT_SYMBOL_GPL(vmrun_slot_page_track_remove_page);
 
+static void *gfn_track_owners_entry(unsigned long owners)
+{
+	return (void *)((owners << RADIX_TREE_EXCEPTIONAL_SHIFT) |
+			RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static unsigned long gfn_track_owners_value(void *entry)
+{
+	return (unsigned long)entry >> RADIX_TREE_EXCEPTIONAL_SHIFT;
+}
+
+static unsigned long gfn_track_owners(struct vmrun_memory_slot *slot,
+				      gfn_t gfn,
+				      enum vmrun_page_track_mode mode)
+{
+	struct vmrun_gfn_track *track = slot->arch.gfn_track[mode];
+	unsigned long index;
+	void *entry;
+
+	index = gfn_to_index(gfn, slot->base_gfn, PT_PAGE_TABLE_LEVEL);
+
+	rcu_read_lock();
+	entry = radix_tree_lookup(&track->owners, index);
+	rcu_read_unlock();
+
+	return entry ? gfn_track_owners_value(entry) : 0;
+}
+
+/*
+ * Returns 1 if the owners of @gfn changed, 0 if @owner already was or
+ * was not one of them, or -ENOMEM.  Only adding the first owner of a
+ * page allocates.
+ */
+static int update_gfn_track_owners(struct vmrun_memory_slot *slot, gfn_t gfn,
+				   enum vmrun_page_track_mode mode,
+				   int owner, bool add)
+{
+	struct vmrun_gfn_track *track = slot->arch.gfn_track[mode];
+	unsigned long index, owners;
+	void __rcu **p;
+	int r;
+
+	index = gfn_to_index(gfn, slot->base_gfn, PT_PAGE_TABLE_LEVEL);
+	owners = gfn_track_owners(slot, gfn, mode);
+
+	if (!!(owners & BIT(owner)) == add)
+		return 0;
+
+	owners ^= BIT(owner);
+	if (!owners) {
+		radix_tree_delete(&track->owners, index);
+		return 1;
+	}
+
+	p = radix_tree_lookup_slot(&track->owners, index);
+	if (p) {
+		radix_tree_replace_slot(&track->owners, p,
+					gfn_track_owners_entry(owners));
+		return 1;
+	}
+
+	r = radix_tree_insert(&track->owners, index,
+			      gfn_track_owners_entry(owners));
+	return r ? r : 1;
+}
+
+/*
+ * vmrun_slot_page_track_add_page() on behalf of @n, so that a filtered
+ * @n gets called for @gfn.  A node tracks a page at most once this way:
+ * adding a page it already owns does nothing.
+ */
+int vmrun_slot_page_track_add_page_owned(struct vmrun *vmrun,
+				struct vmrun_memory_slot *slot, gfn_t gfn,
+				enum vmrun_page_track_mode mode,
+				struct vmrun_page_track_notifier_node *n)
+{
+	int r;
+
+	if (WARN_ON(!page_track_mode_is_valid(mode)))
+		return -EINVAL;
+
+	if (n->owner >= 0) {
+		r = update_gfn_track_owners(slot, gfn, mode, n->owner, true);
+		if (r <= 0)
+			return r;
+	}
+
+	r = vmrun_slot_page_track_add_page(vmrun, slot, gfn, mode);
+	if (r && n->owner >= 0)
+		update_gfn_track_owners(slot, gfn, mode, n->owner, false);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_add_page_owned);
+
+/*
+ * Undo vmrun_slot_page_track_add_page_owned().  An access tracked page
+ * may already have been dropped, owner included, by the fault that
+ * reported it to track_access; removing it then does nothing.
+ */
+void vmrun_slot_page_track_remove_page_owned(struct vmrun *vmrun,
+				struct vmrun_memory_slot *slot, gfn_t gfn,
+				enum vmrun_page_track_mode mode,
+				struct vmrun_page_track_notifier_node *n)
+{
+	if (WARN_ON(!page_track_mode_is_valid(mode)))
+		return;
+
+	if (n->owner >= 0 &&
+	    update_gfn_track_owners(slot, gfn, mode, n->owner, false) <= 0) {
+		WARN_ON(mode != VMRUN_PAGE_TRACK_ACCESS);
+		return;
+	}
+
+	vmrun_slot_page_track_remove_page(vmrun, slot, gfn, mode);
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_remove_page_owned);
+
+/* Sets *@flush if the caller has to flush the TLBs. */
+static int page_track_add_range(struct vmrun *vmrun,
+				struct vmrun_memory_slot *slot, gfn_t start,
+				unsigned long npages,
+				enum vmrun_page_track_mode mode, bool *flush)
+{
+	gfn_t gfn;
+	int r;
+
+	r = update_gfn_track_range(slot, start, npages, mode, 1);
+	if (r)
+		return r;
+
+	vmrun_mmu_gfn_range_disallow_lpage(slot, start, npages);
+
+	for (gfn = start; gfn < start + npages; gfn++)
+		*flush |= page_track_arm_gfn(vmrun, slot, gfn, mode);
+
+	return 0;
+}
+
+static void page_track_remove_range(struct vmrun_memory_slot *slot,
+				    gfn_t start, unsigned long npages,
+				    enum vmrun_page_track_mode mode)
+{
+	update_gfn_track_range(slot, start, npages, mode, -1);
+	vmrun_mmu_gfn_range_allow_lpage(slot, start, npages);
+}
+
+/*
+ * vmrun_slot_page_track_add_page() for the @npages pages from @start,
+ * with a single TLB flush at the end instead of up to one per page.
+ *
+ * Same locking as vmrun_slot_page_track_add_page().  On failure none of
+ * the pages is tracked.
+ */
+int vmrun_slot_page_track_add_range(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot, gfn_t start,
+				    unsigned long npages,
+				    enum vmrun_page_track_mode mode)
+{
+	bool flush = false;
+	int r;
+
+	if (WARN_ON(!page_track_mode_is_valid(mode)))
+		return -EINVAL;
+
+	if (!npages)
+		return 0;
+
+	r = page_track_add_range(vmrun, slot, start, npages, mode, &flush);
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_add_range);
+
+void vmrun_slot_page_track_remove_range(struct vmrun *vmrun,
+					struct vmrun_memory_slot *slot,
+					gfn_t start, unsigned long npages,
+					enum vmrun_page_track_mode mode)
+{
+	if (WARN_ON(!page_track_mode_is_valid(mode)) || !npages)
+		return;
+
+	page_track_remove_range(slot, start, npages, mode);
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_remove_range);
+
+/*
+ * Track the pages from @start whose bit is set in @bitmap, which is
+ * @npages bits long.  Runs of set bits are handled as ranges, and the
+ * TLBs are flushed once for the whole bitmap.  On failure none of the
+ * pages is tracked.
+ */
+int vmrun_slot_page_track_add_bitmap(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot,
+				     gfn_t start, const unsigned long *bitmap,
+				     unsigned long npages,
+				     enum vmrun_page_track_mode mode)
+{
+	unsigned long first, end;
+	bool flush = false;
+	int r = 0;
+
+	if (WARN_ON(!page_track_mode_is_valid(mode)))
+		return -EINVAL;
+
+	first = find_first_bit(bitmap, npages);
+	while (first < npages) {
+		end = find_next_zero_bit(bitmap, npages, first);
+		r = page_track_add_range(vmrun, slot, start + first,
+					 end - first, mode, &flush);
+		if (r)
+			break;
+		first = find_next_bit(bitmap, npages, end);
+	}
+
+	/* The runs before @first are the ones that were added. */
+	if (r)
+		vmrun_slot_page_track_remove_bitmap(vmrun, slot, start, bitmap,
+						    first, mode);
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_add_bitmap);
+
+void vmrun_slot_page_track_remove_bitmap(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t start,
+					 const unsigned long *bitmap,
+					 unsigned long npages,
+					 enum vmrun_page_track_mode mode)
+{
+	unsigned long first, end;
+
+	if (WARN_ON(!page_track_mode_is_valid(mode)))
+		return;
+
+	first = find_first_bit(bitmap, npages);
+	while (first < npages) {
+		end = find_next_zero_bit(bitmap, npages, first);
+		page_track_remove_range(slot, start + first, end - first, mode);
+		first = find_next_bit(bitmap, npages, end);
+	}
+}
+EXPORT_SYMBOL_GPL(vmrun_slot_page_track_remove_bitmap);
+
 /*
  * check if the corresponding access on the specified guest page is tracked.
  */
@@ -143,7 +589,8 @@ bool vmrun_page_track_is_active(struct vmrun_vcpu *vcpu, gfn_t gfn,
 			      enum vmrun_page_track_mode mode)
 {
 	struct vmrun_memory_slot *slot;
-	int index;
+	struct vmrun_gfn_track *track;
+	unsigned long index;
 
 	if (WARN_ON(!page_track_mode_is_valid(mode)))
 		return false;
@@ -152,8 +599,12 @@ bool vmrun_page_track_is_active(struct vmrun_vcpu *vcpu, gfn_t gfn,
 	if (!slot)
 		return false;
 
+	track = slot->arch.gfn_track[mode];
+	if (!READ_ONCE(track->tracked))
+		return false;
+
 	index = gfn_to_index(gfn, slot->base_gfn, PT_PAGE_TABLE_LEVEL);
-	return !!ACCESS_ONCE(slot->arch.gfn_track[mode][index]);
+	return test_bit(index, track->bitmap);
 }
 
 void vmrun_page_track_cleanup(struct vmrun *vmrun)
@@ -171,6 +622,7 @@ void vmrun_page_track_init(struct vmrun *vmrun)
 	head = &vmrun->arch.track_notifier_head;
 	init_srcu_struct(&head->track_srcu);
 	INIT_HLIST_HEAD(&head->track_notifier_list);
+	head->owner_ids = 0;
 }
 
 /*
@@ -185,15 +637,29 @@ vmrun_page_track_register_notifier(struct vmrun *vmrun,
 
 	head = &vmrun->arch.track_notifier_head;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
+	n->owner = -1;
+	if (n->filtered) {
+		n->owner = find_first_zero_bit(&head->owner_ids,
+					       VMRUN_PAGE_TRACK_MAX_OWNERS);
+		/* Out of ids: the node just sees every page. */
+		if (WARN_ON(n->owner == VMRUN_PAGE_TRACK_MAX_OWNERS))
+			n->owner = -1;
+		else
+			WRITE_ONCE(head->owner_ids,
+				   head->owner_ids | BIT(n->owner));
+	}
 	hlist_add_head_rcu(&n->node, &head->track_notifier_list);
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 }
 EXPORT_SYMBOL_GPL(vmrun_page_track_register_notifier);
 
 /*
  * stop receiving the event interception. It is the opposed operation of
  * vmrun_page_track_register_notifier().
+ *
+ * A filtered node must have removed the pages it owns, or the next node
+ * to get its owner id would be called for them.
  */
 void
 vmrun_page_track_unregister_notifier(struct vmrun *vmrun,
@@ -203,25 +669,43 @@ vmrun_page_track_unregister_notifier(struct vmrun *vmrun,
 
 	head = &vmrun->arch.track_notifier_head;
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 	hlist_del_rcu(&n->node);
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 	synchronize_srcu(&head->track_srcu);
+
+	/* Only now can no reader be calling @n under its owner id. */
+	if (n->owner >= 0) {
+		write_lock(&vmrun->mmu_lock);
+		WRITE_ONCE(head->owner_ids, head->owner_ids & ~BIT(n->owner));
+		write_unlock(&vmrun->mmu_lock);
+	}
 }
 EXPORT_SYMBOL_GPL(vmrun_page_track_unregister_notifier);
 
+static bool page_track_node_wants(struct vmrun_page_track_notifier_node *n,
+				  unsigned long owners)
+{
+	return n->owner < 0 || (owners & BIT(n->owner));
+}
+
 /*
  * Notify the node that write access is intercepted and write emulation is
  * finished at this time.
  *
- * The node should figure out if the written page is the one that node is
- * interested in by itself.
+ * A write is reported in one call however many pages it spans, and a
+ * filtered node only gets it if it owns one of those pages.  Other
+ * nodes should figure out if the written page is the one that node is
+ * interested in by themselves.
  */
 void vmrun_page_track_write(struct vmrun_vcpu *vcpu, gpa_t gpa, const u8 *new,
 			  int bytes)
 {
 	struct vmrun_page_track_notifier_head *head;
 	struct vmrun_page_track_notifier_node *n;
+	struct vmrun_memory_slot *slot;
+	unsigned long owners = 0;
+	gfn_t gfn;
 	int idx;
 
 	head = &vcpu->vmrun->arch.track_notifier_head;
@@ -230,8 +714,19 @@ void vmrun_page_track_write(struct vmrun_vcpu *vcpu, gpa_t gpa, const u8 *new,
 		return;
 
 	idx = srcu_read_lock(&head->track_srcu);
+
+	if (READ_ONCE(head->owner_ids)) {
+		for (gfn = gpa >> PAGE_SHIFT;
+		     gfn <= (gpa + bytes - 1) >> PAGE_SHIFT; gfn++) {
+			slot = vmrun_vcpu_gfn_to_memslot(vcpu, gfn);
+			if (slot)
+				owners |= gfn_track_owners(slot, gfn,
+							   VMRUN_PAGE_TRACK_WRITE);
+		}
+	}
+
 	hlist_for_each_entry_rcu(n, &head->track_notifier_list, node)
-		if (n->track_write)
+		if (n->track_write && page_track_node_wants(n, owners))
 			n->track_write(vcpu, gpa, new, bytes, n);
 	srcu_read_unlock(&head->track_srcu, idx);
 }
@@ -247,7 +742,10 @@ void vmrun_page_track_flush_slot(struct vmrun *vmrun, struct vmrun_memory_slot *
 {
 	struct vmrun_page_track_notifier_head *head;
 	struct vmrun_page_track_notifier_node *n;
-	int idx;
+	struct radix_tree_iter iter;
+	unsigned long owners = 0;
+	void __rcu **p;
+	int idx, i;
 
 	head = &vmrun->arch.track_notifier_head;
 
@@ -255,8 +753,109 @@ void vmrun_page_track_flush_slot(struct vmrun *vmrun, struct vmrun_memory_slot *
 		return;
 
 	idx = srcu_read_lock(&head->track_srcu);
+
+	/* Slots go away rarely enough to just walk the owner maps. */
+	if (READ_ONCE(head->owner_ids)) {
+		rcu_read_lock();
+		for (i = 0; i < VMRUN_PAGE_TRACK_MAX; i++) {
+			radix_tree_for_each_slot(p,
+					&slot->arch.gfn_track[i]->owners,
+					&iter, 0) {
+				void *entry = radix_tree_deref_slot(p);
+
+				if (radix_tree_deref_retry(entry)) {
+					p = radix_tree_iter_retry(&iter);
+					continue;
+				}
+				owners |= gfn_track_owners_value(entry);
+			}
+		}
+		rcu_read_unlock();
+	}
+
 	hlist_for_each_entry_rcu(n, &head->track_notifier_list, node)
-		if (n->track_flush_slot)
+		if (n->track_flush_slot && page_track_node_wants(n, owners))
 			n->track_flush_slot(vmrun, slot, n);
 	srcu_read_unlock(&head->track_srcu, idx);
 }
+
+/*
+ * The guest touched @gfn, which is access tracked.  Drop the tracking,
+ * all of it if several users added the page, and queue the page for
+ * track_access.  Called from the page fault path without mmu_lock.
+ */
+void vmrun_page_track_access_fault(struct vmrun_vcpu *vcpu, gfn_t gfn)
+{
+	struct vmrun *vmrun = vcpu->vmrun;
+	struct vmrun_memory_slot *slot;
+	unsigned long owners = 0;
+	bool touched = false;
+
+	slot = vmrun_vcpu_gfn_to_memslot(vcpu, gfn);
+	if (!slot)
+		return;
+
+	write_lock(&vmrun->mmu_lock);
+	/* Another vCPU may have taken the fault first. */
+	while (vmrun_page_track_is_active(vcpu, gfn, VMRUN_PAGE_TRACK_ACCESS)) {
+		vmrun_slot_page_track_remove_page(vmrun, slot, gfn,
+						  VMRUN_PAGE_TRACK_ACCESS);
+		touched = true;
+	}
+	if (touched) {
+		owners = gfn_track_owners(slot, gfn, VMRUN_PAGE_TRACK_ACCESS);
+		radix_tree_delete(
+			&slot->arch.gfn_track[VMRUN_PAGE_TRACK_ACCESS]->owners,
+			gfn_to_index(gfn, slot->base_gfn, PT_PAGE_TABLE_LEVEL));
+	}
+	write_unlock(&vmrun->mmu_lock);
+
+	if (!touched)
+		return;
+
+	vcpu->track_access.owners |= owners;
+	vcpu->track_access.gfn_owners[vcpu->track_access.nr] = owners;
+	vcpu->track_access.gfns[vcpu->track_access.nr++] = gfn;
+	if (vcpu->track_access.nr == VMRUN_PAGE_TRACK_ACCESS_BATCH)
+		vmrun_page_track_flush_access(vcpu);
+}
+
+/*
+ * Hand the pages the vCPU has queued to the track_access notifiers.
+ * The vCPU calls it when the batch is full, and before it reschedules
+ * or returns to userspace, so that no page waits long to be reported.
+ */
+void vmrun_page_track_flush_access(struct vmrun_vcpu *vcpu)
+{
+	struct vmrun_page_track_notifier_head *head;
+	struct vmrun_page_track_notifier_node *n;
+	unsigned long owners = vcpu->track_access.owners;
+	int idx, nr = vcpu->track_access.nr;
+	int i, own;
+
+	if (!nr)
+		return;
+
+	vcpu->track_access.nr = 0;
+	vcpu->track_access.owners = 0;
+	head = &vcpu->vmrun->arch.track_notifier_head;
+
+	idx = srcu_read_lock(&head->track_srcu);
+	hlist_for_each_entry_rcu(n, &head->track_notifier_list, node) {
+		if (!n->track_access || !page_track_node_wants(n, owners))
+			continue;
+
+		if (n->owner < 0) {
+			n->track_access(vcpu, vcpu->track_access.gfns, nr, n);
+			continue;
+		}
+
+		/* A filtered node only gets the pages it owned. */
+		for (i = own = 0; i < nr; i++)
+			if (vcpu->track_access.gfn_owners[i] & BIT(n->owner))
+				vcpu->track_access.filtered[own++] =
+					vcpu->track_access.gfns[i];
+		n->track_access(vcpu, vcpu->track_access.filtered, own, n);
+	}
+	srcu_read_unlock(&head->track_srcu, idx);
+}
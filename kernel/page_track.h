@@ -1,13 +1,56 @@
 #ifndef _ASM_X86_VMRUN_PAGE_TRACK_H
 #define _ASM_X86_VMRUN_PAGE_TRACK_H
 
+#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
 #include "types.h"
 
+struct vmrun_mmu_memory_cache;
+
 enum vmrun_page_track_mode {
 	VMRUN_PAGE_TRACK_WRITE,
+	/*
+	 * The page is unmapped; the first guest access to it drops the
+	 * tracking and is reported through track_access.
+	 */
+	VMRUN_PAGE_TRACK_ACCESS,
 	VMRUN_PAGE_TRACK_MAX,
 };
 
+/* Touched pages a vCPU collects before calling track_access. */
+#define VMRUN_PAGE_TRACK_ACCESS_BATCH	64
+
+/*
+ * Filtered notifiers per VM; owner masks are stored as exceptional
+ * radix tree entries.
+ */
+#define VMRUN_PAGE_TRACK_MAX_OWNERS	\
+	(BITS_PER_LONG - RADIX_TREE_EXCEPTIONAL_SHIFT)
+
+/* The count less one of a page tracked more than once. */
+struct vmrun_gfn_track_overflow {
+	struct rb_node node;
+	unsigned long index;
+	unsigned int count;
+};
+
+/*
+ * Per-slot tracking state of one mode.  A page is tracked iff its bit
+ * is set; pages tracked more than once also have an entry in @overflow.
+ * @tracked counts the bits set, so that slots nobody tracks are ruled
+ * out without touching the bitmap.  @owners maps a page to the mask of
+ * the filtered notifiers that track it.
+ *
+ * Updated under mmu_lock held for write.  The bitmap and @owners are
+ * read without it, @overflow only with it.
+ */
+struct vmrun_gfn_track {
+	unsigned long tracked;
+	struct rb_root overflow;
+	struct radix_tree_root owners;
+	unsigned long bitmap[];
+};
+
 /*
  * The notifier represented by @vmrun_page_track_notifier_node is linked into
  * the head which will be notified when guest is triggering the track event.
@@ -18,11 +61,22 @@ enum vmrun_page_track_mode {
 struct vmrun_page_track_notifier_head {
 	struct srcu_struct track_srcu;
 	struct hlist_head track_notifier_list;
+	/* Owner ids handed out to filtered nodes. */
+	unsigned long owner_ids;
 };
 
 struct vmrun_page_track_notifier_node {
 	struct hlist_node node;
 
+	/*
+	 * Set before registering to be called only for the pages this
+	 * node tracks with the _owned helpers, instead of for every page.
+	 * @owner is assigned at registration, and is -1 for nodes that
+	 * see every page.
+	 */
+	bool filtered;
+	int owner;
+
 	/*
 	 * It is called when guest is writing the write-tracked page
 	 * and write emulation is finished at that time.
@@ -45,6 +99,20 @@ struct vmrun_page_track_notifier_node {
 	 */
 	void (*track_flush_slot)(struct vmrun *vmrun, struct vmrun_memory_slot *slot,
 			    struct vmrun_page_track_notifier_node *node);
+	/*
+	 * It is called with access tracked pages the guest has touched,
+	 * in batches of up to VMRUN_PAGE_TRACK_ACCESS_BATCH.  A filtered
+	 * node only gets the pages it owned.  The pages are no longer
+	 * tracked and are accessible again; add them back to keep watching
+	 * them.
+	 *
+	 * @vcpu: the vcpu that touched the pages.
+	 * @gfns: the guest pages.
+	 * @nr: the number of pages in @gfns.
+	 * @node: this node
+	 */
+	void (*track_access)(struct vmrun_vcpu *vcpu, const gfn_t *gfns, int nr,
+			     struct vmrun_page_track_notifier_node *node);
 };
 
 void vmrun_page_track_init(struct vmrun *vmrun);
@@ -55,14 +123,45 @@ void vmrun_page_track_free_memslot(struct vmrun_memory_slot *free,
 int vmrun_page_track_create_memslot(struct vmrun_memory_slot *slot,
 				  unsigned long npages);
 
-void vmrun_slot_page_track_add_page(struct vmrun *vmrun,
-				  struct vmrun_memory_slot *slot, gfn_t gfn,
-				  enum vmrun_page_track_mode mode);
+int __vmrun_slot_page_track_add_page(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot, gfn_t gfn,
+				     enum vmrun_page_track_mode mode,
+				     struct vmrun_mmu_memory_cache *cache);
+int vmrun_slot_page_track_add_page(struct vmrun *vmrun,
+				   struct vmrun_memory_slot *slot, gfn_t gfn,
+				   enum vmrun_page_track_mode mode);
 void vmrun_slot_page_track_remove_page(struct vmrun *vmrun,
 				     struct vmrun_memory_slot *slot, gfn_t gfn,
 				     enum vmrun_page_track_mode mode);
+int vmrun_slot_page_track_add_range(struct vmrun *vmrun,
+				    struct vmrun_memory_slot *slot, gfn_t start,
+				    unsigned long npages,
+				    enum vmrun_page_track_mode mode);
+void vmrun_slot_page_track_remove_range(struct vmrun *vmrun,
+					struct vmrun_memory_slot *slot,
+					gfn_t start, unsigned long npages,
+					enum vmrun_page_track_mode mode);
+int vmrun_slot_page_track_add_bitmap(struct vmrun *vmrun,
+				     struct vmrun_memory_slot *slot,
+				     gfn_t start, const unsigned long *bitmap,
+				     unsigned long npages,
+				     enum vmrun_page_track_mode mode);
+void vmrun_slot_page_track_remove_bitmap(struct vmrun *vmrun,
+					 struct vmrun_memory_slot *slot,
+					 gfn_t start,
+					 const unsigned long *bitmap,
+					 unsigned long npages,
+					 enum vmrun_page_track_mode mode);
 bool vmrun_page_track_is_active(struct vmrun_vcpu *vcpu, gfn_t gfn,
 			      enum vmrun_page_track_mode mode);
+int vmrun_slot_page_track_add_page_owned(struct vmrun *vmrun,
+				struct vmrun_memory_slot *slot, gfn_t gfn,
+				enum vmrun_page_track_mode mode,
+				struct vmrun_page_track_notifier_node *n);
+void vmrun_slot_page_track_remove_page_owned(struct vmrun *vmrun,
+				struct vmrun_memory_slot *slot, gfn_t gfn,
+				enum vmrun_page_track_mode mode,
+				struct vmrun_page_track_notifier_node *n);
 
 void
 vmrun_page_track_register_notifier(struct vmrun *vmrun,
@@ -73,4 +172,6 @@ vmrun_page_track_unregister_notifier(struct vmrun *vmrun,
 void vmrun_page_track_write(struct vmrun_vcpu *vcpu, gpa_t gpa, const u8 *new,
 			  int bytes);
 void vmrun_page_track_flush_slot(struct vmrun *vmrun, struct vmrun_memory_slot *slot);
+void vmrun_page_track_access_fault(struct vmrun_vcpu *vcpu, gfn_t gfn);
+void vmrun_page_track_flush_access(struct vmrun_vcpu *vcpu);
 #endif
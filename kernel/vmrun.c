@@ -67,10 +67,11 @@
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/sched.h>
-//#include <linux/sched/mm.h>
+#include <linux/sched/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/spinlock.h>
 #include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/types.h>
@@ -104,6 +105,7 @@ static bool largepages_enabled = true;
 
 static unsigned long iopm_base;
 
+/* Set at module load when CPUID reports nested paging support */
 static bool npt_enabled = false;
 
 static DEFINE_PER_CPU(struct vmrun_vcpu *, local_vcpu);
@@ -236,6 +238,22 @@ static int vmrun_has_svm(void)
 	return 0;
 }
 
+static bool vmrun_has_npt(void)
+{
+	int cpuid_value = 0;
+
+	//
+	// See AMD64 APM
+	// Vol.2, Chapter 15, Section 25 (Nested Paging)
+	//
+
+	asm volatile("cpuid\n\t" : "=d" (cpuid_value)
+				 : "a"  (CPUID_EXT_A_SVM_LOCK_LEAF)
+				 : "%rbx","%rcx");
+
+	return (cpuid_value >> CPUID_EXT_A_SVM_NPT_BIT) & 1;
+}
+
 static void vmrun_cpu_enable_nolock(void *junk)
 {
 	struct vmrun_cpu_data *cd;
@@ -544,6 +562,28 @@ static void vmrun_flush_tlb(struct vmrun_vcpu *vcpu)
 		vcpu->asid_generation--;
 }
 
+void vmrun_set_tdp_cr3(struct vmrun_vcpu *vcpu, unsigned long root)
+{
+	vcpu->vmcb->control.nested_cr3  = root;
+	vcpu->vmcb->control.clean      &= ~(1 << VMCB_NPT);
+
+	vmrun_flush_tlb(vcpu);
+}
+
+int vmrun_get_tdp_level(struct vmrun_vcpu *vcpu)
+{
+	return PT64_ROOT_4LEVEL;
+}
+
+int vmrun_get_lpage_level(void)
+{
+	// 1GB nested page-table leaves need 1GB page support on the host
+	if (npt_enabled && boot_cpu_has(X86_FEATURE_GBPAGES))
+		return PT_PDPE_LEVEL;
+
+	return PT_DIRECTORY_LEVEL;
+}
+
 static int vmrun_set_cr4(struct vmrun_vcpu *vcpu, unsigned long cr4)
 {
 	unsigned long host_cr4_mce = cr4_read_shadow() & X86_CR4_MCE;
@@ -802,6 +842,23 @@ static void vmrun_vmcb_init(struct vmrun_vcpu *vcpu)
 	save->rip = 0x0000fff0;
 	save->dr6 = 0xffff0ff0;
 	save->rflags = 2;
+
+	if (npt_enabled) {
+		/*
+		 * Setup VMCB for Nested Paging. The guest owns its own page
+		 * tables, so CR3 accesses, INVLPG and #PF need not exit.
+		 */
+		control->nested_ctl = SVM_NESTED_CTL_NP_ENABLE;
+		control->intercept &= ~(1ULL << INTERCEPT_INVLPG);
+		control->intercept_exceptions &= ~(1 << PF_VECTOR);
+		vmrun_clr_cr_intercept(vcpu, INTERCEPT_CR3_READ);
+		vmrun_clr_cr_intercept(vcpu, INTERCEPT_CR3_WRITE);
+		save->g_pat = VMRUN_PAT_DEFAULT;
+		save->cr0 = cr0;
+		save->cr3 = 0;
+		save->cr4 = 0;
+	}
+
 	control->clean &= ~(1 << VMCB_CR);
 	control->clean = 0;
 
@@ -1081,11 +1138,20 @@ static int vmmcall_interception(struct vmrun_vcpu *vcpu)
 	return 0;
 }
 
+static int npf_interception(struct vmrun_vcpu *vcpu)
+{
+	u64 fault_address = vcpu->vmcb->control.exit_info_2;
+	u64 error_code    = vcpu->vmcb->control.exit_info_1;
+
+	return vmrun_mmu_page_fault(vcpu, fault_address, error_code, NULL, 0);
+}
+
 static int (*const vmrun_exit_handlers[])(struct vmrun_vcpu *vcpu) = {
 	[SVM_EXIT_INTR]				= intr_interception,
 	[SVM_EXIT_NMI]				= nmi_interception,
 	[SVM_EXIT_CPUID]			= cpuid_interception,
 	[SVM_EXIT_VMMCALL]			= vmmcall_interception,
+	[SVM_EXIT_NPF]				= npf_interception,
 };
 
 static void vmrun_vcpu_dump_vmcb(struct vmrun_vcpu *vcpu)
@@ -1347,6 +1413,143 @@ void vmrun_vcpu_put(struct vmrun_vcpu *vcpu)
 //	return false;
 //}
 
+static u32 vmrun_dirty_ring_used(struct vmrun_dirty_ring *ring)
+{
+	return READ_ONCE(ring->dirty_index) - READ_ONCE(ring->reset_index);
+}
+
+static bool vmrun_dirty_ring_soft_full(struct vmrun_dirty_ring *ring)
+{
+	return vmrun_dirty_ring_used(ring) >= ring->soft_limit;
+}
+
+static int vmrun_dirty_ring_alloc(struct vmrun_dirty_ring *ring, u32 size)
+{
+	ring->dirty_gfns = vzalloc(size);
+	if (!ring->dirty_gfns)
+		return -ENOMEM;
+
+	ring->size = size / sizeof(struct vmrun_dirty_gfn);
+	ring->soft_limit = ring->size - VMRUN_DIRTY_RING_RSVD_ENTRIES;
+	ring->dirty_index = 0;
+	ring->reset_index = 0;
+
+	return 0;
+}
+
+static void vmrun_dirty_ring_free(struct vmrun_dirty_ring *ring)
+{
+	vfree(ring->dirty_gfns);
+	ring->dirty_gfns = NULL;
+}
+
+static void vmrun_dirty_ring_push(struct vmrun_dirty_ring *ring,
+				  u32 slot, u64 offset)
+{
+	struct vmrun_dirty_gfn *entry;
+
+	/* The soft limit should keep this from ever happening. */
+	WARN_ON_ONCE(vmrun_dirty_ring_used(ring) >= ring->size);
+
+	entry = &ring->dirty_gfns[ring->dirty_index & (ring->size - 1)];
+	entry->slot = slot;
+	entry->offset = offset;
+	/* Fill in the entry before userspace can see it is dirty. */
+	smp_wmb();
+	WRITE_ONCE(entry->flags, VMRUN_DIRTY_GFN_F_DIRTY);
+	WRITE_ONCE(ring->dirty_index, ring->dirty_index + 1);
+}
+
+/*
+ * The slot and offset come from memory userspace can write, so check
+ * them against the current memslots before using them.
+ */
+static void vmrun_reset_dirty_gfn(struct vmrun *vmrun, u32 slot, u64 offset,
+				  unsigned long mask)
+{
+	struct vmrun_memory_slot *memslot;
+	int as_id = slot >> 16;
+	int id = (u16)slot;
+
+	if (!mask || as_id >= VMRUN_ADDRESS_SPACE_NUM ||
+	    id >= VMRUN_USER_MEM_SLOTS)
+		return;
+
+	/* Written so that a huge @offset cannot wrap past the check. */
+	memslot = id_to_memslot(__vmrun_memslots(vmrun, as_id), id);
+	if (offset >= memslot->npages ||
+	    __fls(mask) >= memslot->npages - offset)
+		return;
+
+	vmrun_arch_mmu_enable_log_dirty_pt_masked(vmrun, memslot, offset, mask);
+}
+
+/*
+ * Write protect again the pages userspace has collected from @ring, and
+ * give their entries back to the vCPU.  Consecutive entries that fall
+ * in the same BITS_PER_LONG pages of a slot, as a guest streaming
+ * through memory produces, are handed over as one mask.  Returns the
+ * number of entries reset; the caller holds mmu_lock for write and
+ * flushes the TLBs.
+ */
+static u32 vmrun_dirty_ring_reset(struct vmrun *vmrun,
+				  struct vmrun_dirty_ring *ring)
+{
+	struct vmrun_dirty_gfn *entry;
+	u32 cur_slot = 0, next_slot;
+	u64 cur_offset = 0, next_offset;
+	unsigned long mask = 0;
+	u32 count = 0;
+	u64 delta;
+
+	while (ring->reset_index != READ_ONCE(ring->dirty_index)) {
+		entry = &ring->dirty_gfns[ring->reset_index & (ring->size - 1)];
+
+		if (!(smp_load_acquire(&entry->flags) & VMRUN_DIRTY_GFN_F_RESET))
+			break;
+
+		next_slot = READ_ONCE(entry->slot);
+		next_offset = READ_ONCE(entry->offset);
+
+		WRITE_ONCE(entry->flags, 0);
+		WRITE_ONCE(ring->reset_index, ring->reset_index + 1);
+		count++;
+
+		/*
+		 * Compare the offsets as unsigned values: userspace can
+		 * write any of them, and a difference taken across a wrap
+		 * would merge entries that are nowhere near each other.
+		 */
+		if (mask && next_slot == cur_slot) {
+			if (next_offset >= cur_offset) {
+				delta = next_offset - cur_offset;
+				if (delta < BITS_PER_LONG) {
+					mask |= 1UL << delta;
+					continue;
+				}
+			} else {
+				/* Walking backwards: shift if no bit falls off the top. */
+				delta = cur_offset - next_offset;
+				if (delta < BITS_PER_LONG &&
+				    (mask << delta >> delta) == mask) {
+					cur_offset = next_offset;
+					mask = (mask << delta) | 1;
+					continue;
+				}
+			}
+		}
+
+		vmrun_reset_dirty_gfn(vmrun, cur_slot, cur_offset, mask);
+		cur_slot = next_slot;
+		cur_offset = next_offset;
+		mask = 1;
+	}
+
+	vmrun_reset_dirty_gfn(vmrun, cur_slot, cur_offset, mask);
+
+	return count;
+}
+
 int vmrun_vcpu_init(struct vmrun_vcpu *vcpu, struct vmrun *vmrun, unsigned id)
 {
 	struct page *run_page;
@@ -1361,6 +1564,12 @@ int vmrun_vcpu_init(struct vmrun_vcpu *vcpu, struct vmrun *vmrun, unsigned id)
 	vcpu->pre_pcpu = -1;
 	INIT_LIST_HEAD(&vcpu->blocked_vcpu_list);
 
+	vcpu->async_pf.queued = 0;
+	INIT_LIST_HEAD(&vcpu->async_pf.queue);
+	INIT_LIST_HEAD(&vcpu->async_pf.done);
+	spin_lock_init(&vcpu->async_pf.lock);
+	init_waitqueue_head(&vcpu->async_pf.wq);
+
 	run_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 
 	if (!run_page) {
@@ -1370,6 +1579,13 @@ int vmrun_vcpu_init(struct vmrun_vcpu *vcpu, struct vmrun *vmrun, unsigned id)
 
 	vcpu->run = page_address(run_page);
 
+	if (vmrun->dirty_ring_size) {
+		r = vmrun_dirty_ring_alloc(&vcpu->dirty_ring,
+					   vmrun->dirty_ring_size);
+		if (r)
+			goto fail_free_run_page;
+	}
+
 	vcpu->spin_loop.in_spin_loop = false;
 	vcpu->spin_loop.dy_eligible  = false;
 	vcpu->preempted = false;
@@ -1377,13 +1593,15 @@ int vmrun_vcpu_init(struct vmrun_vcpu *vcpu, struct vmrun *vmrun, unsigned id)
 	r = vmrun_mmu_create(vcpu);
 
 	if (r < 0)
-		goto fail_free_run_page;
+		goto fail_free_dirty_ring;
 
 	// vcpu->pending_external_vector = -1;
 	// vcpu->preempted_in_kernel = false;
 
 	return 0;
 
+fail_free_dirty_ring:
+	vmrun_dirty_ring_free(&vcpu->dirty_ring);
 fail_free_run_page:
 	free_page((unsigned long)vcpu->run);
 fail:
@@ -1405,6 +1623,7 @@ void vmrun_vcpu_uninit(struct vmrun_vcpu *vcpu)
 	vmrun_mmu_destroy(vcpu);
 	srcu_read_unlock(&vcpu->vmrun->srcu, idx);
 
+	vmrun_dirty_ring_free(&vcpu->dirty_ring);
 	free_page((unsigned long)vcpu->run);
 }
 
@@ -1482,7 +1701,7 @@ static void vmrun_free_vcpus(struct vmrun *vmrun)
 	 * Unpin any mmu pages first.
 	 */
 	vmrun_for_each_vcpu(i, vcpu, vmrun) {
-		//vmrun_clear_async_pf_completion_queue(vcpu);
+		vmrun_clear_async_pf_completion_queue(vcpu);
 		vmrun_vcpu_unload_mmu(vcpu);
 	}
 	
@@ -1504,6 +1723,8 @@ void vmrun_vcpu_reset(struct vmrun_vcpu *vcpu, bool init_event)
 	vcpu->hflags = 0;
 	vcpu->cr2    = 0;
 
+	vmrun_clear_async_pf_completion_queue(vcpu);
+
 	//vmrun_make_request(VMRUN_REQ_EVENT, vcpu);
 
 	memset(vcpu->regs, 0, sizeof(vcpu->regs));
@@ -1540,7 +1761,7 @@ void vmrun_vcpu_destroy(struct vmrun_vcpu *vcpu)
 {
 	int r;
 
-	//vcpu->arch.apf.msr_val = 0;
+	vmrun_clear_async_pf_completion_queue(vcpu);
 
 	r = vmrun_vcpu_load(vcpu);
 
@@ -1553,6 +1774,182 @@ void vmrun_vcpu_destroy(struct vmrun_vcpu *vcpu)
 	vmrun_vcpu_free(vcpu);
 }
 
+/*
+ * Asynchronous page faults.  A fault on guest memory that is not
+ * resident (swapped out, or behind a slow userfaultfd) is handed to a
+ * work item that faults the page in on the VM's mm, so the physical CPU
+ * is not blocked.  Meanwhile the vCPU is halted, or a guest with a
+ * reason area gets a "page not present" #PF and can run another task.
+ * Finished page-ins are drained on the next guest entry.
+ *
+ * Each work item holds a reference to the VM, so that the vCPU it wakes
+ * outlives it even after the vCPU thread has freed the item.
+ */
+static void vmrun_get_vmrun(struct vmrun *vmrun);
+static void vmrun_put_vmrun(struct vmrun *vmrun);
+
+static void vmrun_async_pf_execute(struct work_struct *work)
+{
+	struct vmrun_async_pf *apf =
+		container_of(work, struct vmrun_async_pf, work);
+	struct mm_struct *mm = apf->mm;
+	struct vmrun_vcpu *vcpu = apf->vcpu;
+	struct vmrun *vmrun = vcpu->vmrun;
+	int locked = 1;
+
+	/*
+	 * This work is run asynchronously to the task which owns
+	 * mm and might be done in another context, so we must
+	 * access remotely.
+	 */
+	down_read(&mm->mmap_sem);
+	get_user_pages_remote(NULL, mm, apf->addr, 1, FOLL_WRITE, NULL, NULL,
+			      &locked);
+	if (locked)
+		up_read(&mm->mmap_sem);
+
+	mmput(mm);
+
+	/*
+	 * Once on the done list @apf belongs to the vCPU thread, which may
+	 * free it at any time; a NULL ->vcpu tells the clear path that
+	 * there is nothing left to cancel.
+	 */
+	spin_lock(&vcpu->async_pf.lock);
+	list_add_tail(&apf->done_link, &vcpu->async_pf.done);
+	apf->vcpu = NULL;
+	spin_unlock(&vcpu->async_pf.lock);
+
+	wake_up_interruptible(&vcpu->async_pf.wq);
+
+	vmrun_put_vmrun(vmrun);
+}
+
+int vmrun_setup_async_pf(struct vmrun_vcpu *vcpu, gva_t gva, unsigned long hva,
+			 struct vmrun_arch_async_pf *arch)
+{
+	struct vmrun_async_pf *work;
+
+	if (vcpu->async_pf.queued >= VMRUN_ASYNC_PF_PER_VCPU)
+		return 0;
+
+	/* We are on the page fault path, so do not sleep here. */
+	work = kzalloc(sizeof(*work), GFP_NOWAIT | __GFP_NOWARN);
+	if (!work)
+		return 0;
+
+	work->vcpu = vcpu;
+	work->gva  = gva;
+	work->addr = hva;
+	work->arch = *arch;
+	work->mm   = current->mm;
+	mmget(work->mm);
+	vmrun_get_vmrun(vcpu->vmrun);
+
+	INIT_WORK(&work->work, vmrun_async_pf_execute);
+
+	list_add_tail(&work->link, &vcpu->async_pf.queue);
+	vcpu->async_pf.queued++;
+
+	queue_work(system_unbound_wq, &work->work);
+
+	vcpu->apf.halted = true;
+
+	return 1;
+}
+
+bool vmrun_find_async_pf_gfn(struct vmrun_vcpu *vcpu, gfn_t gfn)
+{
+	struct vmrun_async_pf *work;
+
+	list_for_each_entry(work, &vcpu->async_pf.queue, link)
+		if (work->arch.gfn == gfn)
+			return true;
+
+	return false;
+}
+
+void vmrun_check_async_pf_completion(struct vmrun_vcpu *vcpu)
+{
+	struct vmrun_async_pf *work;
+
+	while (!list_empty_careful(&vcpu->async_pf.done)) {
+		spin_lock(&vcpu->async_pf.lock);
+		work = list_first_entry(&vcpu->async_pf.done,
+					struct vmrun_async_pf, done_link);
+		list_del(&work->done_link);
+		spin_unlock(&vcpu->async_pf.lock);
+
+		vmrun_arch_async_page_ready(vcpu, work);
+		vcpu->apf.halted = false;
+
+		list_del(&work->link);
+		vcpu->async_pf.queued--;
+		kfree(work);
+	}
+}
+
+void vmrun_clear_async_pf_completion_queue(struct vmrun_vcpu *vcpu)
+{
+	struct vmrun_async_pf *work, *tmp;
+	bool done;
+
+	/*
+	 * Cancel what has not started; the rest ends up on the done list.
+	 * Items already there are skipped: their work may be dropping the
+	 * last VM reference, and is then the caller of this function.
+	 */
+	list_for_each_entry_safe(work, tmp, &vcpu->async_pf.queue, link) {
+		list_del(&work->link);
+
+		spin_lock(&vcpu->async_pf.lock);
+		done = !work->vcpu;
+		spin_unlock(&vcpu->async_pf.lock);
+
+		if (!done && cancel_work_sync(&work->work)) {
+			mmput(work->mm);
+			kfree(work);
+			vmrun_put_vmrun(vcpu->vmrun);
+		}
+	}
+
+	spin_lock(&vcpu->async_pf.lock);
+	while (!list_empty(&vcpu->async_pf.done)) {
+		work = list_first_entry(&vcpu->async_pf.done,
+					struct vmrun_async_pf, done_link);
+		list_del(&work->done_link);
+		kfree(work);
+	}
+	spin_unlock(&vcpu->async_pf.lock);
+
+	vcpu->async_pf.queued = 0;
+	vcpu->apf.halted = false;
+}
+
+/*
+ * Wait for an outstanding page-in when the guest cannot be told about
+ * it.  Returns 1 to go on with the run loop.
+ */
+static int vmrun_vcpu_async_pf_halt(struct vmrun_vcpu *vcpu)
+{
+	struct vmrun *vmrun = vcpu->vmrun;
+	int r;
+
+	srcu_read_unlock(&vmrun->srcu, vcpu->srcu_idx);
+	r = wait_event_interruptible(vcpu->async_pf.wq,
+				     !list_empty_careful(&vcpu->async_pf.done));
+	vcpu->srcu_idx = srcu_read_lock(&vmrun->srcu);
+
+	if (r) {
+		vcpu->run->exit_reason = VMRUN_EXIT_INTR;
+		return -EINTR;
+	}
+
+	vcpu->apf.halted = false;
+
+	return 1;
+}
+
 /*
  * Returns 1 to let vcpu_run() continue the guest execution loop without
  * exiting to the userspace.  Otherwise, the value will be returned to the
@@ -1723,7 +2120,19 @@ int vmrun_vcpu_ioctl_run(struct vmrun_vcpu *vcpu, struct vmrun_run *vmrun_run)
 		vcpu->srcu_idx = srcu_read_lock(&vmrun->srcu);
 
 		for (;;) {
-			if (vcpu->mp_state == VMRUN_MP_STATE_RUNNABLE) {
+			if (vmrun->dirty_ring_size &&
+			    vmrun_dirty_ring_soft_full(&vcpu->dirty_ring)) {
+				vmrun_run->exit_reason = VMRUN_EXIT_DIRTY_RING_FULL;
+				r = 0;
+				break;
+			}
+
+			if (!list_empty_careful(&vcpu->async_pf.done))
+				vmrun_check_async_pf_completion(vcpu);
+
+			if (vcpu->apf.halted) {
+				r = vmrun_vcpu_async_pf_halt(vcpu);
+			} else if (vcpu->mp_state == VMRUN_MP_STATE_RUNNABLE) {
 				r = vmrun_vcpu_enter_guest(vcpu);
 			} else {
 				// r = vmrun_vcpu_hlt(vcpu);
@@ -1739,12 +2148,14 @@ int vmrun_vcpu_ioctl_run(struct vmrun_vcpu *vcpu, struct vmrun_run *vmrun_run)
 //			}
 
 			if (need_resched()) {
+				vmrun_page_track_flush_access(vcpu);
 				srcu_read_unlock(&vmrun->srcu, vcpu->srcu_idx);
 				cond_resched();
 				vcpu->srcu_idx = srcu_read_lock(&vmrun->srcu);
 			}
 		}
 
+		vmrun_page_track_flush_access(vcpu);
 		srcu_read_unlock(&vmrun->srcu, vcpu->srcu_idx);
 	}
 
@@ -2050,6 +2461,11 @@ static int vmrun_vcpu_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 		page = virt_to_page(vcpu->run);
 //	else if (vmf->pgoff == VMRUN_PIO_PAGE_OFFSET)
 //		page = virt_to_page(vcpu->arch.pio_data);
+	else if (vmf->pgoff >= VMRUN_DIRTY_LOG_PAGE_OFFSET &&
+		 vmf->pgoff < VMRUN_DIRTY_LOG_PAGE_OFFSET +
+			      vcpu->vmrun->dirty_ring_size / PAGE_SIZE)
+		page = vmalloc_to_page((void *)vcpu->dirty_ring.dirty_gfns +
+			(vmf->pgoff - VMRUN_DIRTY_LOG_PAGE_OFFSET) * PAGE_SIZE);
 	else
 		return VM_FAULT_SIGBUS;
 
@@ -2071,9 +2487,6 @@ static int vmrun_vcpu_mmap(struct file *file, struct vm_area_struct *vma)
 	return 0;
 }
 
-static void vmrun_get_vmrun(struct vmrun *vmrun);
-static void vmrun_put_vmrun(struct vmrun *vmrun);
-
 static int vmrun_vcpu_release(struct inode *inode, struct file *filp)
 {
 	struct vmrun_vcpu *vcpu = filp->private_data;
@@ -2181,19 +2594,6 @@ vcpu_decrement:
 	return r;
 }
 
-static inline struct vmrun_memory_slot *
-id_to_memslot(struct vmrun_memslots *slots, int id)
-{
-	int index = slots->id_to_index[id];
-	struct vmrun_memory_slot *slot;
-
-	slot = &slots->memslots[index];
-
-	WARN_ON(slot->id != id);
-
-	return slot;
-}
-
 /*
  * Insert memslot and re-sort memslots based on their GFN,
  * so binary search could be used to lookup GFN.
@@ -2222,6 +2622,7 @@ static void vmrun_update_memslots(struct vmrun_memslots *slots,
 		if (!mslots[i + 1].npages)
 			break;
 		mslots[i] = mslots[i + 1];
+		slots->base_gfns[i] = mslots[i].base_gfn;
 		slots->id_to_index[mslots[i].id] = i;
 		i++;
 	}
@@ -2239,6 +2640,7 @@ static void vmrun_update_memslots(struct vmrun_memslots *slots,
 		while (i > 0 &&
 		       new->base_gfn >= mslots[i - 1].base_gfn) {
 			mslots[i] = mslots[i - 1];
+			slots->base_gfns[i] = mslots[i].base_gfn;
 			slots->id_to_index[mslots[i].id] = i;
 			i--;
 		}
@@ -2246,6 +2648,7 @@ static void vmrun_update_memslots(struct vmrun_memslots *slots,
 		WARN_ON_ONCE(i != slots->used_slots);
 
 	mslots[i] = *new;
+	slots->base_gfns[i] = new->base_gfn;
 	slots->id_to_index[mslots[i].id] = i;
 }
 
@@ -2263,16 +2666,55 @@ static int vmrun_check_memory_region_flags(const struct vmrun_userspace_memory_r
 	return 0;
 }
 
-static inline struct vmrun_memslots *__vmrun_memslots(struct vmrun *vmrun, int as_id)
+/*
+ * Size of the host page backing @gfn; hugetlbfs mappings report their
+ * huge page size, everything else PAGE_SIZE.
+ */
+unsigned long vmrun_host_page_size(struct vmrun *vmrun, gfn_t gfn)
 {
-	return srcu_dereference_check(vmrun->memslots[as_id], &vmrun->srcu,
-				      lockdep_is_held(&vmrun->slots_lock) ||
-				      !atomic_read(&vmrun->users_count));
+	struct vmrun_memory_slot *slot;
+	struct vm_area_struct *vma;
+	unsigned long addr, size;
+
+	size = PAGE_SIZE;
+
+	slot = search_memslots(vmrun_memslots(vmrun), gfn);
+	if (!slot || slot->flags & VMRUN_MEMSLOT_INVALID)
+		return PAGE_SIZE;
+
+	addr = __gfn_to_hva_memslot(slot, gfn);
+
+	down_read(&current->mm->mmap_sem);
+	vma = find_vma(current->mm, addr);
+	if (vma)
+		size = vma_kernel_pagesize(vma);
+	up_read(&current->mm->mmap_sem);
+
+	return size;
 }
 
-static inline struct vmrun_memslots *vmrun_memslots(struct vmrun *vmrun)
+#define vmrun_for_each_memslot(memslot, slots)	\
+	for (memslot = &slots->memslots[0];	\
+	      memslot < slots->memslots + VMRUN_MEM_SLOTS_NUM && memslot->npages;\
+		memslot++)
+
+/*
+ * The hva tree links the entries of memslots[], which move around on
+ * every update and are copied into a new array, so rebuild it from
+ * scratch; there are at most VMRUN_MEM_SLOTS_NUM slots.
+ */
+static void vmrun_build_hva_tree(struct vmrun_memslots *slots)
 {
-	return __vmrun_memslots(vmrun, 0);
+	struct vmrun_memory_slot *memslot;
+
+	slots->hva_tree = RB_ROOT_CACHED;
+
+	vmrun_for_each_memslot(memslot, slots) {
+		memslot->hva_node.start = memslot->userspace_addr;
+		memslot->hva_node.last = memslot->userspace_addr +
+					 (memslot->npages << PAGE_SHIFT) - 1;
+		interval_tree_insert(&memslot->hva_node, &slots->hva_tree);
+	}
 }
 
 static struct vmrun_memslots *vmrun_install_new_memslots(struct vmrun *vmrun,
@@ -2280,6 +2722,8 @@ static struct vmrun_memslots *vmrun_install_new_memslots(struct vmrun *vmrun,
 {
 	struct vmrun_memslots *old_memslots = __vmrun_memslots(vmrun, as_id);
 
+	vmrun_build_hva_tree(slots);
+
 	/*
 	 * Set the low bit in the generation, which disables SPTE caching
 	 * until the end of synchronize_srcu_expedited.
@@ -2312,11 +2756,6 @@ static struct vmrun_memslots *vmrun_install_new_memslots(struct vmrun *vmrun,
 	return old_memslots;
 }
 
-#define vmrun_for_each_memslot(memslot, slots)	\
-	for (memslot = &slots->memslots[0];	\
-	      memslot < slots->memslots + VMRUN_MEM_SLOTS_NUM && memslot->npages;\
-		memslot++)
-
 static struct vmrun_memslots *vmrun_alloc_memslots(void)
 {
 	struct vmrun_memslots *slots;
@@ -2348,17 +2787,41 @@ static void vmrun_destroy_dirty_bitmap(struct vmrun_memory_slot *memslot)
 	memslot->dirty_bitmap = NULL;
 }
 
-void vmrun_page_track_free_memslot(struct vmrun_memory_slot *free,
-				   struct vmrun_memory_slot *dont)
+/*
+ * Allocation size is twice as large as the actual dirty bitmap size.
+ * The second half is where vmrun_vm_ioctl_get_dirty_log() collects the
+ * harvested bits before copying them to userspace.
+ */
+static int vmrun_create_dirty_bitmap(struct vmrun_memory_slot *memslot)
 {
-	int i;
+	unsigned long dirty_bytes = 2 * vmrun_dirty_bitmap_bytes(memslot);
 
-	for (i = 0; i < VMRUN_PAGE_TRACK_MAX; i++)
-		if (!dont || free->arch.gfn_track[i] !=
-			     dont->arch.gfn_track[i]) {
-			kvfree(free->arch.gfn_track[i]);
-			free->arch.gfn_track[i] = NULL;
-		}
+	memslot->dirty_bitmap = vmrun_kvzalloc(dirty_bytes);
+	if (!memslot->dirty_bitmap)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void vmrun_vcpu_mark_page_dirty(struct vmrun_vcpu *vcpu, gfn_t gfn)
+{
+	struct vmrun_memory_slot *memslot;
+	unsigned long rel_gfn;
+	int as_id;
+
+	memslot = vmrun_vcpu_gfn_to_memslot(vcpu, gfn);
+	if (!memslot || !(memslot->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
+		return;
+
+	rel_gfn = gfn - memslot->base_gfn;
+
+	if (vcpu->vmrun->dirty_ring_size) {
+		as_id = (vcpu->hflags & HF_SMM_MASK) ? 1 : 0;
+		vmrun_dirty_ring_push(&vcpu->dirty_ring,
+				      (as_id << 16) | memslot->id, rel_gfn);
+	} else if (memslot->dirty_bitmap) {
+		set_bit_le(rel_gfn, memslot->dirty_bitmap);
+	}
 }
 
 void vmrun_arch_free_memslot(struct vmrun *vmrun,
@@ -2431,12 +2894,13 @@ int vmrun_arch_create_memslot(struct vmrun *vmrun, struct vmrun_memory_slot *slo
 
 		/*
 		 * If the gfn and userspace address are not aligned wrt each
-		 * other, or if explicitly asked to, disable large page
+		 * other, if the page size cannot be mapped by the nested page
+		 * tables, or if explicitly asked to, disable large page
 		 * support for this slot
 		 */
 
 		if ((slot->base_gfn ^ ugfn) & (VMRUN_PAGES_PER_HPAGE(level) - 1) ||
-		    !largepages_enabled) {
+		    level > vmrun_get_lpage_level() || !largepages_enabled) {
 			unsigned long j;
 
 			for (j = 0; j < lpages; ++j)
@@ -2444,6 +2908,9 @@ int vmrun_arch_create_memslot(struct vmrun *vmrun, struct vmrun_memory_slot *slo
 		}
 	}
 
+	slot->arch.prefetch_window = PTE_PREFETCH_NUM;
+	slot->arch.prefetch_score = 0;
+
 	if (vmrun_page_track_create_memslot(slot, npages))
 		goto out_free;
 
@@ -2464,12 +2931,27 @@ out_free:
 	return -ENOMEM;
 }
 
+static void vmrun_mmu_slot_apply_flags(struct vmrun *vmrun,
+				       struct vmrun_memory_slot *new)
+{
+	/*
+	 * Dirty logging tracks writes by write protecting the slot: the
+	 * first write to each page faults, marks the page in the dirty
+	 * bitmap and makes the spte writable again.  NPT has no PML, and
+	 * harvesting D-bits instead would cost a walk of every spte of the
+	 * slot on each VMRUN_GET_DIRTY_LOG.
+	 */
+	if (new->flags & VMRUN_MEM_LOG_DIRTY_PAGES)
+		vmrun_mmu_slot_remove_write_access(vmrun, new);
+}
+
 void vmrun_arch_commit_memory_region(struct vmrun *vmrun,
 				     const struct vmrun_userspace_memory_region *mem,
 				     const struct vmrun_memory_slot *old,
 				     const struct vmrun_memory_slot *new,
 				     enum vmrun_mr_change change)
 {
+	int as_id = mem->slot >> 16;
 	int nr_mmu_pages = 0;
 
 	if (!vmrun->n_requested_mmu_pages)
@@ -2486,14 +2968,28 @@ void vmrun_arch_commit_memory_region(struct vmrun *vmrun,
 	 * in the source machine (for example if live migration fails), small
 	 * sptes will remain around and cause bad performance.
 	 *
-	 * Scan sptes if dirty logging has been stopped, dropping those
-	 * which can be collapsed into a single large-page spte.  Later
-	 * page faults will create the large-page sptes.
+	 * Rebuild the large-page sptes in the background once dirty logging
+	 * has been stopped, replacing fully populated page tables in place
+	 * and zapping the small sptes of the others so that later page
+	 * faults create them.
+	 */
+	if ((change == VMRUN_MR_DELETE || change == VMRUN_MR_MOVE) ||
+	    (new->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
+		vmrun_mmu_stop_huge_page_recovery(vmrun, as_id, old);
+	else if ((old->flags & VMRUN_MEM_LOG_DIRTY_PAGES) &&
+		 !(new->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
+		vmrun_mmu_start_huge_page_recovery(vmrun, as_id, new);
+
+	/*
+	 * Conversely, split large sptes as soon as dirty logging starts,
+	 * instead of letting every first write to a large page fault to
+	 * demote it.
 	 */
-	if ((change != VMRUN_MR_DELETE) &&
-	    (old->flags & VMRUN_MEM_LOG_DIRTY_PAGES) &&
-	    !(new->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
-		vmrun_mmu_zap_collapsible_sptes(vmrun, new);
+	if ((change == VMRUN_MR_FLAGS_ONLY) &&
+	    !(old->flags & VMRUN_MEM_LOG_DIRTY_PAGES) &&
+	    (new->flags & VMRUN_MEM_LOG_DIRTY_PAGES))
+		vmrun_mmu_slot_split_huge_pages(vmrun,
+					(struct vmrun_memory_slot *) new);
 
 	/*
 	 * Set up write protection and/or dirty logging for the new slot.
@@ -2505,8 +3001,8 @@ void vmrun_arch_commit_memory_region(struct vmrun *vmrun,
 	 *
 	 * FIXME: const-ify all uses of struct vmrun_memory_slot.
 	 */
-//	if (change != VMRUN_MR_DELETE)
-//		vmrun_mmu_slot_apply_flags(vmrun, (struct vmrun_memory_slot *) new);
+	if (change != VMRUN_MR_DELETE)
+		vmrun_mmu_slot_apply_flags(vmrun, (struct vmrun_memory_slot *) new);
 }
 
 /*
@@ -2538,39 +3034,128 @@ static void vmrun_free_memslots(struct vmrun *vmrun, struct vmrun_memslots *slot
 }
 
 /*
- * Allocate some memory and give it an address in the guest physical address
- * space.
- *
- * Discontiguous memory is allowed, mostly for framebuffers.
+ * Each address space has two memslot arrays: the active one, published
+ * in vmrun->memslots[], and an inactive one that the next update edits
+ * and swaps in.  After a swap the inactive array lacks only the slots
+ * changed by that swap, which are recorded in memslots_stale[] and
+ * replayed from the active array before the next edit, instead of
+ * copying all VMRUN_MEM_SLOTS_NUM slots.
  *
- * Must be called holding vmrun->slots_lock for write.
+ * Slot contents in the inactive array are stale copies; only the
+ * active array owns the dirty bitmaps and arch data.
  */
-int __vmrun_set_memory_region(struct vmrun *vmrun,
-			    const struct vmrun_userspace_memory_region *mem)
+static struct vmrun_memslots *vmrun_get_inactive_memslots(struct vmrun *vmrun,
+							  int as_id)
 {
-	int r;
-	gfn_t base_gfn;
-	unsigned long npages;
-	struct vmrun_memory_slot *slot;
-	struct vmrun_memory_slot old, new;
-	struct vmrun_memslots *slots = NULL, *old_memslots;
-	int as_id, id;
-	enum vmrun_mr_change change;
+	struct vmrun_memslots *active = __vmrun_memslots(vmrun, as_id);
+	struct vmrun_memslots *slots = vmrun->inactive_memslots[as_id];
+	unsigned long *stale = vmrun->memslots_stale[as_id];
+	struct vmrun_memory_slot *src;
+	int id;
 
-	r = vmrun_check_memory_region_flags(mem);
-	if (r)
-		goto out;
+	for_each_set_bit(id, stale, VMRUN_MEM_SLOTS_NUM) {
+		src = id_to_memslot(active, id);
 
-	r = -EINVAL;
-	as_id = mem->slot >> 16;
-	id = (u16)mem->slot;
+		/* Created and deleted again while the array was swapped out. */
+		if (!src->npages && !id_to_memslot(slots, id)->npages)
+			continue;
 
-	/* General sanity checks */
-	if (mem->memory_size & (PAGE_SIZE - 1))
-		goto out;
+		vmrun_update_memslots(slots, src);
+	}
 
-	if (mem->guest_phys_addr & (PAGE_SIZE - 1))
-		goto out;
+	bitmap_zero(stale, VMRUN_MEM_SLOTS_NUM);
+
+	return slots;
+}
+
+/* Publish the inactive array; @changed lists the slot ids edited in it. */
+static void vmrun_swap_active_memslots(struct vmrun *vmrun, int as_id,
+				       const unsigned long *changed)
+{
+	struct vmrun_memslots *slots = vmrun->inactive_memslots[as_id];
+
+	vmrun->inactive_memslots[as_id] =
+		vmrun_install_new_memslots(vmrun, as_id, slots);
+	bitmap_copy(vmrun->memslots_stale[as_id], changed, VMRUN_MEM_SLOTS_NUM);
+}
+
+struct vmrun_memslot_change {
+	const struct vmrun_userspace_memory_region *mem;
+	struct vmrun_memory_slot old, new;
+	enum vmrun_mr_change change;
+	/* The region does not change anything. */
+	bool nop;
+};
+
+static bool vmrun_memslot_overlaps(gfn_t base_gfn, unsigned long npages,
+				   struct vmrun_memory_slot *slot)
+{
+	return !((base_gfn + npages <= slot->base_gfn) ||
+		 (base_gfn >= slot->base_gfn + slot->npages));
+}
+
+/*
+ * A created or moved slot must not overlap the other user slots once
+ * the whole batch is applied: the slots of the active memslots that
+ * the batch leaves alone (not in @batch_ids), and the new layout of
+ * the other regions in the batch.
+ */
+static bool vmrun_memslot_change_overlaps(struct vmrun *vmrun, int as_id,
+					  const unsigned long *batch_ids,
+					  struct vmrun_memslot_change *changes,
+					  int nr, int i)
+{
+	struct vmrun_memory_slot *new = &changes[i].new;
+	struct vmrun_memory_slot *slot;
+	int j;
+
+	vmrun_for_each_memslot(slot, __vmrun_memslots(vmrun, as_id)) {
+		if ((slot->id >= VMRUN_USER_MEM_SLOTS) ||
+		    test_bit(slot->id, batch_ids))
+			continue;
+		if (vmrun_memslot_overlaps(new->base_gfn, new->npages, slot))
+			return true;
+	}
+
+	for (j = 0; j < nr; j++) {
+		slot = &changes[j].new;
+		if (j == i || !slot->npages || slot->id >= VMRUN_USER_MEM_SLOTS)
+			continue;
+		if (vmrun_memslot_overlaps(new->base_gfn, new->npages, slot))
+			return true;
+	}
+
+	return false;
+}
+
+/* Validate @mem against the active memslots and fill in @c. */
+static int vmrun_prepare_memslot_change(struct vmrun *vmrun,
+					const struct vmrun_userspace_memory_region *mem,
+					struct vmrun_memslot_change *c)
+{
+	int r;
+	gfn_t base_gfn;
+	unsigned long npages;
+	struct vmrun_memory_slot *slot;
+	int as_id, id;
+
+	c->mem = mem;
+	c->nop = false;
+
+	r = vmrun_check_memory_region_flags(mem);
+	if (r)
+		return r;
+
+	r = -EINVAL;
+	as_id = mem->slot >> 16;
+	id = (u16)mem->slot;
+
+	/* General sanity checks */
+	if (mem->memory_size & (PAGE_SIZE - 1))
+		return r;
+
+	if (mem->guest_phys_addr & (PAGE_SIZE - 1))
+		return r;
 
 	/* We can read the guest memory with __xxx_user() later on. */
 	if ((id < VMRUN_USER_MEM_SLOTS) &&
@@ -2578,98 +3163,170 @@ int __vmrun_set_memory_region(struct vmrun *vmrun,
 	     !access_ok(VERIFY_WRITE,
 			(void __user *)(unsigned long)mem->userspace_addr,
 			mem->memory_size)))
-		goto out;
+		return r;
 
 	if (as_id >= VMRUN_ADDRESS_SPACE_NUM || id >= VMRUN_MEM_SLOTS_NUM)
-		goto out;
+		return r;
 
 	if (mem->guest_phys_addr + mem->memory_size < mem->guest_phys_addr)
-		goto out;
+		return r;
 
 	slot = id_to_memslot(__vmrun_memslots(vmrun, as_id), id);
 	base_gfn = mem->guest_phys_addr >> PAGE_SHIFT;
 	npages = mem->memory_size >> PAGE_SHIFT;
 
 	if (npages > VMRUN_MEM_MAX_NR_PAGES)
-		goto out;
+		return r;
 
-	new = old = *slot;
+	c->new = c->old = *slot;
 
-	new.id = id;
-	new.base_gfn = base_gfn;
-	new.npages = npages;
-	new.flags = mem->flags;
+	c->new.id = id;
+	c->new.base_gfn = base_gfn;
+	c->new.npages = npages;
+	c->new.flags = mem->flags;
 
 	if (npages) {
-		if (!old.npages)
-			change = VMRUN_MR_CREATE;
+		if (!c->old.npages)
+			c->change = VMRUN_MR_CREATE;
 		else { /* Modify an existing slot. */
-			if ((mem->userspace_addr != old.userspace_addr) ||
-			    (npages != old.npages) ||
-			    ((new.flags ^ old.flags) & VMRUN_MEM_READONLY))
-				goto out;
-
-			if (base_gfn != old.base_gfn)
-				change = VMRUN_MR_MOVE;
-			else if (new.flags != old.flags)
-				change = VMRUN_MR_FLAGS_ONLY;
+			if ((mem->userspace_addr != c->old.userspace_addr) ||
+			    (npages != c->old.npages) ||
+			    ((c->new.flags ^ c->old.flags) & VMRUN_MEM_READONLY))
+				return r;
+
+			if (base_gfn != c->old.base_gfn)
+				c->change = VMRUN_MR_MOVE;
+			else if (c->new.flags != c->old.flags)
+				c->change = VMRUN_MR_FLAGS_ONLY;
 			else { /* Nothing to change. */
-				r = 0;
-				goto out;
+				c->nop = true;
+				return 0;
 			}
 		}
 	} else {
-		if (!old.npages)
-			goto out;
+		if (!c->old.npages)
+			return r;
 
-		change = VMRUN_MR_DELETE;
-		new.base_gfn = 0;
-		new.flags = 0;
+		c->change = VMRUN_MR_DELETE;
+		c->new.base_gfn = 0;
+		c->new.flags = 0;
 	}
 
-	if ((change == VMRUN_MR_CREATE) || (change == VMRUN_MR_MOVE)) {
-		/* Check for overlaps */
-		r = -EEXIST;
-		vmrun_for_each_memslot(slot, __vmrun_memslots(vmrun, as_id)) {
-			if ((slot->id >= VMRUN_USER_MEM_SLOTS) ||
-			    (slot->id == id))
-				continue;
-			if (!((base_gfn + npages <= slot->base_gfn) ||
-			      (base_gfn >= slot->base_gfn + slot->npages)))
-				goto out;
+	/* Free page dirty bitmap if unneeded */
+	if (!(c->new.flags & VMRUN_MEM_LOG_DIRTY_PAGES))
+		c->new.dirty_bitmap = NULL;
+
+	if (c->change == VMRUN_MR_CREATE) {
+		c->new.userspace_addr = mem->userspace_addr;
+
+		if (vmrun_arch_create_memslot(vmrun, &c->new, npages)) {
+			vmrun_free_memslot(vmrun, &c->new, &c->old);
+			return -ENOMEM;
 		}
 	}
 
-	/* Free page dirty bitmap if unneeded */
-	if (!(new.flags & VMRUN_MEM_LOG_DIRTY_PAGES))
-		new.dirty_bitmap = NULL;
+	/* Allocate page dirty bitmap if needed */
+	if ((c->new.flags & VMRUN_MEM_LOG_DIRTY_PAGES) && !c->new.dirty_bitmap &&
+	    !vmrun->dirty_ring_size) {
+		if (vmrun_create_dirty_bitmap(&c->new) < 0) {
+			vmrun_free_memslot(vmrun, &c->new, &c->old);
+			return -ENOMEM;
+		}
+	}
 
-	r = -ENOMEM;
-	if (change == VMRUN_MR_CREATE) {
-		new.userspace_addr = mem->userspace_addr;
+	return 0;
+}
+
+/*
+ * Apply @nr memory regions, all in the same address space, as one
+ * transaction: either all of them are applied or none is.  A batch
+ * costs one SRCU synchronization, or two if it deletes or moves slots,
+ * however many regions it holds.
+ *
+ * Discontiguous memory is allowed, mostly for framebuffers.
+ *
+ * Must be called holding vmrun->slots_lock for write.
+ */
+int __vmrun_set_memory_regions(struct vmrun *vmrun,
+			       const struct vmrun_userspace_memory_region *mems,
+			       int nr)
+{
+	DECLARE_BITMAP(batch_ids, VMRUN_MEM_SLOTS_NUM);
+	struct vmrun_memslot_change *changes;
+	struct vmrun_memslots *slots;
+	struct vmrun_memory_slot *slot;
+	bool invalidate = false;
+	int as_id, id;
+	int r, i;
 
-		if (vmrun_arch_create_memslot(vmrun, &new, npages))
+	if (nr <= 0 || nr > ULONG_MAX / sizeof(*changes))
+		return -EINVAL;
+
+	changes = vmrun_kvzalloc(nr * sizeof(*changes));
+	if (!changes)
+		return -ENOMEM;
+
+	bitmap_zero(batch_ids, VMRUN_MEM_SLOTS_NUM);
+
+	as_id = mems[0].slot >> 16;
+	r = -EINVAL;
+	for (i = 0; i < nr; i++) {
+		id = (u16)mems[i].slot;
+		if ((mems[i].slot >> 16) != as_id || id >= VMRUN_MEM_SLOTS_NUM ||
+		    __test_and_set_bit(id, batch_ids))
+			goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		r = vmrun_prepare_memslot_change(vmrun, &mems[i], &changes[i]);
+		if (r)
 			goto out_free;
+
+		if (!changes[i].nop &&
+		    (changes[i].change == VMRUN_MR_DELETE ||
+		     changes[i].change == VMRUN_MR_MOVE))
+			invalidate = true;
 	}
 
-//	/* Allocate page dirty bitmap if needed */
-//	if ((new.flags & VMRUN_MEM_LOG_DIRTY_PAGES) && !new.dirty_bitmap) {
-//		if (vmrun_create_dirty_bitmap(&new) < 0)
-//			goto out_free;
-//	}
+	/* Check for overlaps */
+	r = -EEXIST;
+	for (i = 0; i < nr; i++) {
+		if (changes[i].nop ||
+		    (changes[i].change != VMRUN_MR_CREATE &&
+		     changes[i].change != VMRUN_MR_MOVE))
+			continue;
 
-	slots = vmrun_kvzalloc(sizeof(struct vmrun_memslots));
+		if (vmrun_memslot_change_overlaps(vmrun, as_id, batch_ids,
+						  changes, nr, i)) {
+			i = nr;
+			goto out_free;
+		}
+	}
 
-	if (!slots)
-		goto out_free;
+	/* batch_ids now tracks the slots that are edited below. */
+	for (i = 0; i < nr; i++)
+		if (changes[i].nop)
+			__clear_bit(changes[i].new.id, batch_ids);
 
-	memcpy(slots, __vmrun_memslots(vmrun, as_id), sizeof(struct vmrun_memslots));
+	if (bitmap_empty(batch_ids, VMRUN_MEM_SLOTS_NUM)) {
+		r = 0;
+		goto out;
+	}
 
-	if ((change == VMRUN_MR_DELETE) || (change == VMRUN_MR_MOVE)) {
-		slot = id_to_memslot(slots, id);
-		slot->flags |= VMRUN_MEMSLOT_INVALID;
+	if (invalidate) {
+		slots = vmrun_get_inactive_memslots(vmrun, as_id);
 
-		old_memslots = vmrun_install_new_memslots(vmrun, as_id, slots);
+		for (i = 0; i < nr; i++) {
+			if (changes[i].nop ||
+			    (changes[i].change != VMRUN_MR_DELETE &&
+			     changes[i].change != VMRUN_MR_MOVE))
+				continue;
+
+			id_to_memslot(slots, changes[i].new.id)->flags |=
+				VMRUN_MEMSLOT_INVALID;
+		}
+
+		vmrun_swap_active_memslots(vmrun, as_id, batch_ids);
 
 		/* From this point no new shadow pages pointing to a deleted,
 		 * or moved, memslot will be created.
@@ -2678,45 +3335,73 @@ int __vmrun_set_memory_region(struct vmrun *vmrun,
 		 *	- gfn_to_hva (vmrun_read_guest, gfn_to_pfn)
 		 *	- vmrun_is_visible_gfn (mmu_check_roots)
 		 */
-		// vmrun_arch_flush_shadow_memslot(vmrun, slot);
-		vmrun_page_track_flush_slot(vmrun, slot);
+		slots = __vmrun_memslots(vmrun, as_id);
+		for (i = 0; i < nr; i++) {
+			slot = id_to_memslot(slots, changes[i].new.id);
+			if (!(slot->flags & VMRUN_MEMSLOT_INVALID))
+				continue;
 
-		/*
-		 * We can re-use the old_memslots from above, the only difference
-		 * from the currently installed memslots is the invalid flag.  This
-		 * will get overwritten by update_memslots anyway.
-		 */
-		slots = old_memslots;
+			// vmrun_arch_flush_shadow_memslot(vmrun, slot);
+			vmrun_page_track_flush_slot(vmrun, slot);
+		}
 	}
 
-	r = 0; // vmrun_arch_prepare_memory_region(vmrun, &new, mem, change);
+	// r = vmrun_arch_prepare_memory_region(vmrun, &new, mem, change);
+
+	slots = vmrun_get_inactive_memslots(vmrun, as_id);
+
+	for (i = 0; i < nr; i++) {
+		if (changes[i].nop)
+			continue;
 
-	// if (r)
-	//	goto out_slots;
+		/* actual memory is freed via old in vmrun_free_memslot below */
+		if (changes[i].change == VMRUN_MR_DELETE) {
+			changes[i].new.dirty_bitmap = NULL;
+			memset(&changes[i].new.arch, 0,
+			       sizeof(changes[i].new.arch));
+		}
 
-	/* actual memory is freed via old in vmrun_free_memslot below */
-	if (change == VMRUN_MR_DELETE) {
-		new.dirty_bitmap = NULL;
-		memset(&new.arch, 0, sizeof(new.arch));
+		vmrun_update_memslots(slots, &changes[i].new);
 	}
 
-	vmrun_update_memslots(slots, &new);
-	old_memslots = vmrun_install_new_memslots(vmrun, as_id, slots);
+	vmrun_swap_active_memslots(vmrun, as_id, batch_ids);
 
-	vmrun_arch_commit_memory_region(vmrun, mem, &old, &new, change);
+	for (i = 0; i < nr; i++) {
+		if (changes[i].nop)
+			continue;
 
-	vmrun_free_memslot(vmrun, &old, &new);
-	kvfree(old_memslots);
-	
+		vmrun_arch_commit_memory_region(vmrun, changes[i].mem,
+						&changes[i].old,
+						&changes[i].new,
+						changes[i].change);
+		vmrun_free_memslot(vmrun, &changes[i].old, &changes[i].new);
+	}
+
+	kvfree(changes);
 	return 0;
 
 out_free:
-	vmrun_free_memslot(vmrun, &new, &old);
-
+	while (i--)
+		if (!changes[i].nop)
+			vmrun_free_memslot(vmrun, &changes[i].new,
+					   &changes[i].old);
 out:
+	kvfree(changes);
 	return r;
 }
 
+/*
+ * Allocate some memory and give it an address in the guest physical address
+ * space.
+ *
+ * Must be called holding vmrun->slots_lock for write.
+ */
+int __vmrun_set_memory_region(struct vmrun *vmrun,
+			    const struct vmrun_userspace_memory_region *mem)
+{
+	return __vmrun_set_memory_regions(vmrun, mem, 1);
+}
+
 int __vmrun_set_memory_region_vm_destroy(struct vmrun *vmrun, int id, gpa_t gpa, u32 size)
 {
 	int i, r;
@@ -2803,6 +3488,307 @@ static int vmrun_vm_ioctl_set_memory_region(struct vmrun *vmrun,
 	return vmrun_set_memory_region(vmrun, mem);
 }
 
+static int vmrun_vm_ioctl_set_memory_regions(struct vmrun *vmrun,
+					     struct vmrun_userspace_memory_regions __user *argp)
+{
+	struct vmrun_userspace_memory_regions regions;
+	struct vmrun_userspace_memory_region *mems;
+	int r, i;
+
+	if (copy_from_user(&regions, argp, sizeof(regions)))
+		return -EFAULT;
+
+	if (!regions.nregions || regions.nregions > VMRUN_USER_MEM_SLOTS)
+		return -EINVAL;
+
+	mems = vmrun_kvzalloc(regions.nregions * sizeof(*mems));
+	if (!mems)
+		return -ENOMEM;
+
+	r = -EFAULT;
+	if (copy_from_user(mems, argp->regions,
+			   regions.nregions * sizeof(*mems)))
+		goto out;
+
+	r = -EINVAL;
+	for (i = 0; i < regions.nregions; i++)
+		if ((u16)mems[i].slot >= VMRUN_USER_MEM_SLOTS)
+			goto out;
+
+	mutex_lock(&vmrun->slots_lock);
+	r = __vmrun_set_memory_regions(vmrun, mems, regions.nregions);
+	mutex_unlock(&vmrun->slots_lock);
+
+out:
+	kvfree(mems);
+	return r;
+}
+
+/*
+ * Copy the dirty bitmap of a slot to userspace and re-arm logging for
+ * the pages it reports.  Each word is swapped out with xchg, so a bit
+ * set concurrently by a vCPU is either reported now or kept for the
+ * next call; only the harvested pages are write protected again, and
+ * the TLBs are flushed once for the whole slot.
+ *
+ * With manual_dirty_log_protect the bitmap is copied as is and nothing
+ * is re-armed until userspace asks for it with VMRUN_CLEAR_DIRTY_LOG.
+ */
+static int vmrun_vm_ioctl_get_dirty_log(struct vmrun *vmrun,
+					struct vmrun_dirty_log *log)
+{
+	struct vmrun_memslots *slots;
+	struct vmrun_memory_slot *memslot;
+	unsigned long *dirty_bitmap, *dirty_bitmap_buffer;
+	unsigned long n, i, mask;
+	bool flush = false;
+	int as_id, id, r;
+
+	/* Dirty pages go to the vCPU rings instead. */
+	if (vmrun->dirty_ring_size)
+		return -ENXIO;
+
+	as_id = log->slot >> 16;
+	id = (u16)log->slot;
+	if (as_id >= VMRUN_ADDRESS_SPACE_NUM || id >= VMRUN_USER_MEM_SLOTS)
+		return -EINVAL;
+
+	/*
+	 * Serializes the flush below against
+	 * vmrun_mmu_slot_remove_write_access(), see the comment there.
+	 */
+	mutex_lock(&vmrun->slots_lock);
+
+	slots = __vmrun_memslots(vmrun, as_id);
+	memslot = id_to_memslot(slots, id);
+
+	r = -ENOENT;
+	dirty_bitmap = memslot->dirty_bitmap;
+	if (!dirty_bitmap)
+		goto out;
+
+	n = vmrun_dirty_bitmap_bytes(memslot);
+
+	if (vmrun->manual_dirty_log_protect) {
+		r = 0;
+		if (copy_to_user(log->dirty_bitmap, dirty_bitmap, n))
+			r = -EFAULT;
+		goto out;
+	}
+
+	dirty_bitmap_buffer = dirty_bitmap + n / sizeof(long);
+	memset(dirty_bitmap_buffer, 0, n);
+
+	write_lock(&vmrun->mmu_lock);
+	for (i = 0; i < n / sizeof(long); i++) {
+		if (!READ_ONCE(dirty_bitmap[i]))
+			continue;
+
+		flush = true;
+		mask = xchg(&dirty_bitmap[i], 0);
+		dirty_bitmap_buffer[i] = mask;
+
+		vmrun_arch_mmu_enable_log_dirty_pt_masked(vmrun, memslot,
+							  i * BITS_PER_LONG,
+							  mask);
+	}
+	write_unlock(&vmrun->mmu_lock);
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	r = 0;
+	if (copy_to_user(log->dirty_bitmap, dirty_bitmap_buffer, n))
+		r = -EFAULT;
+out:
+	mutex_unlock(&vmrun->slots_lock);
+	return r;
+}
+
+/*
+ * Clear the bits of [first_page, first_page + num_pages) of a slot that
+ * are set in the user bitmap, and write protect again the pages whose
+ * bit was actually cleared.  Lets userspace re-arm logging in chunks,
+ * right before it copies each chunk, instead of for the whole slot on
+ * every VMRUN_GET_DIRTY_LOG.
+ */
+static int vmrun_vm_ioctl_clear_dirty_log(struct vmrun *vmrun,
+					  struct vmrun_clear_dirty_log *log)
+{
+	struct vmrun_memslots *slots;
+	struct vmrun_memory_slot *memslot;
+	unsigned long *dirty_bitmap, *dirty_bitmap_buffer;
+	unsigned long n, i, offset, mask;
+	atomic_long_t *p;
+	bool flush = false;
+	int as_id, id, r;
+
+	if (!vmrun->manual_dirty_log_protect)
+		return -ENXIO;
+
+	as_id = log->slot >> 16;
+	id = (u16)log->slot;
+	if (as_id >= VMRUN_ADDRESS_SPACE_NUM || id >= VMRUN_USER_MEM_SLOTS)
+		return -EINVAL;
+
+	/* The range starts on a bitmap word. */
+	if (log->first_page & (BITS_PER_LONG - 1))
+		return -EINVAL;
+
+	mutex_lock(&vmrun->slots_lock);
+
+	slots = __vmrun_memslots(vmrun, as_id);
+	memslot = id_to_memslot(slots, id);
+
+	r = -ENOENT;
+	dirty_bitmap = memslot->dirty_bitmap;
+	if (!dirty_bitmap)
+		goto out;
+
+	/* It ends on a bitmap word too, or at the end of the slot. */
+	r = -EINVAL;
+	if (log->first_page > memslot->npages ||
+	    log->num_pages > memslot->npages - log->first_page ||
+	    (log->num_pages < memslot->npages - log->first_page &&
+	     (log->num_pages & (BITS_PER_LONG - 1))))
+		goto out;
+
+	n = ALIGN(log->num_pages, BITS_PER_LONG) / 8;
+	dirty_bitmap_buffer = dirty_bitmap +
+			      vmrun_dirty_bitmap_bytes(memslot) / sizeof(long);
+
+	r = -EFAULT;
+	if (copy_from_user(dirty_bitmap_buffer, log->dirty_bitmap, n))
+		goto out;
+
+	write_lock(&vmrun->mmu_lock);
+	for (offset = log->first_page, i = 0; i < n / sizeof(long);
+	     i++, offset += BITS_PER_LONG) {
+		mask = dirty_bitmap_buffer[i];
+		if (!mask)
+			continue;
+
+		/*
+		 * Keep only the bits that were set.  That never includes
+		 * bits past the end of the slot, so userspace setting them
+		 * in its bitmap is harmless.
+		 */
+		p = (atomic_long_t *)&dirty_bitmap[offset / BITS_PER_LONG];
+		mask &= atomic_long_fetch_andnot(mask, p);
+		if (!mask)
+			continue;
+
+		flush = true;
+		vmrun_arch_mmu_enable_log_dirty_pt_masked(vmrun, memslot,
+							  offset, mask);
+	}
+	write_unlock(&vmrun->mmu_lock);
+
+	if (flush)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	r = 0;
+out:
+	mutex_unlock(&vmrun->slots_lock);
+	return r;
+}
+
+static int vmrun_vm_ioctl_enable_manual_dirty_log_protect(struct vmrun *vmrun,
+							  unsigned long enable)
+{
+	int r = 0;
+
+	/*
+	 * vmrun->lock orders this against vmrun_vm_ioctl_enable_dirty_ring(),
+	 * slots_lock against VMRUN_GET_DIRTY_LOG and VMRUN_CLEAR_DIRTY_LOG.
+	 */
+	mutex_lock(&vmrun->lock);
+	mutex_lock(&vmrun->slots_lock);
+
+	/* Dirty rings are re-armed by VMRUN_RESET_DIRTY_RINGS already. */
+	if (vmrun->dirty_ring_size)
+		r = -EINVAL;
+	else
+		vmrun->manual_dirty_log_protect = !!enable;
+
+	mutex_unlock(&vmrun->slots_lock);
+	mutex_unlock(&vmrun->lock);
+	return r;
+}
+
+static int vmrun_vm_ioctl_enable_dirty_ring(struct vmrun *vmrun, u32 size)
+{
+	int r;
+
+	/*
+	 * Entries are indexed with the ring size - 1 and the ring is
+	 * mapped page by page; a page always holds more entries than
+	 * VMRUN_DIRTY_RING_RSVD_ENTRIES.
+	 */
+	if (!is_power_of_2(size) || size < PAGE_SIZE ||
+	    size > VMRUN_DIRTY_RING_MAX_ENTRIES * sizeof(struct vmrun_dirty_gfn))
+		return -EINVAL;
+
+	mutex_lock(&vmrun->lock);
+
+	if (vmrun->created_vcpus || vmrun->manual_dirty_log_protect) {
+		/* The rings are allocated along with the vCPUs. */
+		r = -EINVAL;
+	} else if (vmrun->dirty_ring_size) {
+		r = -EBUSY;
+	} else {
+		vmrun->dirty_ring_size = size;
+		r = 0;
+	}
+
+	mutex_unlock(&vmrun->lock);
+	return r;
+}
+
+/*
+ * Hold slots_lock across the flush so that it cannot be missed by
+ * vmrun_mmu_slot_remove_write_access(), see the comment there.
+ */
+static int vmrun_vm_ioctl_reset_dirty_rings(struct vmrun *vmrun)
+{
+	struct vmrun_vcpu *vcpu;
+	unsigned int i;
+	int cleared = 0;
+
+	if (!vmrun->dirty_ring_size)
+		return -EINVAL;
+
+	mutex_lock(&vmrun->slots_lock);
+
+	write_lock(&vmrun->mmu_lock);
+	vmrun_for_each_vcpu(i, vcpu, vmrun)
+		cleared += vmrun_dirty_ring_reset(vmrun, &vcpu->dirty_ring);
+	write_unlock(&vmrun->mmu_lock);
+
+	if (cleared)
+		vmrun_flush_remote_tlbs(vmrun);
+
+	mutex_unlock(&vmrun->slots_lock);
+
+	return cleared;
+}
+
+/* The counters change with mmu_lock held for write. */
+static void vmrun_vm_ioctl_get_mmu_stats(struct vmrun *vmrun,
+					 struct vmrun_mmu_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	read_lock(&vmrun->mmu_lock);
+	stats->mmu_page_hash_buckets = 1ull << vmrun->mmu_page_hash_shift;
+	stats->mmu_page_hash_resizes = vmrun->stat.mmu_page_hash_resizes;
+	stats->mmu_page_hash_collisions = vmrun->stat.mmu_page_hash_collisions;
+	stats->max_mmu_page_hash_collisions =
+		vmrun->stat.max_mmu_page_hash_collisions;
+	stats->mmu_reclaim_refaults = vmrun->stat.mmu_reclaim_refaults;
+	read_unlock(&vmrun->mmu_lock);
+}
+
 static long vmrun_vm_ioctl(struct file *filp,
 			   unsigned int ioctl, unsigned long arg)
 {
@@ -2831,6 +3817,55 @@ static long vmrun_vm_ioctl(struct file *filp,
 			break;
 		}
 
+		case VMRUN_SET_USER_MEMORY_REGIONS:
+			r = vmrun_vm_ioctl_set_memory_regions(vmrun, argp);
+			break;
+
+		case VMRUN_GET_DIRTY_LOG: {
+			struct vmrun_dirty_log log;
+			r = -EFAULT;
+
+			if (copy_from_user(&log, argp, sizeof(log)))
+				goto out;
+
+			r = vmrun_vm_ioctl_get_dirty_log(vmrun, &log);
+			break;
+		}
+
+		case VMRUN_CLEAR_DIRTY_LOG: {
+			struct vmrun_clear_dirty_log log;
+			r = -EFAULT;
+
+			if (copy_from_user(&log, argp, sizeof(log)))
+				goto out;
+
+			r = vmrun_vm_ioctl_clear_dirty_log(vmrun, &log);
+			break;
+		}
+
+		case VMRUN_ENABLE_MANUAL_DIRTY_LOG_PROTECT:
+			r = vmrun_vm_ioctl_enable_manual_dirty_log_protect(vmrun, arg);
+			break;
+
+		case VMRUN_ENABLE_DIRTY_RING:
+			r = vmrun_vm_ioctl_enable_dirty_ring(vmrun, arg);
+			break;
+
+		case VMRUN_RESET_DIRTY_RINGS:
+			r = vmrun_vm_ioctl_reset_dirty_rings(vmrun);
+			break;
+
+		case VMRUN_GET_MMU_STATS: {
+			struct vmrun_mmu_stats stats;
+
+			vmrun_vm_ioctl_get_mmu_stats(vmrun, &stats);
+			r = -EFAULT;
+			if (copy_to_user(argp, &stats, sizeof(stats)))
+				goto out;
+			r = 0;
+			break;
+		}
+
 		default:
 			;
 	}
@@ -2954,13 +3989,13 @@ static void vmrun_mmu_notifier_change_pte(struct mmu_notifier *mn,
 
 	idx = srcu_read_lock(&vmrun->srcu);
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 
 	vmrun->mmu_notifier_seq++;
 
 	vmrun_set_spte_hva(vmrun, address, pte);
 
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 
 	srcu_read_unlock(&vmrun->srcu, idx);
 }
@@ -2975,7 +4010,7 @@ static void vmrun_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 
 	idx = srcu_read_lock(&vmrun->srcu);
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 
 	/*
 	 * The count increase must become visible at unlock time as no
@@ -2991,7 +4026,7 @@ static void vmrun_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 	if (need_tlb_flush)
 		vmrun_flush_remote_tlbs(vmrun);
 
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 
 	srcu_read_unlock(&vmrun->srcu, idx);
 }
@@ -3003,7 +4038,7 @@ static void vmrun_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
 {
 	struct vmrun *vmrun = mmu_notifier_to_vmrun(mn);
 
-	spin_lock(&vmrun->mmu_lock);
+	write_lock(&vmrun->mmu_lock);
 
 	/*
 	 * This sequence increase will notify the vmrun page fault that
@@ -3021,7 +4056,7 @@ static void vmrun_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
 	 */
 	vmrun->mmu_notifier_count--;
 
-	spin_unlock(&vmrun->mmu_lock);
+	write_unlock(&vmrun->mmu_lock);
 
 	BUG_ON(vmrun->mmu_notifier_count < 0);
 }
@@ -3036,15 +4071,15 @@ static int vmrun_mmu_notifier_clear_flush_young(struct mmu_notifier *mn,
 
 	idx = srcu_read_lock(&vmrun->srcu);
 
-	spin_lock(&vmrun->mmu_lock);
-
+	/*
+	 * vmrun_age_hva() takes mmu_lock only for shadow pages; one flush
+	 * covers everything it cleared.
+	 */
 	young = vmrun_age_hva(vmrun, start, end);
 
 	if (young)
 		vmrun_flush_remote_tlbs(vmrun);
 
-	spin_unlock(&vmrun->mmu_lock);
-
 	srcu_read_unlock(&vmrun->srcu, idx);
 
 	return young;
@@ -3060,8 +4095,6 @@ static int vmrun_mmu_notifier_clear_young(struct mmu_notifier *mn,
 
 	idx = srcu_read_lock(&vmrun->srcu);
 
-	spin_lock(&vmrun->mmu_lock);
-
 	/*
 	 * Even though we do not flush TLB, this will still adversely
 	 * affect performance on pre-Haswell Intel EPT, where there is
@@ -3077,8 +4110,6 @@ static int vmrun_mmu_notifier_clear_young(struct mmu_notifier *mn,
 	 */
 	young = vmrun_age_hva(vmrun, start, end);
 
-	spin_unlock(&vmrun->mmu_lock);
-
 	srcu_read_unlock(&vmrun->srcu, idx);
 
 	return young;
@@ -3093,12 +4124,8 @@ static int vmrun_mmu_notifier_test_young(struct mmu_notifier *mn,
 
 	idx = srcu_read_lock(&vmrun->srcu);
 
-	spin_lock(&vmrun->mmu_lock);
-
 	young = vmrun_test_age_hva(vmrun, address);
 
-	spin_unlock(&vmrun->mmu_lock);
-
 	srcu_read_unlock(&vmrun->srcu, idx);
 
 	return young;
@@ -3113,7 +4140,7 @@ static void vmrun_mmu_notifier_release(struct mmu_notifier *mn,
 	idx = srcu_read_lock(&vmrun->srcu);
 
 	// vmrun_arch_flush_shadow_all(vmrun);
-	vmrun_mmu_invalidate_zap_all_pages(vmrun);
+	vmrun_mmu_zap_all(vmrun);
 
 	srcu_read_unlock(&vmrun->srcu, idx);
 }
@@ -3144,7 +4171,7 @@ static struct vmrun *vmrun_create_vm(unsigned long type)
 	if (!vmrun)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&vmrun->mmu_lock);
+	rwlock_init(&vmrun->mmu_lock);
 	atomic_inc(&current->mm->mm_count); // Use mmgrab(current->mm) in v4.11+
 	vmrun->mm = current->mm;
 	mutex_init(&vmrun->lock);
@@ -3159,12 +4186,10 @@ static struct vmrun *vmrun_create_vm(unsigned long type)
 
 	INIT_HLIST_HEAD(&vmrun->mask_notifier_list);
 	INIT_LIST_HEAD(&vmrun->active_mmu_pages);
-	INIT_LIST_HEAD(&vmrun->zapped_obsolete_pages);
 	INIT_LIST_HEAD(&vmrun->assigned_dev_head);
 	atomic_set(&vmrun->noncoherent_dma_count, 0);
 
 	vmrun_page_track_init(vmrun);
-	vmrun_mmu_init_vm(vmrun);
 
 	r = vmrun_cpu_enable_all();
 	if (r)
@@ -3179,6 +4204,12 @@ static struct vmrun *vmrun_create_vm(unsigned long type)
 
 		if (!slots)
 			goto out_err_no_srcu;
+
+		vmrun->inactive_memslots[i] = vmrun_alloc_memslots();
+		if (!vmrun->inactive_memslots[i]) {
+			kvfree(slots);
+			goto out_err_no_srcu;
+		}
 		/*
 		 * Generations must be different for each address space.
 		 * Init vmrun generation close to the maximum to easily test the
@@ -3192,10 +4223,15 @@ static struct vmrun *vmrun_create_vm(unsigned long type)
 	if (init_srcu_struct(&vmrun->srcu))
 		goto out_err_no_srcu;
 
-	r = vmrun_init_mmu_notifier(vmrun);
+	// After srcu: the MMU shrinker may run as soon as it is registered.
+	r = vmrun_mmu_init_vm(vmrun);
 	if (r)
 		goto out_err;
 
+	r = vmrun_init_mmu_notifier(vmrun);
+	if (r)
+		goto out_err_mmu;
+
 	spin_lock(&vmrun_lock);
 	list_add(&vmrun->vm_list, &vm_list);
 	spin_unlock(&vmrun_lock);
@@ -3204,6 +4240,8 @@ static struct vmrun *vmrun_create_vm(unsigned long type)
 
 	return vmrun;
 
+out_err_mmu:
+	vmrun_mmu_uninit_vm(vmrun);
 out_err:
 	cleanup_srcu_struct(&vmrun->srcu);
 
@@ -3213,8 +4251,10 @@ out_err_no_srcu:
 out_err_no_disable:
 	atomic_set(&vmrun->users_count, 0);
 	
-	for (i = 0; i < VMRUN_ADDRESS_SPACE_NUM; i++)
+	for (i = 0; i < VMRUN_ADDRESS_SPACE_NUM; i++) {
 		vmrun_free_memslots(vmrun, __vmrun_memslots(vmrun, i));
+		kvfree(vmrun->inactive_memslots[i]);
+	}
 	
 	kfree(vmrun);
 	mmdrop(current->mm);
@@ -3252,8 +4292,11 @@ static void vmrun_destroy_vm(struct vmrun *vmrun)
 
 	//vmrun_destroy_devices(vmrun);
 
-	for (i = 0; i < VMRUN_ADDRESS_SPACE_NUM; i++)
+	/* The inactive halves only hold stale copies of the slots. */
+	for (i = 0; i < VMRUN_ADDRESS_SPACE_NUM; i++) {
 		vmrun_free_memslots(vmrun, __vmrun_memslots(vmrun, i));
+		kvfree(vmrun->inactive_memslots[i]);
+	}
 
 	//cleanup_srcu_struct(&vmrun->irq_srcu);
 	cleanup_srcu_struct(&vmrun->srcu);
@@ -3420,6 +4463,16 @@ static int vmrun_init(void)
 	if (r)
 		goto out_free_cpumask;
 
+	if (vmrun_has_npt()) {
+		npt_enabled = true;
+		vmrun_enable_tdp();
+		printk("vmrun_init: Nested paging enabled\n");
+	} else {
+		npt_enabled = false;
+		vmrun_disable_tdp();
+		printk("vmrun_init: Nested paging not supported, using shadow paging\n");
+	}
+
 	for_each_possible_cpu(cpu) {
 		r = vmrun_cpu_setup(cpu);
 
@@ -47,6 +47,9 @@
 #include <linux/mm.h>
 #include <linux/mmu_notifier.h>
 #include <linux/preempt.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/interval_tree.h>
 
 #include "page_track.h"
 
@@ -54,6 +57,7 @@
 #define CPUID_EXT_1_SVM_BIT       0x2
 #define CPUID_EXT_A_SVM_LOCK_LEAF 0x8000000a
 #define CPUID_EXT_A_SVM_LOCK_BIT  0x2
+#define CPUID_EXT_A_SVM_NPT_BIT   0x0
 
 #define MSR_VM_CR_SVM_DIS_ADDR    0xc0010114
 #define MSR_VM_CR_SVM_DIS_BIT     0x4
@@ -73,6 +77,8 @@
 
 #define INVALID_PAGE              (~(hpa_t)0)
 
+#define VMRUN_PAT_DEFAULT         0x0007040600070406ULL
+
 #define VMRUN_MAX_VCPUS		 288
 #define VMRUN_SOFT_MAX_VCPUS	 240
 #define VMRUN_MAX_VCPU_ID	 1023
@@ -223,12 +229,112 @@ struct vmrun_cpu_data {
 
 struct vmrun_vcpu;
 
+struct vmrun_rmap_head {
+	unsigned long val;
+};
+
+/*
+ * Objects allocated ahead of time, so that they can be taken while
+ * mmu_lock is held.  Sized for the rmap descriptors of a fault at each
+ * of four levels prefetching a batch of 64 SPTEs.
+ */
+#define VMRUN_NR_MEM_OBJS 256
+
+struct vmrun_mmu_memory_cache {
+	int nobjs;
+	void *objects[VMRUN_NR_MEM_OBJS];
+};
+
+/*
+ * The role of a shadow page: everything, besides the gfn, that selects
+ * which shadow page a guest page table (or a direct-mapped range) maps to.
+ */
+union vmrun_mmu_page_role {
+	unsigned word;
+	struct {
+		unsigned level:4;
+		unsigned cr4_pae:1;
+		unsigned quadrant:2;
+		unsigned direct:1;
+		unsigned access:3;
+		unsigned invalid:1;
+		unsigned nxe:1;
+		unsigned cr0_wp:1;
+		unsigned smep_andnot_wp:1;
+		unsigned smap_andnot_wp:1;
+		unsigned ad_disabled:1;
+		unsigned :7;
+
+		/* Address space (SMM or not) the page belongs to */
+		unsigned smm:8;
+	};
+};
+
+struct vmrun_mmu_page {
+	struct list_head link;
+	struct hlist_node hash_link;
+
+	/*
+	 * The following two entries are used to key the shadow page in the
+	 * hash table.
+	 */
+	gfn_t gfn;
+	union vmrun_mmu_page_role role;
+
+	u64 *spt;
+	/* hold the gfn of each spte inside spt */
+	gfn_t *gfns;
+	bool unsync;
+	bool referenced;         /* Looked up since the reclaim clock passed */
+	int root_count;          /* Currently serving as active root */
+	unsigned int unsync_children;
+	struct vmrun_rmap_head parent_ptes; /* rmap pointers to parent sptes */
+
+	/* The page is obsolete if mmu_valid_gen != vmrun->mmu_valid_gen.  */
+	unsigned long mmu_valid_gen;
+
+	DECLARE_BITMAP(unsync_child_bitmap, 512);
+
+	atomic_t write_flooding_count;
+
+	/*
+	 * Page-table pages of the TDP MMU are not hashed and have no
+	 * parent_ptes; once unlinked they are freed after an RCU grace
+	 * period so that lockless walkers never see them disappear.
+	 */
+	bool tdp_mmu_page;
+	struct rcu_head rcu_head;
+};
+
+/*
+ * Recently reclaimed shadow pages, hashed by gfn and role, to count the
+ * ones that are rebuilt right away.  The table has about one entry per
+ * page the MMU may hold (n_max_mmu_pages), so that a page reclaimed a
+ * whole turn of the clock ago is still remembered when it is rebuilt.
+ */
+#define VMRUN_MMU_RECLAIM_HISTORY_MIN_SHIFT	6
+#define VMRUN_MMU_RECLAIM_HISTORY_MAX_SHIFT	18
+
+struct vmrun_mmu_reclaimed_page {
+	gfn_t gfn;
+	unsigned role;
+	unsigned long when;
+};
+
+static inline struct vmrun_mmu_page *page_header(hpa_t shadow_page)
+{
+	struct page *page = pfn_to_page(shadow_page >> PAGE_SHIFT);
+
+	return (struct vmrun_mmu_page *)page_private(page);
+}
+
 struct vmrun_mmu {
 	void (*new_cr3)(struct vmrun_vcpu *vcpu);
 	int (*page_fault)(struct vmrun_vcpu *vcpu, gva_t gva, u32 err);
 	void (*inval_page)(struct vmrun_vcpu *vcpu, gva_t gva);
 	void (*free)(struct vmrun_vcpu *vcpu);
 	gpa_t (*gva_to_gpa)(struct vmrun_vcpu *vcpu, gva_t gva);
+	void (*set_cr3)(struct vmrun_vcpu *vcpu, unsigned long root);
 	hpa_t root_hpa;
 	int root_level;
 	int shadow_root_level;
@@ -241,6 +347,50 @@ struct vmrun_mmu {
 	u8 permissions[16];
 };
 
+/*
+ * Asynchronous page faults: at most VMRUN_ASYNC_PF_PER_VCPU page-ins
+ * are in flight per vCPU.  The vCPU is halted until a page-in completes,
+ * instead of the vCPU thread sleeping in get_user_pages() where it can
+ * not be interrupted.
+ */
+#define VMRUN_ASYNC_PF_PER_VCPU		64
+
+struct vmrun_arch_async_pf {
+	gfn_t gfn;
+	unsigned long cr3;
+	bool direct_map;
+};
+
+struct vmrun_async_pf {
+	struct work_struct work;
+	struct list_head link;		/* vcpu->async_pf.queue */
+	struct list_head done_link;	/* vcpu->async_pf.done */
+	struct vmrun_vcpu *vcpu;
+	struct mm_struct *mm;
+	gva_t gva;
+	unsigned long addr;
+	struct vmrun_arch_async_pf arch;
+};
+
+/*
+ * Entries are pushed only by the vCPU thread, at dirty_index, and
+ * recycled only by VMRUN_RESET_DIRTY_RINGS, at reset_index; both grow
+ * without bound and are masked with size - 1.  The vCPU exits to
+ * userspace once soft_limit entries are in use, which leaves
+ * VMRUN_DIRTY_RING_RSVD_ENTRIES for the pages dirtied by the exit that
+ * crossed it.
+ */
+#define VMRUN_DIRTY_RING_RSVD_ENTRIES	64
+#define VMRUN_DIRTY_RING_MAX_ENTRIES	65536
+
+struct vmrun_dirty_ring {
+	u32 dirty_index;
+	u32 reset_index;
+	u32 size;
+	u32 soft_limit;
+	struct vmrun_dirty_gfn *dirty_gfns;
+};
+
 
 struct vmrun_vcpu {
 	struct vmrun *vmrun;
@@ -256,6 +406,54 @@ struct vmrun_vcpu {
 	struct vmrun_run *run;
 	struct pid __rcu *pid;
 
+	/* Index in memslots[] of the slot this vCPU found last. */
+	int last_used_slot;
+
+	/*
+	 * Filled by mmu_refill_work when the MMU caches run low and moved
+	 * over before the next fault takes mmu_lock.
+	 */
+	struct mutex mmu_refill_lock;
+	struct work_struct mmu_refill_work;
+	struct vmrun_mmu_memory_cache mmu_refill_desc_cache;
+	struct vmrun_mmu_memory_cache mmu_refill_page_cache;
+	struct vmrun_mmu_memory_cache mmu_refill_header_cache;
+
+	/* Page-track overflow entries for the shadow pages of a fault. */
+	struct vmrun_mmu_memory_cache mmu_page_track_cache;
+
+	/*
+	 * @queue holds every page-in that has not been drained yet and is
+	 * only touched by the vCPU thread.  The work item moves finished
+	 * page-ins to @done under @lock and wakes @wq.
+	 */
+	struct {
+		u32 queued;
+		struct list_head queue;
+		struct list_head done;
+		spinlock_t lock;
+		wait_queue_head_t wq;
+	} async_pf;
+
+	struct {
+		bool halted;
+	} apf;
+
+	struct vmrun_dirty_ring dirty_ring;
+
+	/*
+	 * Access tracked pages touched and not yet reported, with the
+	 * owners of each and of the whole batch.  @filtered holds the pages
+	 * of one filtered node while it is called.
+	 */
+	struct {
+		int nr;
+		unsigned long owners;
+		unsigned long gfn_owners[VMRUN_PAGE_TRACK_ACCESS_BATCH];
+		gfn_t gfns[VMRUN_PAGE_TRACK_ACCESS_BATCH];
+		gfn_t filtered[VMRUN_PAGE_TRACK_ACCESS_BATCH];
+	} track_access;
+
 	/*
 	 * [CONFIG_HAVE_KVM_CPU_RELAX_INTERCEPT]
 	 * Cpu relax intercept or pause loop exit optimization
@@ -306,10 +504,6 @@ struct vmrun_vcpu {
 	struct list_head free_pages;
 };
 
-struct vmrun_rmap_head {
-	unsigned long val;
-};
-
 struct vmrun_lpage_info {
 	int disallow_lpage;
 };
@@ -317,7 +511,14 @@ struct vmrun_lpage_info {
 struct vmrun_arch_memory_slot {
 	struct vmrun_rmap_head *rmap[VMRUN_NR_PAGE_SIZES];
 	struct vmrun_lpage_info *lpage_info[VMRUN_NR_PAGE_SIZES - 1];
-	unsigned short *gfn_track[VMRUN_PAGE_TRACK_MAX];
+	struct vmrun_gfn_track *gfn_track[VMRUN_PAGE_TRACK_MAX];
+
+	/*
+	 * Number of SPTEs prefetched around a direct-map fault, a power of
+	 * two, and the hits minus misses seen since it last changed.
+	 */
+	unsigned int prefetch_window;
+	int prefetch_score;
 };
 
 /*
@@ -352,6 +553,8 @@ struct vmrun_memory_slot {
 	unsigned long userspace_addr;
 	u32 flags;
 	short id;
+	/* Node in vmrun_memslots.hva_tree, rebuilt on every install. */
+	struct interval_tree_node hva_node;
 };
 
 struct vmrun_memslots {
@@ -361,13 +564,139 @@ struct vmrun_memslots {
 	short id_to_index[VMRUN_MEM_SLOTS_NUM];
 	atomic_t lru_slot;
 	int used_slots;
+	/*
+	 * memslots[i].base_gfn, packed so that the binary search touches
+	 * a few cache lines instead of one per probed slot.
+	 */
+	gfn_t base_gfns[VMRUN_MEM_SLOTS_NUM];
+	/* Populated slots keyed by [userspace_addr, end of slot - 1]. */
+	struct rb_root_cached hva_tree;
+};
+
+/* Visit the slots of @slots that overlap the hva range [@start, @last]. */
+#define vmrun_for_each_memslot_in_hva_range(node, slots, start, last)	\
+	for (node = interval_tree_iter_first(&(slots)->hva_tree, start, last);\
+	     node;							\
+	     node = interval_tree_iter_next(node, start, last))
+
+static inline bool memslot_contains_gfn(struct vmrun_memory_slot *slot,
+					gfn_t gfn)
+{
+	return gfn >= slot->base_gfn && gfn < slot->base_gfn + slot->npages;
+}
+
+static inline unsigned long
+vmrun_dirty_bitmap_bytes(struct vmrun_memory_slot *memslot)
+{
+	return ALIGN(memslot->npages, BITS_PER_LONG) / 8;
+}
+
+/*
+ * memslots[] is sorted by base_gfn in descending order, see
+ * vmrun_update_memslots().  Return the index of the first slot that
+ * starts at or below @gfn, or used_slots if there is none.  The loop
+ * has a fixed trip count for a given used_slots and no data-dependent
+ * branch, so it does not suffer mispredictions on random gfns.
+ */
+static inline int __search_memslots(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	const gfn_t *base_gfns = slots->base_gfns;
+	int len = slots->used_slots;
+	int start = 0;
+
+	if (unlikely(!len))
+		return 0;
+
+	while (len > 1) {
+		int half = len / 2;
+
+		start += (base_gfns[start + half] > gfn) * half;
+		len -= half;
+	}
+
+	return start + (base_gfns[start] > gfn);
+}
+
+/* lru_slot caches the last slot found, for lookups without a vCPU. */
+static inline struct vmrun_memory_slot *
+search_memslots(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	int slot = atomic_read(&slots->lru_slot);
+	struct vmrun_memory_slot *memslots = slots->memslots;
+
+	if (memslot_contains_gfn(&memslots[slot], gfn))
+		return &memslots[slot];
+
+	slot = __search_memslots(slots, gfn);
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn)) {
+		atomic_set(&slots->lru_slot, slot);
+		return &memslots[slot];
+	}
+
+	return NULL;
+}
+
+static inline struct vmrun_memory_slot *
+__gfn_to_memslot(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	return search_memslots(slots, gfn);
+}
+
+static inline unsigned long
+__gfn_to_hva_memslot(struct vmrun_memory_slot *slot, gfn_t gfn)
+{
+	return slot->userspace_addr + (gfn - slot->base_gfn) * PAGE_SIZE;
+}
+
+static inline struct vmrun_memory_slot *
+id_to_memslot(struct vmrun_memslots *slots, int id)
+{
+	int index = slots->id_to_index[id];
+	struct vmrun_memory_slot *slot;
+
+	slot = &slots->memslots[index];
+
+	WARN_ON(slot->id != id);
+
+	return slot;
+}
+
+/* MMU counters; some are reported by VMRUN_GET_MMU_STATS. */
+struct vmrun_vm_stat {
+	ulong mmu_shadow_zapped;
+	ulong mmu_pte_write;
+	ulong mmu_pte_updated;
+	ulong mmu_pde_zapped;
+	ulong mmu_flooded;
+	ulong mmu_recycled;
+	ulong mmu_cache_miss;
+	ulong mmu_unsync;
+	ulong remote_tlb_flush;
+	ulong lpages;
+	ulong max_mmu_page_hash_collisions;
+	ulong mmu_page_hash_collisions;
+	ulong mmu_page_hash_resizes;
+	ulong mmu_shrink_freed;
+	ulong mmu_reclaim_refaults;
 };
 
 struct vmrun {
-	spinlock_t mmu_lock;
+	/*
+	 * Taken for write by everything that zaps or rebuilds the MMU;
+	 * the TDP MMU takes it for read to service page faults.
+	 */
+	rwlock_t mmu_lock;
 	struct mutex slots_lock;
 	struct mm_struct *mm; /* userspace tied to this vm */
 	struct vmrun_memslots __rcu *memslots[VMRUN_ADDRESS_SPACE_NUM];
+	/*
+	 * The other half of each double-buffered memslots pair, and the
+	 * slot ids it lacks from the active half.  Protected by slots_lock.
+	 */
+	struct vmrun_memslots *inactive_memslots[VMRUN_ADDRESS_SPACE_NUM];
+	unsigned long memslots_stale[VMRUN_ADDRESS_SPACE_NUM]
+				    [BITS_TO_LONGS(VMRUN_MEM_SLOTS_NUM)];
 	struct vmrun_vcpu *vcpus[VMRUN_MAX_VCPUS];
 
 	/*
@@ -380,6 +709,10 @@ struct vmrun {
 	atomic_t online_vcpus;
 	int created_vcpus;
 	int last_boosted_vcpu;
+	/* Bytes per vCPU dirty ring, 0 to log into dirty bitmaps. */
+	u32 dirty_ring_size;
+	/* Dirty bitmaps are re-armed by VMRUN_CLEAR_DIRTY_LOG only. */
+	bool manual_dirty_log_protect;
 	struct list_head vm_list;
 	struct mutex lock;
 	atomic_t users_count;
@@ -394,11 +727,100 @@ struct vmrun {
 
 	long tlbs_dirty;
 	struct srcu_struct srcu;
+	/* Shadow pages by gfn, resized under mmu_lock held for write. */
+	struct hlist_head *mmu_page_hash;
+	unsigned int mmu_page_hash_shift;
 	struct list_head active_mmu_pages;
-	struct list_head zapped_obsolete_pages;
+	/* Pages of older MMU generations, freed by zap_obsolete_work. */
+	struct list_head obsolete_mmu_pages;
+	struct work_struct zap_obsolete_work;
+	struct shrinker mmu_shrinker;
+	/* Resized under mmu_lock held for write. */
+	struct vmrun_mmu_reclaimed_page *mmu_reclaim_history;
+	unsigned int mmu_reclaim_history_shift;
+
+	/*
+	 * TDP MMU roots and their page-table pages. tdp_mmu_pages_lock
+	 * serializes vCPUs that link new pages while holding mmu_lock for
+	 * read; the roots list only changes with mmu_lock held for write.
+	 * n_tdp_mmu_pages is the part of n_used_mmu_pages that they make
+	 * up, which the shrinker cannot free.
+	 */
+	bool tdp_mmu_enabled;
+	struct list_head tdp_mmu_roots;
+	struct list_head tdp_mmu_pages;
+	spinlock_t tdp_mmu_pages_lock;
+	unsigned int n_tdp_mmu_pages;
+
+	/*
+	 * Caches for eager huge page splitting, which runs without a vCPU.
+	 * Used with slots_lock held and refilled with mmu_lock dropped.
+	 */
+	struct vmrun_mmu_memory_cache split_page_header_cache;
+	struct vmrun_mmu_memory_cache split_page_cache;
+	struct vmrun_mmu_memory_cache split_desc_cache;
+
+	/*
+	 * Slots whose huge mappings are being rebuilt after dirty logging
+	 * stopped, and the slot (as_id << 16 | id, or -1) and gfn that the
+	 * next run resumes from.  Protected by slots_lock.
+	 */
+	struct delayed_work recover_huge_pages_work;
+	unsigned long recover_huge_pages_slots[VMRUN_ADDRESS_SPACE_NUM]
+					      [BITS_TO_LONGS(VMRUN_MEM_SLOTS_NUM)];
+	int recover_huge_pages_slot;
+	gfn_t recover_huge_pages_gfn;
 	struct list_head assigned_dev_head;
 	atomic_t noncoherent_dma_count;
 	struct hlist_head mask_notifier_list; /* reads protected by irq_srcu, writes by irq_lock */
+	struct vmrun_vm_stat stat;
 };
 
+static inline struct vmrun_memslots *__vmrun_memslots(struct vmrun *vmrun, int as_id)
+{
+	return srcu_dereference_check(vmrun->memslots[as_id], &vmrun->srcu,
+				      lockdep_is_held(&vmrun->slots_lock) ||
+				      !atomic_read(&vmrun->users_count));
+}
+
+static inline struct vmrun_memslots *vmrun_memslots(struct vmrun *vmrun)
+{
+	return __vmrun_memslots(vmrun, 0);
+}
+
+static inline struct vmrun_memslots *vmrun_vcpu_memslots(struct vmrun_vcpu *vcpu)
+{
+	int as_id = (vcpu->hflags & HF_SMM_MASK) ? 1 : 0;
+
+	return __vmrun_memslots(vcpu->vmrun, as_id);
+}
+
+/*
+ * Faults from one vCPU tend to hit the same slot over and over, so
+ * check the one it used last before searching.  The index is only a
+ * hint: it is checked against the current memslots, which makes it
+ * safe across memslot updates, and it keeps vCPUs from bouncing the
+ * shared lru_slot cache line between them.
+ */
+static inline struct vmrun_memory_slot *
+vmrun_vcpu_gfn_to_memslot(struct vmrun_vcpu *vcpu, gfn_t gfn)
+{
+	struct vmrun_memslots *slots = vmrun_vcpu_memslots(vcpu);
+	struct vmrun_memory_slot *memslots = slots->memslots;
+	int slot = READ_ONCE(vcpu->last_used_slot);
+
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn))
+		return &memslots[slot];
+
+	slot = __search_memslots(slots, gfn);
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn)) {
+		WRITE_ONCE(vcpu->last_used_slot, slot);
+		return &memslots[slot];
+	}
+
+	return NULL;
+}
+
 #endif // VMRUN_H
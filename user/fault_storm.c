@@ -0,0 +1,266 @@
+//
+// Fault-storm benchmark for the vmrun MMU
+//
+// Description: Boots VMs with 1, 2, 4, ... vCPUs, up to the number
+// given, in which every vCPU writes one byte to each page of its own
+// guest memory and then exits with an OUT.  Host memory is populated
+// up front, so the time is spent in guest page faults; the pages per
+// second show how fault handling scales with the number of vCPUs.
+//
+// Usage: fault_storm [max vcpus] [MiB per vcpu]
+//
+// This work is licensed under the terms of the GNU GPL, version 2.
+// See the LICENSE file in the top-level directory.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <time.h>
+#include "vmrun.h"
+
+#define VMRUN_DEVICE	"/dev/vmrun"
+#define PAGE_SIZE	4096
+#define CODE_START	0x1000
+#define DATA_START	0x100000
+#define DONE_PORT	0x10
+#define MAX_VCPUS	64
+
+//
+// 32-bit protected mode, no paging:
+//
+// 1:	movb	$1, (%esi)
+//	addl	$0x1000, %esi
+//	decl	%ecx
+//	jnz	1b
+//	outb	%al, $DONE_PORT
+//	jmp	.
+//
+static const unsigned char guest_code[] = {
+	0xc6, 0x06, 0x01,
+	0x81, 0xc6, 0x00, 0x10, 0x00, 0x00,
+	0x49,
+	0x75, 0xf4,
+	0xe6, DONE_PORT,
+	0xeb, 0xfe,
+};
+
+struct vcpu {
+	int vcpu_fd;
+	pthread_t thread;
+	struct vmrun_run *vmrun_run;
+	int vmrun_run_mmap_size;
+	__u64 data_start;
+	__u64 npages;
+};
+
+static pthread_barrier_t start_barrier;
+
+static void set_flat_segment(struct vmrun_segment *seg, __u16 selector,
+			     __u8 type)
+{
+	memset(seg, 0, sizeof(*seg));
+	seg->base = 0;
+	seg->limit = 0xffffffff;
+	seg->selector = selector;
+	seg->type = type;
+	seg->present = 1;
+	seg->db = 1;
+	seg->s = 1;
+	seg->g = 1;
+}
+
+static void setup_vcpu(struct vcpu *vcpu)
+{
+	struct vmrun_sregs sregs;
+	struct vmrun_regs regs;
+
+	if (ioctl(vcpu->vcpu_fd, VMRUN_GET_SREGS, &sregs) < 0) {
+		perror("can not get sregs");
+		exit(1);
+	}
+
+	set_flat_segment(&sregs.cs, 0x08, 0xb);
+	set_flat_segment(&sregs.ds, 0x10, 0x3);
+	sregs.es = sregs.fs = sregs.gs = sregs.ss = sregs.ds;
+	sregs.cr0 |= 1;
+
+	if (ioctl(vcpu->vcpu_fd, VMRUN_SET_SREGS, &sregs) < 0) {
+		perror("can not set sregs");
+		exit(1);
+	}
+
+	memset(&regs, 0, sizeof(regs));
+	regs.rflags = 0x2;
+	regs.rip = CODE_START;
+	regs.rsi = vcpu->data_start;
+	regs.rcx = vcpu->npages;
+
+	if (ioctl(vcpu->vcpu_fd, VMRUN_SET_REGS, &regs) < 0) {
+		perror("can not set regs");
+		exit(1);
+	}
+}
+
+static void *vcpu_thread(void *data)
+{
+	struct vcpu *vcpu = data;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (;;) {
+		if (ioctl(vcpu->vcpu_fd, VMRUN_RUN, 0) < 0) {
+			perror("vcpu run failed");
+			exit(1);
+		}
+
+		switch (vcpu->vmrun_run->exit_reason) {
+		case VMRUN_EXIT_IO:
+			if (vcpu->vmrun_run->io.port == DONE_PORT)
+				return NULL;
+			break;
+		case VMRUN_EXIT_INTR:
+			break;
+		default:
+			fprintf(stderr, "unexpected exit reason %u\n",
+				vcpu->vmrun_run->exit_reason);
+			exit(1);
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the seconds it took nr_vcpus vCPUs to touch their pages.
+static double run_storm(int dev_fd, int nr_vcpus, __u64 npages)
+{
+	struct vmrun_userspace_memory_region mem;
+	struct vcpu vcpus[MAX_VCPUS];
+	int vm_fd, mmap_size, i;
+	__u64 ram_size;
+	double start;
+	void *ram;
+
+	vm_fd = ioctl(dev_fd, VMRUN_CREATE_VM, 0);
+	if (vm_fd < 0) {
+		perror("can not create vm");
+		exit(1);
+	}
+
+	ram_size = DATA_START + nr_vcpus * npages * PAGE_SIZE;
+	ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ram == MAP_FAILED) {
+		perror("can not mmap ram");
+		exit(1);
+	}
+	memcpy((char *)ram + CODE_START, guest_code, sizeof(guest_code));
+
+	mem.slot = 0;
+	mem.flags = 0;
+	mem.guest_phys_addr = 0;
+	mem.memory_size = ram_size;
+	mem.userspace_addr = (__u64)ram;
+	if (ioctl(vm_fd, VMRUN_SET_USER_MEMORY_REGION, &mem) < 0) {
+		perror("can not set user memory region");
+		exit(1);
+	}
+
+	mmap_size = ioctl(dev_fd, VMRUN_GET_VCPU_MMAP_SIZE, 0);
+	if (mmap_size < 0) {
+		perror("can not get vcpu mmsize");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_vcpus; i++) {
+		vcpus[i].vcpu_fd = ioctl(vm_fd, VMRUN_CREATE_VCPU, i);
+		if (vcpus[i].vcpu_fd < 0) {
+			perror("can not create vcpu");
+			exit(1);
+		}
+
+		vcpus[i].vmrun_run_mmap_size = mmap_size;
+		vcpus[i].vmrun_run = mmap(NULL, mmap_size,
+					  PROT_READ | PROT_WRITE, MAP_SHARED,
+					  vcpus[i].vcpu_fd, 0);
+		if (vcpus[i].vmrun_run == MAP_FAILED) {
+			perror("can not mmap vmrun_run");
+			exit(1);
+		}
+
+		vcpus[i].data_start = DATA_START + i * npages * PAGE_SIZE;
+		vcpus[i].npages = npages;
+		setup_vcpu(&vcpus[i]);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, nr_vcpus + 1);
+	for (i = 0; i < nr_vcpus; i++) {
+		if (pthread_create(&vcpus[i].thread, NULL, vcpu_thread,
+				   &vcpus[i]) != 0) {
+			perror("can not create vcpu thread");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	for (i = 0; i < nr_vcpus; i++)
+		pthread_join(vcpus[i].thread, NULL);
+	start = now() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < nr_vcpus; i++) {
+		munmap(vcpus[i].vmrun_run, vcpus[i].vmrun_run_mmap_size);
+		close(vcpus[i].vcpu_fd);
+	}
+	close(vm_fd);
+	munmap(ram, ram_size);
+
+	return start;
+}
+
+int main(int argc, char **argv)
+{
+	int max_vcpus = argc > 1 ? atoi(argv[1]) : 8;
+	__u64 mib = argc > 2 ? strtoull(argv[2], NULL, 0) : 256;
+	__u64 npages = mib * (1 << 20) / PAGE_SIZE;
+	double secs;
+	int dev_fd, n;
+
+	if (max_vcpus < 1 || max_vcpus > MAX_VCPUS || !npages ||
+	    DATA_START + max_vcpus * npages * PAGE_SIZE > 0xffffffffULL) {
+		fprintf(stderr, "usage: %s [max vcpus <= %d] [MiB per vcpu]\n"
+			"guest memory must stay below 4 GiB\n",
+			argv[0], MAX_VCPUS);
+		return 1;
+	}
+
+	dev_fd = open(VMRUN_DEVICE, O_RDWR);
+	if (dev_fd < 0) {
+		perror("open vmrun device fault");
+		return 1;
+	}
+
+	printf("%6s %12s %10s %14s\n", "vcpus", "pages", "seconds",
+	       "pages/s");
+	for (n = 1; n <= max_vcpus; n *= 2) {
+		secs = run_storm(dev_fd, n, npages);
+		printf("%6d %12llu %10.3f %14.0f\n", n,
+		       (unsigned long long)(n * npages), secs,
+		       n * npages / secs);
+	}
+
+	close(dev_fd);
+	return 0;
+}
@@ -0,0 +1,375 @@
+//
+// memslot lookup micro-benchmark
+//
+// Description: Times gfn to memslot lookups over several slot layouts
+// and access patterns, for the lookups in kernel/vmrun.h (branch-free
+// search over the packed base_gfns[] behind the lru_slot check, and
+// the per-vCPU last_used_slot hint in vmrun_vcpu_gfn_to_memslot()) and
+// for the previous one (binary search over the memslots[] array itself
+// behind the lru_slot check).  The lookup code is copied from the
+// kernel; keep the "new" variants in step with __search_memslots(),
+// search_memslots() and vmrun_vcpu_gfn_to_memslot().
+//
+// Usage: memslot_bench [lookups per point]
+//
+// This work is licensed under the terms of the GNU GPL, version 2.
+// See the LICENSE file in the top-level directory.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef u64 gfn_t;
+
+#define VMRUN_MEM_SLOTS_NUM	512
+#define MAX_LAYOUT_SLOTS	509
+
+//
+// Same size as the kernel's struct vmrun_memory_slot on x86-64: the
+// lookup only reads base_gfn and npages, the rest is what the old
+// binary search drags through the cache.
+//
+struct vmrun_memory_slot {
+	gfn_t base_gfn;
+	unsigned long npages;
+	unsigned long *dirty_bitmap;
+	unsigned long arch[6];
+	unsigned long userspace_addr;
+	u32 flags;
+	short id;
+	unsigned long hva_node[6];
+};
+
+// memslots[] and base_gfns[] are sorted by base_gfn in descending order.
+struct vmrun_memslots {
+	struct vmrun_memory_slot memslots[VMRUN_MEM_SLOTS_NUM];
+	int lru_slot;
+	int used_slots;
+	gfn_t base_gfns[VMRUN_MEM_SLOTS_NUM];
+};
+
+struct vmrun_vcpu {
+	int last_used_slot;
+};
+
+static inline int memslot_contains_gfn(struct vmrun_memory_slot *slot,
+				       gfn_t gfn)
+{
+	return gfn >= slot->base_gfn && gfn < slot->base_gfn + slot->npages;
+}
+
+//
+// Current lookups, as in kernel/vmrun.h.
+//
+static inline int __search_memslots(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	const gfn_t *base_gfns = slots->base_gfns;
+	int len = slots->used_slots;
+	int start = 0;
+
+	if (!len)
+		return 0;
+
+	while (len > 1) {
+		int half = len / 2;
+
+		start += (base_gfns[start + half] > gfn) * half;
+		len -= half;
+	}
+
+	return start + (base_gfns[start] > gfn);
+}
+
+static struct vmrun_memory_slot *
+search_memslots(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	struct vmrun_memory_slot *memslots = slots->memslots;
+	int slot = slots->lru_slot;
+
+	if (memslot_contains_gfn(&memslots[slot], gfn))
+		return &memslots[slot];
+
+	slot = __search_memslots(slots, gfn);
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn)) {
+		slots->lru_slot = slot;
+		return &memslots[slot];
+	}
+
+	return NULL;
+}
+
+static struct vmrun_memory_slot *
+vcpu_gfn_to_memslot(struct vmrun_vcpu *vcpu, struct vmrun_memslots *slots,
+		    gfn_t gfn)
+{
+	struct vmrun_memory_slot *memslots = slots->memslots;
+	int slot = vcpu->last_used_slot;
+
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn))
+		return &memslots[slot];
+
+	slot = __search_memslots(slots, gfn);
+	if (slot < slots->used_slots &&
+	    memslot_contains_gfn(&memslots[slot], gfn)) {
+		vcpu->last_used_slot = slot;
+		return &memslots[slot];
+	}
+
+	return NULL;
+}
+
+//
+// Previous lookup: binary search over memslots[] behind lru_slot.
+//
+static struct vmrun_memory_slot *
+old_search_memslots(struct vmrun_memslots *slots, gfn_t gfn)
+{
+	int start = 0, end = slots->used_slots;
+	int slot = slots->lru_slot;
+	struct vmrun_memory_slot *memslots = slots->memslots;
+
+	if (gfn >= memslots[slot].base_gfn &&
+	    gfn < memslots[slot].base_gfn + memslots[slot].npages)
+		return &memslots[slot];
+
+	while (start < end) {
+		slot = start + (end - start) / 2;
+
+		if (gfn >= memslots[slot].base_gfn)
+			end = slot;
+		else
+			start = slot + 1;
+	}
+
+	if (gfn >= memslots[start].base_gfn &&
+	    gfn < memslots[start].base_gfn + memslots[start].npages) {
+		slots->lru_slot = start;
+		return &memslots[start];
+	}
+
+	return NULL;
+}
+
+//
+// Slot layouts, in 4K pages.
+//
+struct slot_range {
+	gfn_t base_gfn;
+	unsigned long npages;
+};
+
+// A 4 GiB guest with a PCI hole, plus the private TSS and APIC pages.
+static const struct slot_range pc_layout[] = {
+	{ 0x0, 0xa0 },			// low RAM
+	{ 0xc0, 0x20 },			// option ROMs
+	{ 0x100, 0xbff00 },		// RAM up to 3 GiB
+	{ 0xfee00, 0x1 },		// APIC access page
+	{ 0xfeffc, 0x3 },		// TSS
+	{ 0xfffc0, 0x40 },		// BIOS
+	{ 0x100000, 0x40000 },		// RAM above 4 GiB
+};
+
+static void setup_slots(struct vmrun_memslots *slots,
+			const struct slot_range *ranges, int n)
+{
+	int i, j;
+
+	// Highest base_gfn first, as vmrun_update_memslots() keeps them.
+	for (i = 0; i < n; i++) {
+		j = n - 1 - i;
+		slots->memslots[i].base_gfn = ranges[j].base_gfn;
+		slots->memslots[i].npages = ranges[j].npages;
+		slots->memslots[i].id = j;
+		slots->base_gfns[i] = ranges[j].base_gfn;
+	}
+	slots->used_slots = n;
+	slots->lru_slot = 0;
+}
+
+// n slots of the given size, with a one page hole between them.
+static int make_even_layout(struct slot_range *ranges, int n,
+			    unsigned long npages)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ranges[i].base_gfn = i * (npages + 1);
+		ranges[i].npages = npages;
+	}
+	return n;
+}
+
+//
+// Access patterns.
+//
+static gfn_t random_gfn(const struct slot_range *ranges, int n)
+{
+	const struct slot_range *r = &ranges[rand() % n];
+
+	return r->base_gfn + (unsigned long)rand() % r->npages;
+}
+
+// Every lookup in a random slot: defeats lru_slot and the hint.
+static void fill_random(gfn_t *gfns, long nr, const struct slot_range *ranges,
+			int n)
+{
+	long i;
+
+	for (i = 0; i < nr; i++)
+		gfns[i] = random_gfn(ranges, n);
+}
+
+// Runs of 64 lookups in one slot, as a vCPU walking a buffer does.
+static void fill_local(gfn_t *gfns, long nr, const struct slot_range *ranges,
+		       int n)
+{
+	const struct slot_range *r = ranges;
+	long i;
+
+	for (i = 0; i < nr; i++) {
+		if (!(i % 64))
+			r = &ranges[rand() % n];
+		gfns[i] = r->base_gfn + (unsigned long)rand() % r->npages;
+	}
+}
+
+// Two vCPUs in different slots, interleaved: they fight over lru_slot.
+static void fill_two_vcpus(gfn_t *gfns, long nr,
+			   const struct slot_range *ranges, int n)
+{
+	const struct slot_range *r[2] = { ranges, ranges + n - 1 };
+	long i;
+
+	for (i = 0; i < nr; i++) {
+		if (!(i % 128))
+			r[(i / 128) & 1] = &ranges[rand() % n];
+		gfns[i] = r[i & 1]->base_gfn +
+			  (unsigned long)rand() % r[i & 1]->npages;
+	}
+}
+
+//
+// Driver
+//
+enum { IMPL_OLD, IMPL_NEW, IMPL_HINT, NR_IMPLS };
+
+static const char *impl_names[NR_IMPLS] = { "old", "new", "new+hint" };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the nanoseconds per lookup.
+static double bench(int impl, struct vmrun_memslots *slots, const gfn_t *gfns,
+		    long nr)
+{
+	struct vmrun_vcpu vcpus[2] = { { 0 }, { 0 } };
+	struct vmrun_memory_slot *slot;
+	volatile long sink = 0;
+	double t;
+	long i;
+
+	slots->lru_slot = 0;
+	t = now();
+	for (i = 0; i < nr; i++) {
+		switch (impl) {
+		case IMPL_OLD:
+			slot = old_search_memslots(slots, gfns[i]);
+			break;
+		case IMPL_NEW:
+			slot = search_memslots(slots, gfns[i]);
+			break;
+		default:
+			slot = vcpu_gfn_to_memslot(&vcpus[i & 1], slots,
+						   gfns[i]);
+			break;
+		}
+		if (!slot) {
+			fprintf(stderr, "%s: gfn %llx not found\n",
+				impl_names[impl], (unsigned long long)gfns[i]);
+			exit(1);
+		}
+		sink += slot->id;
+	}
+	t = now() - t;
+
+	return t * 1e9 / nr;
+}
+
+struct pattern {
+	const char *name;
+	void (*fill)(gfn_t *gfns, long nr, const struct slot_range *ranges,
+		     int n);
+};
+
+static const struct pattern patterns[] = {
+	{ "random", fill_random },
+	{ "local", fill_local },
+	{ "2 vcpus", fill_two_vcpus },
+};
+
+static void run_layout(const char *name, struct vmrun_memslots *slots,
+		       const struct slot_range *ranges, int n, gfn_t *gfns,
+		       long nr)
+{
+	unsigned int p;
+	int impl;
+
+	setup_slots(slots, ranges, n);
+	for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+		patterns[p].fill(gfns, nr, ranges, n);
+		printf("%-10s %5d %-8s", name, n, patterns[p].name);
+		for (impl = 0; impl < NR_IMPLS; impl++)
+			printf(" %10.2f", bench(impl, slots, gfns, nr));
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const int even_counts[] = { 1, 8, 32, 128, MAX_LAYOUT_SLOTS };
+	long nr = argc > 1 ? atol(argv[1]) : 1 << 22;
+	struct slot_range *ranges;
+	struct vmrun_memslots *slots;
+	unsigned int k;
+	gfn_t *gfns;
+	int n;
+
+	if (nr < 1) {
+		fprintf(stderr, "usage: %s [lookups per point]\n", argv[0]);
+		return 1;
+	}
+
+	slots = calloc(1, sizeof(*slots));
+	ranges = calloc(MAX_LAYOUT_SLOTS, sizeof(*ranges));
+	gfns = calloc(nr, sizeof(*gfns));
+	if (!slots || !ranges || !gfns) {
+		perror("calloc");
+		return 1;
+	}
+
+	srand(1);
+	printf("%-10s %5s %-8s %10s %10s %10s\n", "layout", "slots",
+	       "pattern", "old ns", "new ns", "hint ns");
+	run_layout("pc", slots, pc_layout,
+		   sizeof(pc_layout) / sizeof(pc_layout[0]), gfns, nr);
+	for (k = 0; k < sizeof(even_counts) / sizeof(even_counts[0]); k++) {
+		n = make_even_layout(ranges, even_counts[k], 256);
+		run_layout("1MiB each", slots, ranges, n, gfns, nr);
+	}
+
+	free(gfns);
+	free(ranges);
+	free(slots);
+	return 0;
+}
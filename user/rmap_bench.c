@@ -0,0 +1,410 @@
+//
+// rmap chain micro-benchmark
+//
+// Description: Times adding, iterating and removing the sptes of rmap
+// chains of various lengths, for the pte_list_desc layout
+// in kernel/mmu.c (6 sptes per cache line, counts kept in the head,
+// new descriptors pushed in front) and for the previous one (3 sptes
+// per descriptor, appended at the tail after walking the chain).  The
+// chain code is copied from the kernel with the debug output dropped;
+// keep the "new" half in step with pte_list_add(), pte_list_remove()
+// and rmap_get_first()/rmap_get_next().
+//
+// Usage: rmap_bench [max chain length]
+//
+// This work is licensed under the terms of the GNU GPL, version 2.
+// See the LICENSE file in the top-level directory.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+struct vmrun_rmap_head {
+	unsigned long val;
+};
+
+// Stands in for the kmem_cache, so that malloc() is not measured.
+struct desc_pool {
+	void *free;
+	size_t size;
+};
+
+static void *pool_alloc(struct desc_pool *pool)
+{
+	void *p = pool->free;
+
+	if (p) {
+		pool->free = *(void **)p;
+		return p;
+	}
+
+	p = malloc(pool->size);
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void pool_free(struct desc_pool *pool, void *p)
+{
+	*(void **)p = pool->free;
+	pool->free = p;
+}
+
+//
+// Current layout, as in kernel/mmu.c.
+//
+#define PTE_LIST_EXT 6
+
+struct pte_list_desc {
+	struct pte_list_desc *more;
+	u32 spte_count;
+	u32 tail_count;
+	u64 *sptes[PTE_LIST_EXT];
+};
+
+static struct desc_pool new_pool = { NULL, sizeof(struct pte_list_desc) };
+
+static int pte_list_add(u64 *spte, struct vmrun_rmap_head *rmap_head)
+{
+	struct pte_list_desc *desc;
+	int count = 0;
+
+	if (!rmap_head->val) {
+		rmap_head->val = (unsigned long)spte;
+	} else if (!(rmap_head->val & 1)) {
+		desc = pool_alloc(&new_pool);
+		desc->more = NULL;
+		desc->sptes[0] = (u64 *)rmap_head->val;
+		desc->sptes[1] = spte;
+		desc->spte_count = 2;
+		desc->tail_count = 0;
+		rmap_head->val = (unsigned long)desc | 1;
+		++count;
+	} else {
+		desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+		count = desc->tail_count + desc->spte_count;
+
+		if (desc->spte_count == PTE_LIST_EXT) {
+			desc = pool_alloc(&new_pool);
+			desc->more = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+			desc->spte_count = 0;
+			desc->tail_count = count;
+			rmap_head->val = (unsigned long)desc | 1;
+		}
+		desc->sptes[desc->spte_count++] = spte;
+	}
+	return count;
+}
+
+static void
+pte_list_desc_remove_entry(struct vmrun_rmap_head *rmap_head,
+			   struct pte_list_desc *desc, int i)
+{
+	struct pte_list_desc *head_desc;
+	int j;
+
+	head_desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+	j = head_desc->spte_count - 1;
+
+	desc->sptes[i] = head_desc->sptes[j];
+	head_desc->sptes[j] = NULL;
+	if (--head_desc->spte_count)
+		return;
+
+	if (!head_desc->more)
+		rmap_head->val = 0;
+	else
+		rmap_head->val = (unsigned long)head_desc->more | 1;
+	pool_free(&new_pool, head_desc);
+}
+
+static void pte_list_remove(u64 *spte, struct vmrun_rmap_head *rmap_head)
+{
+	struct pte_list_desc *desc;
+	unsigned int i;
+
+	if (!(rmap_head->val & 1)) {
+		rmap_head->val = 0;
+		return;
+	}
+
+	desc = (struct pte_list_desc *)(rmap_head->val & ~1ul);
+	while (desc) {
+		for (i = 0; i < desc->spte_count; ++i) {
+			if (desc->sptes[i] == spte) {
+				pte_list_desc_remove_entry(rmap_head, desc, i);
+				return;
+			}
+		}
+		desc = desc->more;
+	}
+	fprintf(stderr, "pte_list_remove: %p not found\n", (void *)spte);
+	exit(1);
+}
+
+static u64 pte_list_sum(struct vmrun_rmap_head *rmap_head)
+{
+	struct pte_list_desc *desc;
+	u64 sum = 0;
+	unsigned int i;
+
+	if (!(rmap_head->val & 1))
+		return rmap_head->val;
+
+	for (desc = (struct pte_list_desc *)(rmap_head->val & ~1ul); desc;
+	     desc = desc->more)
+		for (i = 0; i < desc->spte_count; ++i)
+			sum += (unsigned long)desc->sptes[i];
+	return sum;
+}
+
+//
+// Previous layout: 3 sptes and a next pointer, NULL-terminated.
+//
+#define OLD_PTE_LIST_EXT 3
+
+struct old_pte_list_desc {
+	u64 *sptes[OLD_PTE_LIST_EXT];
+	struct old_pte_list_desc *more;
+};
+
+static struct desc_pool old_pool = { NULL, sizeof(struct old_pte_list_desc) };
+
+static struct old_pte_list_desc *old_alloc(void)
+{
+	struct old_pte_list_desc *desc = pool_alloc(&old_pool);
+	int i;
+
+	for (i = 0; i < OLD_PTE_LIST_EXT; i++)
+		desc->sptes[i] = NULL;
+	desc->more = NULL;
+	return desc;
+}
+
+static int old_pte_list_add(u64 *spte, struct vmrun_rmap_head *rmap_head)
+{
+	struct old_pte_list_desc *desc;
+	int i, count = 0;
+
+	if (!rmap_head->val) {
+		rmap_head->val = (unsigned long)spte;
+	} else if (!(rmap_head->val & 1)) {
+		desc = old_alloc();
+		desc->sptes[0] = (u64 *)rmap_head->val;
+		desc->sptes[1] = spte;
+		rmap_head->val = (unsigned long)desc | 1;
+		++count;
+	} else {
+		desc = (struct old_pte_list_desc *)(rmap_head->val & ~1ul);
+		while (desc->sptes[OLD_PTE_LIST_EXT-1] && desc->more) {
+			desc = desc->more;
+			count += OLD_PTE_LIST_EXT;
+		}
+		if (desc->sptes[OLD_PTE_LIST_EXT-1]) {
+			desc->more = old_alloc();
+			desc = desc->more;
+		}
+		for (i = 0; desc->sptes[i]; ++i)
+			++count;
+		desc->sptes[i] = spte;
+	}
+	return count;
+}
+
+static void
+old_pte_list_desc_remove_entry(struct vmrun_rmap_head *rmap_head,
+			       struct old_pte_list_desc *desc, int i,
+			       struct old_pte_list_desc *prev_desc)
+{
+	int j;
+
+	for (j = OLD_PTE_LIST_EXT - 1; !desc->sptes[j] && j > i; --j)
+		;
+	desc->sptes[i] = desc->sptes[j];
+	desc->sptes[j] = NULL;
+	if (j != 0)
+		return;
+	if (!prev_desc && !desc->more)
+		rmap_head->val = (unsigned long)desc->sptes[0];
+	else
+		if (prev_desc)
+			prev_desc->more = desc->more;
+		else
+			rmap_head->val = (unsigned long)desc->more | 1;
+	pool_free(&old_pool, desc);
+}
+
+static void old_pte_list_remove(u64 *spte, struct vmrun_rmap_head *rmap_head)
+{
+	struct old_pte_list_desc *desc, *prev_desc = NULL;
+	int i;
+
+	if (!(rmap_head->val & 1)) {
+		rmap_head->val = 0;
+		return;
+	}
+
+	desc = (struct old_pte_list_desc *)(rmap_head->val & ~1ul);
+	while (desc) {
+		for (i = 0; i < OLD_PTE_LIST_EXT && desc->sptes[i]; ++i) {
+			if (desc->sptes[i] == spte) {
+				old_pte_list_desc_remove_entry(rmap_head,
+						desc, i, prev_desc);
+				return;
+			}
+		}
+		prev_desc = desc;
+		desc = desc->more;
+	}
+	fprintf(stderr, "old_pte_list_remove: %p not found\n", (void *)spte);
+	exit(1);
+}
+
+static u64 old_pte_list_sum(struct vmrun_rmap_head *rmap_head)
+{
+	struct old_pte_list_desc *desc;
+	u64 sum = 0;
+	int i;
+
+	if (!(rmap_head->val & 1))
+		return rmap_head->val;
+
+	for (desc = (struct old_pte_list_desc *)(rmap_head->val & ~1ul); desc;
+	     desc = desc->more)
+		for (i = 0; i < OLD_PTE_LIST_EXT && desc->sptes[i]; ++i)
+			sum += (unsigned long)desc->sptes[i];
+	return sum;
+}
+
+//
+// Driver
+//
+struct rmap_impl {
+	const char *name;
+	int (*add)(u64 *spte, struct vmrun_rmap_head *rmap_head);
+	void (*remove)(u64 *spte, struct vmrun_rmap_head *rmap_head);
+	u64 (*sum)(struct vmrun_rmap_head *rmap_head);
+};
+
+static const struct rmap_impl impls[] = {
+	{ "new", pte_list_add, pte_list_remove, pte_list_sum },
+	{ "old", old_pte_list_add, old_pte_list_remove, old_pte_list_sum },
+};
+
+// Total sptes handled per measurement, spread over as many chains.
+#define OPS_PER_POINT	(1 << 20)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void shuffle(u64 **sptes, int n)
+{
+	u64 *tmp;
+	int i, j;
+
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = sptes[i];
+		sptes[i] = sptes[j];
+		sptes[j] = tmp;
+	}
+}
+
+// Prints the nanoseconds per spte for add, iterate and remove.
+static void bench(const struct rmap_impl *impl, u64 *table, u64 **order,
+		  int len)
+{
+	long nr_heads = OPS_PER_POINT / len, h;
+	struct vmrun_rmap_head *heads;
+	double t_add, t_iter, t_remove;
+	volatile u64 sink = 0;
+	int i;
+
+	if (!nr_heads)
+		nr_heads = 1;
+
+	heads = calloc(nr_heads, sizeof(*heads));
+	if (!heads) {
+		perror("calloc");
+		exit(1);
+	}
+
+	t_add = now();
+	for (h = 0; h < nr_heads; h++)
+		for (i = 0; i < len; i++)
+			impl->add(&table[i], &heads[h]);
+	t_add = now() - t_add;
+
+	t_iter = now();
+	for (h = 0; h < nr_heads; h++)
+		sink += impl->sum(&heads[h]);
+	t_iter = now() - t_iter;
+
+	t_remove = now();
+	for (h = 0; h < nr_heads; h++)
+		for (i = 0; i < len; i++)
+			impl->remove(order[i], &heads[h]);
+	t_remove = now() - t_remove;
+
+	for (h = 0; h < nr_heads; h++) {
+		if (heads[h].val) {
+			fprintf(stderr, "%s: chain not empty\n", impl->name);
+			exit(1);
+		}
+	}
+	free(heads);
+
+	printf("%-4s %8d %12.1f %12.1f %12.1f\n", impl->name, len,
+	       t_add * 1e9 / (nr_heads * len),
+	       t_iter * 1e9 / (nr_heads * len),
+	       t_remove * 1e9 / (nr_heads * len));
+}
+
+int main(int argc, char **argv)
+{
+	int max_len = argc > 1 ? atoi(argv[1]) : 4096;
+	u64 *table, **order;
+	unsigned int k;
+	int len, i;
+
+	if (max_len < 1) {
+		fprintf(stderr, "usage: %s [max chain length]\n", argv[0]);
+		return 1;
+	}
+
+	table = calloc(max_len, sizeof(*table));
+	order = calloc(max_len, sizeof(*order));
+	if (!table || !order) {
+		perror("calloc");
+		return 1;
+	}
+
+	srand(1);
+	printf("%-4s %8s %12s %12s %12s\n", "impl", "length",
+	       "add ns", "iterate ns", "remove ns");
+	for (len = 1; len <= max_len; len *= 2) {
+		// Zaps remove the sptes in no particular order.
+		for (i = 0; i < len; i++)
+			order[i] = &table[i];
+		shuffle(order, len);
+
+		for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+			bench(&impls[k], table, order, len);
+	}
+
+	free(order);
+	free(table);
+	return 0;
+}
@@ -58,6 +58,13 @@
  */
 #define VMRUN_CREATE_VCPU            _IO  (VMRUNIO, 0x40)
 #define VMRUN_SET_USER_MEMORY_REGION _IOW (VMRUNIO, 0x41, struct vmrun_userspace_memory_region)
+#define VMRUN_SET_USER_MEMORY_REGIONS _IOW (VMRUNIO, 0x42, struct vmrun_userspace_memory_regions)
+#define VMRUN_GET_DIRTY_LOG          _IOW (VMRUNIO, 0x43, struct vmrun_dirty_log)
+#define VMRUN_ENABLE_DIRTY_RING      _IO  (VMRUNIO, 0x44) /* ring size in bytes */
+#define VMRUN_RESET_DIRTY_RINGS      _IO  (VMRUNIO, 0x45)
+#define VMRUN_ENABLE_MANUAL_DIRTY_LOG_PROTECT _IO (VMRUNIO, 0x46) /* 0 to disable */
+#define VMRUN_CLEAR_DIRTY_LOG        _IOWR(VMRUNIO, 0x47, struct vmrun_clear_dirty_log)
+#define VMRUN_GET_MMU_STATS          _IOR (VMRUNIO, 0x48, struct vmrun_mmu_stats)
 
 /*
  * ioctls for vcpu fds
@@ -99,6 +106,7 @@
 #define VMRUN_EXIT_SHUTDOWN         6
 #define VMRUN_EXIT_FAIL_ENTRY       7
 #define VMRUN_EXIT_INTR             8
+#define VMRUN_EXIT_DIRTY_RING_FULL  9
 
 /*
  * Architectural interrupt line count, and the size of the bitmap needed
@@ -260,4 +268,70 @@ struct vmrun_userspace_memory_region {
 	__u64 userspace_addr; /* start of the userspace allocated memory */
 };
 
+/*
+ * for VMRUN_SET_USER_MEMORY_REGIONS: applied all or nothing, each slot
+ * at most once and all in the same address space.
+ */
+struct vmrun_userspace_memory_regions {
+	__u32 nregions;
+	__u32 pad;
+	struct vmrun_userspace_memory_region regions[0];
+};
+
+/* for VMRUN_GET_DIRTY_LOG */
+struct vmrun_dirty_log {
+	__u32 slot;
+	__u32 padding1;
+	union {
+		void *dirty_bitmap; /* one bit per page */
+		__u64 padding2;
+	};
+};
+
+/*
+ * for VMRUN_CLEAR_DIRTY_LOG: first_page is a multiple of 64, and so is
+ * num_pages unless the range runs to the end of the slot.
+ */
+struct vmrun_clear_dirty_log {
+	__u32 slot;
+	__u32 num_pages;
+	__u64 first_page;
+	union {
+		void *dirty_bitmap; /* one bit per page */
+		__u64 padding2;
+	};
+};
+
+/*
+ * for VMRUN_GET_MMU_STATS: counters since the VM was created, except
+ * for the current number of shadow page hash buckets.
+ */
+struct vmrun_mmu_stats {
+	__u64 mmu_page_hash_buckets;
+	__u64 mmu_page_hash_resizes;
+	__u64 mmu_page_hash_collisions;
+	__u64 max_mmu_page_hash_collisions;
+	__u64 mmu_reclaim_refaults;
+};
+
+/*
+ * Per-vCPU dirty ring, enabled with VMRUN_ENABLE_DIRTY_RING before any
+ * vCPU is created and mapped from the vcpu fd at page offset
+ * VMRUN_DIRTY_LOG_PAGE_OFFSET.  vmrun publishes an entry by setting
+ * VMRUN_DIRTY_GFN_F_DIRTY; userspace collects it and sets
+ * VMRUN_DIRTY_GFN_F_RESET, and VMRUN_RESET_DIRTY_RINGS write protects
+ * the collected pages again and hands the entries back.  A vCPU whose
+ * ring is nearly full exits with VMRUN_EXIT_DIRTY_RING_FULL.
+ */
+#define VMRUN_DIRTY_LOG_PAGE_OFFSET	64
+
+#define VMRUN_DIRTY_GFN_F_DIRTY		(1 << 0)
+#define VMRUN_DIRTY_GFN_F_RESET		(1 << 1)
+
+struct vmrun_dirty_gfn {
+	__u32 flags;
+	__u32 slot; /* as_id << 16 | slot id */
+	__u64 offset; /* in pages from the start of the slot */
+};
+
 #endif /* VMRUN_USER */